@@ -8,10 +8,17 @@
 uint64_t loadSelector;
 
 __attribute__((constructor)) static void init_aah(void) {
+    init_log();
+    init_entry_stats();
+    init_sampler();
+    init_coverage();
+    init_perf_map();
+    init_timeline();
+    
     // initialize unicorn
     unsigned int maj, min;
     uc_version(&maj, &min);
-    printf("Unicorn version %d.%d\n", maj, min);
+    LOG_INFO(LOG_EMULATOR, "Unicorn version %d.%d\n", maj, min);
     
     init_emulator_ctx_key();
     get_emulator_ctx();
@@ -35,25 +42,22 @@ hidden void sighandler (int signo, siginfo_t *si, void *data) {
     //printf("bus error at %p\n", (void*)pc);
     uint32_t should_emulate = should_emulate_at(pc);
     if (should_emulate) {
-        // get native cif for call
-        ffi_cif *cif = cif_cache_get_native((void*)pc);
+        // get entry point for call
+        const struct entry_point *entry = cif_cache_get((void*)pc);
         
-        if (cif == CIF_MARKER_WRAPPER) {
-            struct call_wrapper *wrapper = (struct call_wrapper*)cif_cache_get_arm64((void*)pc);
-            cif = wrapper->cif_native;
-        } else if (cif == CIF_MARKER_SHIM) {
+        if (entry && entry->kind == ENTRY_POINT_SHIM) {
             abort();
-        } else if (cif == NULL && mc->__ss.__rsi == loadSelector) {
+        } else if (entry == NULL && mc->__ss.__rsi == loadSelector) {
             // calling unknown load method
             cif_cache_add((void*)pc, "v@:", "+[??? load]");
-            cif = cif_cache_get_native((void*)pc);
+            entry = cif_cache_get((void*)pc);
         }
         
-        if (cif) {
+        if (entry) {
             // call arm64 entry point
-            printf("calling emulated %s at %p\n", cif_get_name((void*)pc), (void*)pc);
+            LOG_DEBUG(LOG_CALLS, "calling emulated %s at %p\n", entry->name, (void*)pc);
             struct emulator_ctx *ctx = get_emulator_ctx();
-            if (ffi_prep_closure_loc(ctx->closure, cif, call_emulated_function, (void*)pc, ctx->closure_code) != FFI_OK) {
+            if (ffi_prep_closure_loc(ctx->closure, (ffi_cif *)&entry_point_cifs(entry)->cif_native, call_emulated_function, (void*)entry, ctx->closure_code) != FFI_OK) {
                 fprintf(stderr, "ffi_prep_closure_loc failed\n");
                 abort();
             }
@@ -65,7 +69,7 @@ hidden void sighandler (int signo, siginfo_t *si, void *data) {
         } else {
             // TODO: when is this? maybe blocks or callbacks
             dladdr((void*)pc, &info);
-            printf("returning to unknown emulated %p (%s+0x%llx:%s)\n", (void*)pc, info.dli_fname, pc - (uint64_t)info.dli_fbase, info.dli_sname);
+            LOG_ERROR(LOG_CALLS, "returning to unknown emulated %p (%s+0x%llx:%s)\n", (void*)pc, info.dli_fname, pc - (uint64_t)info.dli_fbase, info.dli_sname);
             abort();
         }
     } else {
@@ -1,6 +1,7 @@
 #include <inttypes.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <time.h>
 #include <mach-o/dyld.h>
 #include <mach-o/getsect.h>
 #include <mach-o/nlist.h>
@@ -9,15 +10,76 @@
 #include <unicorn/unicorn.h>
 #include <capstone/capstone.h>
 #include <ffi.h>
+#include <objc/objc.h>
 
 #define hidden __attribute__ ((visibility ("hidden")))
 
 #include "ffi_arm64.h"
+#include "sigtable.h"
+#include "mem_intervals.h"
+#include "mem_engine.h"
+#include "emulated_ranges.h"
+#include "registers.h"
+#include "log.h"
 
 hidden void init_loader (void);
 
 void sighandler (int signo, siginfo_t *si, void *data);
 
+// direct-mapped cache of recently called native targets, per thread
+#define NATIVE_CALL_CACHE_SIZE 256
+
+struct native_call_cache_entry {
+    uint64_t pc;
+    const struct entry_point *entry;
+};
+
+// direct-mapped cache of resolved objc message sends, per thread
+#define OBJC_DISPATCH_CACHE_SIZE 256
+
+struct objc_dispatch_cache_entry {
+    const void *cls;
+    const void *sel;
+    void *imp;
+    bool emulated;
+    // shim for emulated methods, entry point to call for native ones
+    const struct entry_point *entry;
+};
+
+// why uc_emu_start returned
+enum emulator_exit {
+    EMULATOR_EXIT_RETURN,     // returned to native code
+    EMULATOR_EXIT_GATE,       // branched to a native call gate
+    EMULATOR_EXIT_FETCH_PROT, // branched to native code
+    EMULATOR_EXIT_SAMPLE,     // stopped by the sampler
+    EMULATOR_EXIT_ERROR,      // anything else, aborts
+    EMULATOR_EXIT_COUNT
+};
+
+#define EMULATOR_STATS_FAULT_RANGES 8
+
+// engine statistics, kept per context and aggregated by aah_get_emulator_stats
+struct emulator_stats {
+    uint64_t contexts; // aggregated, including freed ones
+    uint64_t emu_starts;
+    uint64_t exits[EMULATOR_EXIT_COUNT];
+    uint64_t rw_faults, fetch_faults; // unmapped or protected accesses
+    uint64_t fault_maps, fault_mapped_bytes; // regions mapped by faults
+    uint64_t remaps; // mem_remap_region
+    uint64_t emulated_ns; // in uc_emu_start
+    uint64_t native_ns; // in native calls from emulated code, excluding nested emulation
+    // most recent regions mapped by faults, the last one at (fault_range_next - 1) % EMULATOR_STATS_FAULT_RANGES
+    struct {
+        uint64_t begin, end;
+    } fault_ranges[EMULATOR_STATS_FAULT_RANGES];
+    uint32_t fault_range_next;
+};
+
+// counters only written by their own thread, read by others
+static inline void stat_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
 struct emulator_ctx {
     uc_engine *uc;
     size_t stack_size;
@@ -29,7 +91,31 @@ struct emulator_ctx {
     void *closure;
     void *closure_code;
     uc_hook instr_hook;
+    struct native_gate *gate; // gate that stopped emulation
+    struct mem_intervals mem_intervals; // mirror of the engine's mappings
+    uint32_t mem_registry_version; // registry entries already mapped
+    uint32_t mem_retirements_version; // registry retirements already unmapped
+    struct emulator_ctx *pool_next; // in the pool of unused contexts
+    time_t pool_released;
+    struct trace_ring *trace_ring; // TRACE_FILE
+    uc_hook trace_hook;
+    struct entry_stats_shard *entry_stats; // ENTRY_STATS
+    struct emulator_ctx *all_next; // in the list of all contexts, for statistics
+    struct emulator_stats stats;
+    bool in_emulation; // in uc_emu_start, accessed atomically
+    bool sample_pending; // stopped by the sampler, accessed atomically
+    uint32_t coverage_images; // images with coverage hooks
+    uint32_t coverage_unloads; // unloaded images whose hooks were deleted
+    uc_hook *coverage_hooks; // per image, 0 once deleted
+    struct timeline_buffer *timeline; // TIMELINE_FILE, of the thread that last used it
     void(*maybe_print_regs)(uc_engine*,int);
+    bool print_cache_stats;
+    uint32_t native_call_cache_generation;
+    uint64_t native_call_cache_hits, native_call_cache_misses;
+    struct native_call_cache_entry native_call_cache[NATIVE_CALL_CACHE_SIZE];
+    uint32_t objc_dispatch_cache_generation;
+    uint64_t objc_dispatch_cache_hits, objc_dispatch_cache_misses;
+    struct objc_dispatch_cache_entry objc_dispatch_cache[OBJC_DISPATCH_CACHE_SIZE];
 };
 
 hidden void init_emulator_ctx_key(void);
@@ -37,25 +123,63 @@ hidden struct emulator_ctx* get_emulator_ctx(void);
 hidden void run_emulator(struct emulator_ctx *ctx, uint64_t start_address);
 hidden void print_disasm(struct emulator_ctx *ctx, int print);
 
+// native call gates, svc instructions mapped only in the emulators
+// branching to a gate stops emulation with UC_ERR_OK instead of a fetch error
+#define NATIVE_GATE_COUNT 16384
+
+// entry, generation, sequence and calls are accessed atomically
+struct native_gate {
+    uint64_t target;
+    // resolved on first call and when the cif cache generation changes
+    const struct entry_point *entry;
+    uint32_t generation; // cif cache generation + 1, 0 if unresolved
+    uint32_t sequence; // seqlock for entry and generation, odd while writing
+    uint64_t calls;
+};
+
+hidden void native_gates_map(struct emulator_ctx *ctx);
+// false with BIND_NATIVE_GATES=0: only bind lazy symbols to shims to gates
+hidden bool native_gates_bind_all(void);
+// returns the gate's address, or 0 if there are no gates left
+hidden uint64_t native_gate_for_address(uint64_t address);
+// pc is after the svc, returns NULL if it's not a gate
+hidden struct native_gate * native_gate_at(uint64_t pc);
+// NULL if the target has no entry point
+hidden const struct entry_point * native_gate_entry(struct native_gate *gate);
+// unbinds gates to targets in [begin, end), for unloaded images
+hidden void native_gates_remove_range(uint64_t begin, uint64_t end);
+
 #define AAH_RANGE_EMULATE (1 << 0)
 #define AAH_RANGE_LIBCPP (1 << 1)
 
 hidden int should_emulate_image(const struct mach_header_64 *mh);
 hidden uint32_t should_emulate_at(uint64_t address);
 
-hidden bool mem_map_region_containing(uc_engine *uc, uint64_t address, uint32_t perms);
-hidden bool mem_is_mapped(uc_engine *uc, uint64_t address, size_t size, uint32_t perms);
+// map and unmap host memory at the same address, keeping ctx->mem_intervals in sync
+hidden uc_err mem_map_ptr(struct emulator_ctx *ctx, uint64_t address, uint64_t size, uint32_t perms);
+hidden uc_err mem_unmap(struct emulator_ctx *ctx, uint64_t address, uint64_t size);
+// maps the host region containing address, and adds it to the registry
+hidden bool mem_map_region_containing(struct emulator_ctx *ctx, uint64_t address, uint32_t perms);
+// maps regions added to the registry since the last sync, and unmaps retired ones, cheap if there are none
+hidden void mem_registry_sync(struct emulator_ctx *ctx);
+// retires registry entries overlapping a range the host unmapped, like an unloaded image
+hidden void mem_registry_remove(uint64_t begin, uint64_t end);
+// unmaps whatever the engine maps in the range
+hidden void mem_unmap_range(struct emulator_ctx *ctx, uint64_t begin, uint64_t end);
+hidden bool mem_is_mapped(struct emulator_ctx *ctx, uint64_t address, size_t size, uint32_t perms);
 hidden void print_mem_info(void *ptr);
 
+// TRACE_FILE: records emulated blocks into a per-context ring, see trace.h
+// attach when a context is created or leased, detach once its engine is freed
+hidden void trace_attach(struct emulator_ctx *ctx);
+hidden void trace_detach(struct emulator_ctx *ctx);
+// emulated images, from the dyld callbacks
+hidden void trace_add_image(const struct mach_header_64 *mh, const char *path);
+hidden void trace_remove_image(const struct mach_header_64 *mh);
+
 #define WRAPPER_ARGS (void *rvalue, void **avalues)
 typedef uint64_t (*wrapper_ptr)WRAPPER_ARGS;
 
-struct call_wrapper {
-    ffi_cif *cif_native;
-    ffi_cif_arm64 *cif_arm64;
-    wrapper_ptr emulated_to_native, native_to_emulated;
-};
-
 struct native_call_context {
     ffi_cif_arm64 *cif_arm64;
     ffi_cif *cif_native;
@@ -66,26 +190,116 @@ struct native_call_context {
 
 typedef uint64_t (*shim_ptr)(uc_engine*, struct native_call_context*);
 
+enum entry_point_kind {
+    ENTRY_POINT_CIF,        // plain method signature
+    ENTRY_POINT_SHIM,       // $shim
+    ENTRY_POINT_WRAPPER,    // <method signature>wrapper
+};
+
+// prepared cifs, shared by all entry points with the same signature
+struct prepared_cifs {
+    ffi_cif cif_native;
+    ffi_cif_arm64 cif_arm64;
+};
+
+// everything known about a function entry point, one cache line
+// immutable once added to the cif cache, overwriting replaces the whole entry
+// except for cifs, which are prepared on first use by entry_point_cifs
+struct entry_point {
+    uint32_t kind;
+    uint32_t index; // dense, in order of creation, for per-entry statistics
+    void *address;
+    const char *name;
+    const char *signature; // must outlive the entry, followed by ">name" for wrappers
+    const struct prepared_cifs *cifs;
+    shim_ptr shim;
+    wrapper_ptr emulated_to_native, native_to_emulated;
+} __attribute__((aligned(64)));
+
+// ENTRY_STATS=1: call counts and inclusive times per entry point and thread
+enum entry_stats_direction {
+    ENTRY_STATS_NATIVE,   // called from emulated code: native function, shim or wrapper
+    ENTRY_STATS_EMULATED, // called from native code
+    ENTRY_STATS_DIRECTIONS
+};
+extern hidden bool entry_stats_enabled;
+hidden void init_entry_stats(void);
+hidden uint64_t entry_stats_now(void);
+// start is from entry_stats_now, before the call
+hidden void entry_stats_record(struct emulator_ctx *ctx, const struct entry_point *entry, enum entry_stats_direction direction, uint64_t start);
+// merges a context's counters into the totals before it's freed
+hidden void entry_stats_retire(struct emulator_ctx *ctx);
+// prints entry points sorted by total time, can be called from the debugger
+void aah_print_entry_stats(void);
+// sums the engine statistics of all contexts, including freed ones
+void aah_get_emulator_stats(struct emulator_stats *stats);
+// EMULATOR_STATS=1 prints them at exit
+void aah_print_emulator_stats(void);
+
+// SAMPLE_FILE=path: samples emulated stacks, written as folded stacks at exit
+hidden void init_sampler(void);
+// stops contexts that are emulating, to be sampled by run_emulator
+hidden void emulator_ctx_request_samples(void);
+// records the stopped context's guest stack
+hidden void sampler_record(struct emulator_ctx *ctx);
+// names emulated functions that aren't in the image's symbol table, cheap if not sampling
+hidden void sampler_add_name(uint64_t address, const char *name);
+
+// COVERAGE_FILE=path: counts entries into emulated blocks, see coverage.h
+hidden void init_coverage(void);
+hidden void coverage_add_image(const struct mach_header_64 *mh, uint64_t text_begin, uint64_t text_size);
+// stops counting, engines delete the hooks on their next sync
+hidden void coverage_remove_image(const struct mach_header_64 *mh);
+// adds hooks for images added since the last sync, cheap if there are none
+hidden void coverage_sync(struct emulator_ctx *ctx);
+
+// PERF_MAP=1: symbols for host profilers in /tmp/perf-<pid>.map
+hidden void init_perf_map(void);
+hidden void perf_map_add_image(const struct mach_header_64 *mh, intptr_t vmaddr_slide);
+// names emulated functions that aren't in the image's symbol table
+hidden void perf_map_add_name(uint64_t address, const char *name);
+// labels the code caches of engines opened since the last call
+hidden void perf_map_add_code_caches(void);
+
+// TIMELINE_FILE=path: begin ('B'), end ('E') and complete ('X') events as Chrome trace JSON
+extern hidden bool timeline_enabled;
+hidden void init_timeline(void);
+// category and name must outlive the process
+hidden void timeline_record(struct emulator_ctx *ctx, char phase, const char *category, const char *name);
+// a slice from start (mach_absolute_time, like entry_stats_now) to now,
+// for calls that may be unwound before they could record an end
+hidden void timeline_record_complete(struct emulator_ctx *ctx, const char *category, const char *name, uint64_t start);
+
 hidden void init_cif (void);
 hidden void cif_cache_add_new(void *address, const char *method_signature, const char *name); // doesn't overwrite
 hidden void cif_cache_add(void *address, const char *method_signature, const char *name); // overwrites
 hidden const char * cif_get_name(void *address);
+// parses and prepares the signature on first use, NULL for shims
+hidden const struct prepared_cifs * entry_point_cifs(const struct entry_point *entry);
 hidden void load_objc_entrypoints(const struct mach_header_64 *mh, intptr_t vmaddr_slide);
 hidden void* resolve_symbol(const char *libname, const char *symname);
 hidden void cif_cache_add_class(const char *className);
-hidden ffi_cif * cif_cache_get_native(void *address);
-hidden ffi_cif_arm64 * cif_cache_get_arm64(void *address);
-hidden uint64_t call_native(uc_engine *uc, uint64_t pc);
+hidden const struct entry_point * cif_cache_get(void *address);
+// removes entries in [begin, end), for unloaded images
+hidden void cif_cache_remove_range(uint64_t begin, uint64_t end);
+// changes whenever a cif cache entry is replaced or removed
+hidden uint32_t cif_cache_get_generation(void);
+// call when methods are added or replaced, or new images are loaded
+hidden void objc_dispatch_cache_invalidate(void);
+hidden uint64_t call_native(struct emulator_ctx *emulator, uint64_t pc);
+hidden uint64_t call_native_gate(struct emulator_ctx *emulator, struct native_gate *gate);
+hidden uint64_t call_native_entry(struct emulator_ctx *emulator, const struct entry_point *entry, uint64_t pc);
 hidden void call_native_with_context(uc_engine *uc, struct native_call_context *ctx);
-hidden void call_emulated_function (ffi_cif *cif, void *ret, void **args, void *address);
+hidden uint64_t call_entry_point(uc_engine *uc, const struct entry_point *entry, struct native_call_context *ctx);
+// closure function, user_data is the entry point
+hidden void call_emulated_function (ffi_cif *cif, void *ret, void **args, void *user_data);
 hidden const char * lookup_method_signature(const char *lib_name, const char *sym_name);
 // fixed_args is # of fixed args in variadic functions, -1 otherwise
 hidden int prep_cifs(ffi_cif *cif, ffi_cif_arm64 *cif_arm64, const char *method_signature, int fixed_args);
 extern const char *CIF_LIB_OBJC_SHIMS;
-
-#define CIF_MARKER_SHIM ((ffi_cif *)1)
-#define CIF_MARKER_WRAPPER ((ffi_cif *)2)
-#define CIF_IS_CIF(cif) (((uint64_t)cif) > 15)
+hidden void init_objc_shims(const struct sigtable *table, const struct sigtable_library *shims);
+// returns the shim signature for a method, or NULL if no shim applies
+hidden const char * lookup_objc_shim_signature(bool meta, const char *class_name, SEL sel);
 
 #define SHIM_RETURN 0
 #define SHIMDEF(name) __attribute__((visibility("default"))) uint64_t aah_shim_ ## name (uc_engine *uc, struct native_call_context *ctx)
@@ -4,24 +4,60 @@
 #include <string.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <os/lock.h>
+#include <stdatomic.h>
 #include "blocks.h"
+#include "cif_table.h"
+#include "sigtable.h"
 
-static CFMutableDictionaryRef cif_cache_native = NULL;
-static CFMutableDictionaryRef cif_cache_arm64 = NULL;
-static CFMutableDictionaryRef cif_cache_names = NULL;
+// address -> struct entry_point
+// lookups are lock-free, cif_cache_lock only serializes writers
+static struct cif_table *cif_cache = NULL;
 static os_unfair_lock cif_cache_lock = OS_UNFAIR_LOCK_INIT;
-static CFDictionaryRef cif_sig_table = NULL;
+static _Atomic uint32_t cif_cache_next_index = 0;
+// bumped when an entry is replaced or removed, invalidates per-thread caches
+static _Atomic uint32_t cif_cache_generation = 0;
+static const struct sigtable *cif_sig_table = NULL;
+
+// signature -> struct prepared_cifs
+static CFMutableDictionaryRef cif_intern_table = NULL;
+static os_unfair_lock cif_intern_lock = OS_UNFAIR_LOCK_INIT;
+// "M{encoding}" or "S{encoding}" (skip_members) -> struct or array ffi_type
+static CFMutableDictionaryRef ffi_type_intern_table = NULL;
+static os_unfair_lock ffi_type_intern_lock = OS_UNFAIR_LOCK_INIT;
+
+// entries with signatures, entries prepared on first use, distinct signatures
+static _Atomic uint32_t cif_stats_registered = 0, cif_stats_prepared = 0, cif_stats_interned = 0;
 
 const char *CIF_LIB_OBJC_SHIMS = "objc shims";
 
 //#define P(...) printf(__VA_ARGS__)
 #define P(...)
 
+static Boolean cstring_equal(const void *a, const void *b) {
+    return strcmp(a, b) == 0;
+}
+
+static CFHashCode cstring_hash(const void *s) {
+    return sigtable_hash_mix(sigtable_hash_string(s), 0);
+}
+
+static void print_cif_stats(void) {
+    printf("cif cache: %u entries registered, %u prepared, %u distinct signatures\n",
+           atomic_load(&cif_stats_registered), atomic_load(&cif_stats_prepared), atomic_load(&cif_stats_interned));
+}
+
 hidden void init_cif() {
     // initialize cif cache
-    cif_cache_native = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
-    cif_cache_arm64 = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
-    cif_cache_names = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    cif_cache = cif_table_create(4096);
+    
+    // keys are owned by the tables and never removed
+    CFDictionaryKeyCallBacks cstring_keys = {.equal = cstring_equal, .hash = cstring_hash};
+    cif_intern_table = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &cstring_keys, NULL);
+    ffi_type_intern_table = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &cstring_keys, NULL);
+    
+    if (getenv("PRINT_CACHE_STATS") && strtol(getenv("PRINT_CACHE_STATS"), NULL, 10)) {
+        atexit(print_cif_stats);
+    }
 
     // load method signature table
     Dl_info info;
@@ -33,7 +69,7 @@ hidden void init_cif() {
     uint32_t num_images = _dyld_image_count();
     for(uint32_t i = 0; i < num_images; i++) {
         if (_dyld_get_image_header(i) == info.dli_fbase) {
-            printf("Found myself at %d\n", i);
+            LOG_DEBUG(LOG_CIF, "Found myself at %d\n", i);
             image_index = i;
             break;
         }
@@ -42,9 +78,14 @@ hidden void init_cif() {
     const struct section_64 *sig_table = getsectbynamefromheader_64(info.dli_fbase, SEG_DATA, "__aah_meth_sigs");
     void *sig_bytes = (void *)((uintptr_t)vmaddr_slide + sig_table->addr);
     size_t sig_length = sig_table->size;
-    CFDataRef sig_data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, sig_bytes, sig_length, kCFAllocatorNull);
-    cif_sig_table = CFPropertyListCreateWithData(kCFAllocatorDefault, sig_data, kCFPropertyListImmutable, NULL, NULL);
-    CFRelease(sig_data);
+    cif_sig_table = sigtable_open(sig_bytes, sig_length);
+    if (cif_sig_table == NULL) {
+        fprintf(stderr, "invalid method signature table\n");
+        abort();
+    }
+    
+    // index objc shims by selector
+    init_objc_shims(cif_sig_table, sigtable_find_library(cif_sig_table, CIF_LIB_OBJC_SHIMS));
 }
 
 static const char * skip_struct(const char *ms, char opening, char closing) {
@@ -55,6 +96,31 @@ static const char * skip_struct(const char *ms, char opening, char closing) {
     return ms;
 }
 
+// returns the interned type for encoding, type is freed if one already exists
+static ffi_type * intern_ffi_type(const char *encoding, size_t length, bool skip_members, ffi_type *type) {
+    char *key = alloca(length + 2);
+    key[0] = skip_members ? 'S' : 'M';
+    memcpy(key + 1, encoding, length);
+    key[length + 1] = '\0';
+    
+    os_unfair_lock_lock(&ffi_type_intern_lock);
+    ffi_type *interned = (ffi_type *)CFDictionaryGetValue(ffi_type_intern_table, key);
+    if (interned == NULL) {
+        // lay out now: interned types are shared and must not be modified by ffi_prep_cif later
+        ffi_cif layout_cif;
+        ffi_prep_cif(&layout_cif, FFI_DEFAULT_ABI, 0, type, NULL);
+        CFDictionarySetValue(ffi_type_intern_table, strdup(key), type);
+        interned = type;
+    }
+    os_unfair_lock_unlock(&ffi_type_intern_lock);
+    if (interned != type) {
+        // members are interned too
+        free(type->elements);
+        free(type);
+    }
+    return interned;
+}
+
 static ffi_type *next_type(char const ** method_signature, const char *prefix, bool skip_members) {
     ffi_type *type = NULL;
     const char *ms = *method_signature;
@@ -141,6 +207,7 @@ next_type_1:
             break;
         case '[': { // array
             // doesn't appear in method signatures, but could be in structures
+            const char *encoding = ms - 1;
             unsigned long nitems = strtoul(ms, (char**)&ms, 10);
             P("%sarray of %d\n", prefix, (int)nitems);
             ffi_type *element_type = NULL;
@@ -158,9 +225,11 @@ next_type_1:
             }
             type->elements[nitems] = NULL;
             if (*ms++ != ']') fprintf(stderr, "missing array end\n");
+            type = intern_ffi_type(encoding, ms - encoding, skip_members, type);
             } break;
         case '{': { // struct
             P("struct\n");
+            const char *encoding = ms - 1;
             const char *struct_end = skip_struct(ms, '{', '}');
             char *struct_equals = strchr(ms, '=');
             if (struct_equals != NULL && struct_equals < struct_end) {
@@ -183,6 +252,7 @@ next_type_1:
             }
             ms++;
             type->elements[elem] = NULL;
+            type = intern_ffi_type(encoding, ms - encoding, skip_members, type);
         } break;
         case '(': {
             P("union\n");
@@ -190,7 +260,7 @@ next_type_1:
             ms = strchr(ms, '=') + 1;
             ffi_type *largest_type = NULL;
             while(*ms != ')') {
-                // FIXME: structs will be leaked
+                // member types are interned, so the smaller ones aren't leaked
                 type = next_type(&ms, "struct member: ", skip_members);
                 if (largest_type == NULL || largest_type->size < type->size) {
                     largest_type = type;
@@ -270,53 +340,101 @@ hidden int prep_cifs(ffi_cif *cif, ffi_cif_arm64 *cif_arm64, const char *method_
         argtypes[nargs++] = next_type(&ms, "arg: ", false);
     }
     
+    ffi_status status;
     if (fixed_args == -1) {
         ffi_prep_cif(cif, FFI_DEFAULT_ABI, nargs, rtype, argtypes);
-        ffi_prep_cif_arm64(cif_arm64, 0, nargs, nargs, rtype, argtypes);
+        status = ffi_prep_cif_arm64(cif_arm64, 0, nargs, nargs, rtype, argtypes);
     } else {
         ffi_prep_cif_var(cif, FFI_DEFAULT_ABI, fixed_args, nargs, rtype, argtypes);
-        ffi_prep_cif_arm64(cif_arm64, 1, fixed_args, nargs, rtype, argtypes);
+        status = ffi_prep_cif_arm64(cif_arm64, 1, fixed_args, nargs, rtype, argtypes);
+    }
+    if (status != FFI_OK) {
+        // without a plan, arguments can't be placed
+        fprintf(stderr, "couldn't prepare arm64 cif for %s\n", method_signature);
+        return 0;
     }
 
     P("cif done, had %u args\n", nargs);
     return 1;
 }
 
-hidden ffi_cif * cif_cache_get_native(void *address) {
-    os_unfair_lock_lock(&cif_cache_lock);
-    ffi_cif *cif = (ffi_cif *)CFDictionaryGetValue(cif_cache_native, address);
-    os_unfair_lock_unlock(&cif_cache_lock);
-    return cif;
+// length is the length of the signature, which may be followed by other characters
+static const struct prepared_cifs * intern_cifs(const char *method_signature, size_t length) {
+    char *key = alloca(length + 1);
+    memcpy(key, method_signature, length);
+    key[length] = '\0';
+    
+    os_unfair_lock_lock(&cif_intern_lock);
+    struct prepared_cifs *prepared = (struct prepared_cifs *)CFDictionaryGetValue(cif_intern_table, key);
+    if (prepared == NULL) {
+        prepared = malloc(sizeof(struct prepared_cifs));
+        if (!prep_cifs(&prepared->cif_native, &prepared->cif_arm64, key, -1)) {
+            fprintf(stderr, "couldn't prep_cifs");
+            abort();
+        }
+        CFDictionarySetValue(cif_intern_table, strdup(key), prepared);
+        atomic_fetch_add_explicit(&cif_stats_interned, 1, memory_order_relaxed);
+    }
+    os_unfair_lock_unlock(&cif_intern_lock);
+    return prepared;
 }
 
-hidden ffi_cif_arm64 * cif_cache_get_arm64(void *address) {
-    os_unfair_lock_lock(&cif_cache_lock);
-    ffi_cif_arm64 *cif = (ffi_cif_arm64 *)CFDictionaryGetValue(cif_cache_arm64, address);
-    os_unfair_lock_unlock(&cif_cache_lock);
-    return cif;
+hidden const struct prepared_cifs * entry_point_cifs(const struct entry_point *entry) {
+    const struct prepared_cifs *cifs = __atomic_load_n(&entry->cifs, __ATOMIC_ACQUIRE);
+    if (cifs == NULL && entry->signature) {
+        // interning returns the same cifs to racing threads, count only once
+        // wrapper signatures are followed by ">name", '>' may also appear in their types
+        size_t length = entry->kind == ENTRY_POINT_WRAPPER ? strrchr(entry->signature, '>') - entry->signature : strlen(entry->signature);
+        cifs = intern_cifs(entry->signature, length);
+        const struct prepared_cifs *expected = NULL;
+        if (__atomic_compare_exchange_n((const struct prepared_cifs **)&entry->cifs, &expected, cifs, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            atomic_fetch_add_explicit(&cif_stats_prepared, 1, memory_order_relaxed);
+        }
+    }
+    return cifs;
+}
+
+hidden const struct entry_point * cif_cache_get(void *address) {
+    return cif_table_get(cif_cache, (uint64_t)address);
+}
+
+static struct entry_point * entry_point_new(enum entry_point_kind kind, void *address, const char *name) {
+    struct entry_point *entry = NULL;
+    if (posix_memalign((void**)&entry, sizeof(struct entry_point), sizeof(struct entry_point))) {
+        fprintf(stderr, "couldn't allocate entry point\n");
+        abort();
+    }
+    memset(entry, 0, sizeof(struct entry_point));
+    entry->kind = kind;
+    entry->address = address;
+    entry->name = name;
+    return entry;
 }
 
 hidden void cif_cache_add_new(void *address, const char *method_signature, const char *name) {
-    os_unfair_lock_lock(&cif_cache_lock);
-    Boolean hasValue = CFDictionaryContainsKey(cif_cache_native, address);
-    os_unfair_lock_unlock(&cif_cache_lock);
-    if (hasValue) {
+    if (cif_cache == NULL || cif_cache_get(address)) {
         return;
     }
     cif_cache_add(address, method_signature, name);
 }
 
+// same calls, names may differ
+static bool entry_point_equivalent(const struct entry_point *a, const struct entry_point *b) {
+    if (a->kind != b->kind || a->shim != b->shim || a->emulated_to_native != b->emulated_to_native || a->native_to_emulated != b->native_to_emulated) {
+        return false;
+    }
+    return a->signature == b->signature || (a->signature && b->signature && strcmp(a->signature, b->signature) == 0);
+}
+
 hidden void cif_cache_add(void *address, const char *method_signature, const char *name) {
-    if (cif_cache_native == NULL) {
+    if (cif_cache == NULL) {
         // too early
         return;
     }
-    ffi_cif *cif_native = malloc(sizeof(ffi_cif));
-    ffi_cif_arm64 *cif_arm64 = malloc(sizeof(ffi_cif_arm64));
+    struct entry_point *entry = NULL;
+    bool overwrite = true;
     if (method_signature == NULL) {
         // can't add symbol without signature
-        free(cif_native);
-        free(cif_arm64);
         return;
     } else if (method_signature[0] == '$') {
         // shim
@@ -324,107 +442,116 @@ hidden void cif_cache_add(void *address, const char *method_signature, const cha
         snprintf(shim_name, 128, "aah_shim_%s", method_signature+1);
         void *shim = dlsym(RTLD_SELF, shim_name);
         if (shim == NULL) {
-            printf("shim not found: %s, might crash later\n", shim_name);
+            LOG_WARN(LOG_CIF, "shim not found: %s, might crash later\n", shim_name);
         }
-        os_unfair_lock_lock(&cif_cache_lock);
-        CFDictionarySetValue(cif_cache_native, address, CIF_MARKER_SHIM);
-        CFDictionarySetValue(cif_cache_arm64, address, shim);
-        CFDictionarySetValue(cif_cache_names, address, name);
-        os_unfair_lock_unlock(&cif_cache_lock);
+        entry = entry_point_new(ENTRY_POINT_SHIM, address, name);
+        entry->shim = (shim_ptr)shim;
     } else if (method_signature[0] == '<') {
         // wrapper
-        struct call_wrapper *wrapper = calloc(1, sizeof(struct call_wrapper));
-        const char *wrapper_name = strchr(method_signature, '>')+1;
+        entry = entry_point_new(ENTRY_POINT_WRAPPER, address, name);
+        const char *wrapper_name = strrchr(method_signature, '>')+1;
         char shim_name[128];
         snprintf(shim_name, 128, "aah_We2n_%s", wrapper_name);
-        wrapper->emulated_to_native = dlsym(RTLD_SELF, shim_name);
+        entry->emulated_to_native = dlsym(RTLD_SELF, shim_name);
         snprintf(shim_name, 128, "aah_Wn2e_%s", wrapper_name);
-        wrapper->native_to_emulated = dlsym(RTLD_SELF, shim_name);
-        if (wrapper->native_to_emulated == NULL && wrapper->emulated_to_native == NULL) {
-            printf("Could not find wrapper symbols for %s (%s)\n", name, wrapper_name);
+        entry->native_to_emulated = dlsym(RTLD_SELF, shim_name);
+        if (entry->native_to_emulated == NULL && entry->emulated_to_native == NULL) {
+            LOG_ERROR(LOG_CIF, "Could not find wrapper symbols for %s (%s)\n", name, wrapper_name);
             abort();
         }
-        if (prep_cifs(cif_native, cif_arm64, method_signature+1, -1)) {
-            wrapper->cif_native = cif_native;
-            wrapper->cif_arm64 = cif_arm64;
-            os_unfair_lock_lock(&cif_cache_lock);
-            CFDictionarySetValue(cif_cache_native, address, CIF_MARKER_WRAPPER);
-            CFDictionarySetValue(cif_cache_arm64, address, wrapper);
-            CFDictionarySetValue(cif_cache_names, address, name);
-            os_unfair_lock_unlock(&cif_cache_lock);
-        } else {
-            fprintf(stderr, "couldn't prep_cifs");
-            abort();
-        }
-    } else if (prep_cifs(cif_native, cif_arm64, method_signature, -1)) {
-        os_unfair_lock_lock(&cif_cache_lock);
-        if (!CFDictionaryContainsKey(cif_cache_native, address)) {
-            CFDictionarySetValue(cif_cache_native, address, cif_native);
-            CFDictionarySetValue(cif_cache_arm64, address, cif_arm64);
-            CFDictionarySetValue(cif_cache_names, address, name);
-        }
-        os_unfair_lock_unlock(&cif_cache_lock);
+        entry->signature = method_signature+1;
     } else {
-        fprintf(stderr, "couldn't prep_cifs");
-        abort();
+        // plain signatures don't replace existing entries
+        overwrite = false;
+        entry = entry_point_new(ENTRY_POINT_CIF, address, name);
+        // parsed on first call
+        entry->signature = method_signature;
+    }
+    
+    os_unfair_lock_lock(&cif_cache_lock);
+    // replaced entries are leaked, other threads may still be using them
+    const struct entry_point *previous = cif_cache_get(address);
+    if (previous && (!overwrite || entry_point_equivalent(previous, entry))) {
+        // already had one, replacing it would only invalidate the call caches
+        os_unfair_lock_unlock(&cif_cache_lock);
+        free(entry);
+        return;
+    }
+    // only entries that are added take an index, before they are published
+    entry->index = atomic_fetch_add_explicit(&cif_cache_next_index, 1, memory_order_relaxed);
+    cif_table_set(cif_cache, (uint64_t)address, entry, true);
+    if (previous) {
+        atomic_fetch_add_explicit(&cif_cache_generation, 1, memory_order_release);
+    }
+    os_unfair_lock_unlock(&cif_cache_lock);
+    if (entry->signature) {
+        atomic_fetch_add_explicit(&cif_stats_registered, 1, memory_order_relaxed);
     }
+    sampler_add_name((uint64_t)address, name);
+    perf_map_add_name((uint64_t)address, name);
 }
 
-hidden const char * cif_get_name(void *address) {
-    const char *name = NULL;
+hidden void cif_cache_remove_range(uint64_t begin, uint64_t end) {
+    if (cif_cache == NULL) {
+        return;
+    }
     os_unfair_lock_lock(&cif_cache_lock);
-    name = CFDictionaryGetValue(cif_cache_names, address);
+    // removed entries are leaked like replaced ones
+    uint32_t removed = cif_table_remove_range(cif_cache, begin, end);
+    if (removed) {
+        // flushes native call caches and gates that still point at them
+        atomic_fetch_add_explicit(&cif_cache_generation, 1, memory_order_release);
+    }
     os_unfair_lock_unlock(&cif_cache_lock);
-    return name;
+    LOG_DEBUG(LOG_CIF, "removed %u entry points in %p-%p\n", removed, (void*)begin, (void*)end);
+}
+
+hidden uint32_t cif_cache_get_generation() {
+    return atomic_load_explicit(&cif_cache_generation, memory_order_acquire);
+}
+
+static const struct entry_point * native_call_cache_get(struct emulator_ctx *emulator, uint64_t pc) {
+    // read the generation before the cif cache, so a concurrent replacement flushes on the next call
+    uint32_t generation = cif_cache_get_generation();
+    if (emulator->native_call_cache_generation != generation) {
+        memset(emulator->native_call_cache, 0, sizeof(emulator->native_call_cache));
+        emulator->native_call_cache_generation = generation;
+    }
+    struct native_call_cache_entry *cached = &emulator->native_call_cache[(pc >> 2) & (NATIVE_CALL_CACHE_SIZE - 1)];
+    if (cached->pc == pc) {
+        emulator->native_call_cache_hits++;
+        return cached->entry;
+    }
+    emulator->native_call_cache_misses++;
+    const struct entry_point *entry = cif_cache_get((void*)pc);
+    if (entry) {
+        cached->pc = pc;
+        cached->entry = entry;
+    }
+    return entry;
+}
+
+hidden const char * cif_get_name(void *address) {
+    const struct entry_point *entry = cif_cache_get(address);
+    return entry ? entry->name : NULL;
 }
 
 hidden const char * lookup_method_signature(const char *lib_name, const char *sym_name) {
-    // read local table of method signatures
-    CFStringRef lib_name_cf = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, lib_name, kCFStringEncodingUTF8, kCFAllocatorNull);
-    CFDictionaryRef lib_table = CFDictionaryGetValue(cif_sig_table, lib_name_cf);
-    CFRelease(lib_name_cf);
+    // read local table of method signatures, aliases are already resolved
+    const struct sigtable_library *lib_table = sigtable_find_library(cif_sig_table, lib_name);
     if (lib_table == NULL && strrchr(lib_name, '/')) {
         // try basename
-        lib_name_cf = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, strrchr(lib_name, '/')+1, kCFStringEncodingUTF8, kCFAllocatorNull);
-        lib_table = CFDictionaryGetValue(cif_sig_table, lib_name_cf);
-        CFRelease(lib_name_cf);
+        lib_table = sigtable_find_library(cif_sig_table, strrchr(lib_name, '/')+1);
     }
     if (lib_table == NULL) {
-        printf("Library not found in table: %s\n", lib_name);
+        LOG_DEBUG(LOG_CIF, "Library not found in table: %s\n", lib_name);
         return NULL;
     }
-    if (CFGetTypeID(lib_table) == CFStringGetTypeID()) {
-        // library redirect
-        lib_table = CFDictionaryGetValue(cif_sig_table, lib_table);
-    }
-    CFStringRef sym_name_cf = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, sym_name, kCFStringEncodingUTF8, kCFAllocatorNull);
-    CFStringRef signature = CFDictionaryGetValue(lib_table, sym_name_cf);
-    CFRelease(sym_name_cf);
+    const char *signature = sigtable_lookup(cif_sig_table, lib_table, sym_name);
     if (signature == NULL) {
-        if (lib_name == CIF_LIB_OBJC_SHIMS) {
-            // look for shim without class name
-            if (strncmp(sym_name+1, "[* ", 3)) {
-                size_t size = strlen(sym_name)+1;
-                char *method_name = alloca(size);
-                method_name[0] = sym_name[0];
-                method_name[1] = '\0';
-                strcat(method_name, "[*");
-                strcat(method_name, strchr(sym_name, ' '));
-                return lookup_method_signature(CIF_LIB_OBJC_SHIMS, method_name);
-            }
-        } else {
-            printf("Symbol %s not found in table for library %s\n", sym_name, lib_name);
-        }
-        return NULL;
-    }
-    const char *ms = CFStringGetCStringPtr(signature, kCFStringEncodingUTF8);
-    if (ms == NULL) {
-        char buf[512];
-        printf("leaking string\n");
-        CFStringGetCString(signature, buf, sizeof buf, kCFStringEncodingUTF8);
-        ms = strdup(buf); // will leak
+        LOG_DEBUG(LOG_CIF, "Symbol %s not found in table for library %s\n", sym_name, lib_name);
     }
-    return ms;
+    return signature;
 }
 
 hidden void call_native_function(ffi_cif_arm64 *cif_arm64, void *rvalue, void **avalues, void * user_data) {
@@ -443,8 +570,8 @@ hidden void call_native_with_context(uc_engine *uc, struct native_call_context *
     void *ret = NULL;
     int rflags = arm64_rflags_for_type(ctx->cif_arm64->rtype);
     if (rflags & AARCH64_RET_IN_MEM) {
-        uc_reg_read(uc, UC_ARM64_REG_X8, &ret);
-        printf("returning in x8: %p\n", ret);
+        ret = (void*)ctx->arm64_call_context->x[8];
+        LOG_DEBUG(LOG_CALLS, "returning in x8: %p\n", ret);
     } else if (rflags & AARCH64_RET_NEED_COPY) {
         abort();
     } else if (ctx->cif_arm64->rtype->type != FFI_TYPE_VOID) {
@@ -460,7 +587,8 @@ hidden void call_native_with_context(uc_engine *uc, struct native_call_context *
         case AARCH64_RET_VOID:
             break;
         case AARCH64_RET_INT128:
-            uc_reg_write(uc, UC_ARM64_REG_X1, ret+8);
+            reg_write_range(uc, UC_ARM64_REG_X0, 2, ret, 8);
+            break;
         case AARCH64_RET_INT64:
             uc_reg_write(uc, UC_ARM64_REG_X0, ret);
             break;
@@ -492,107 +620,131 @@ hidden void call_native_with_context(uc_engine *uc, struct native_call_context *
             break;
     
         case AARCH64_RET_S4:
-            uc_reg_write(uc, UC_ARM64_REG_S3, ret+12);
         case AARCH64_RET_S3:
-            uc_reg_write(uc, UC_ARM64_REG_S2, ret+8);
         case AARCH64_RET_S2:
-            uc_reg_write(uc, UC_ARM64_REG_S1, ret+4);
         case AARCH64_RET_S1:
-            uc_reg_write(uc, UC_ARM64_REG_S0, ret);
+            reg_write_range(uc, UC_ARM64_REG_S0, 4 - (rflags & 3), ret, 4);
             break;
     
         case AARCH64_RET_D4:
-            uc_reg_write(uc, UC_ARM64_REG_D3, ret+24);
         case AARCH64_RET_D3:
-            uc_reg_write(uc, UC_ARM64_REG_D2, ret+16);
         case AARCH64_RET_D2:
-            uc_reg_write(uc, UC_ARM64_REG_D1, ret+8);
         case AARCH64_RET_D1:
-            uc_reg_write(uc, UC_ARM64_REG_D0, ret);
+            reg_write_range(uc, UC_ARM64_REG_D0, 4 - (rflags & 3), ret, 8);
             break;
     
         case AARCH64_RET_Q4:
-            uc_reg_write(uc, UC_ARM64_REG_Q3, ret+48);
         case AARCH64_RET_Q3:
-            uc_reg_write(uc, UC_ARM64_REG_Q2, ret+32);
         case AARCH64_RET_Q2:
-            uc_reg_write(uc, UC_ARM64_REG_Q1, ret+16);
         case AARCH64_RET_Q1:
-            uc_reg_write(uc, UC_ARM64_REG_Q0, ret);
+            reg_write_range(uc, UC_ARM64_REG_Q0, 4 - (rflags & 3), ret, 16);
             break;
         default:
-            printf("don't know how to return\n");
+            LOG_ERROR(LOG_CALLS, "don't know how to return\n");
             abort();
     }
 }
 
-hidden uint64_t call_native(uc_engine *uc, uint64_t pc) {
-    // call context
-    struct arm64_call_context call_context;
-    uint64_t sp;
-    uc_reg_read(uc, UC_ARM64_REG_SP, &sp);
-    uc_reg_read(uc, UC_ARM64_REG_X0, &call_context.x[0]);
-    uc_reg_read(uc, UC_ARM64_REG_X1, &call_context.x[1]);
-    uc_reg_read(uc, UC_ARM64_REG_X2, &call_context.x[2]);
-    uc_reg_read(uc, UC_ARM64_REG_X3, &call_context.x[3]);
-    uc_reg_read(uc, UC_ARM64_REG_X4, &call_context.x[4]);
-    uc_reg_read(uc, UC_ARM64_REG_X5, &call_context.x[5]);
-    uc_reg_read(uc, UC_ARM64_REG_X6, &call_context.x[6]);
-    uc_reg_read(uc, UC_ARM64_REG_X7, &call_context.x[7]);
-    uc_reg_read(uc, UC_ARM64_REG_X8, &call_context.x[8]);
-    uc_reg_read(uc, UC_ARM64_REG_V0, &call_context.v[0]);
-    uc_reg_read(uc, UC_ARM64_REG_V1, &call_context.v[1]);
-    uc_reg_read(uc, UC_ARM64_REG_V2, &call_context.v[2]);
-    uc_reg_read(uc, UC_ARM64_REG_V3, &call_context.v[3]);
-    uc_reg_read(uc, UC_ARM64_REG_V4, &call_context.v[4]);
-    uc_reg_read(uc, UC_ARM64_REG_V5, &call_context.v[5]);
-    uc_reg_read(uc, UC_ARM64_REG_V6, &call_context.v[6]);
-    uc_reg_read(uc, UC_ARM64_REG_V7, &call_context.v[7]);
-    
-    // find cif
-    struct native_call_context ctx;
-    os_unfair_lock_lock(&cif_cache_lock);
-    if (!CFDictionaryContainsKey(cif_cache_native, (void*)pc)) {
-        os_unfair_lock_unlock(&cif_cache_lock);
+hidden uint64_t call_native(struct emulator_ctx *emulator, uint64_t pc) {
+    // find entry point
+    const struct entry_point *entry = native_call_cache_get(emulator, pc);
+    if (entry == NULL) {
         // try to add symbol
         Dl_info info = {.dli_sname = NULL};
         if (dladdr((void*)pc, &info) && info.dli_saddr == (void*)pc) {
-            printf("trying to add cif for %s (%s+0x%llx) at runtime\n", info.dli_sname, info.dli_fname, (uint64_t)info.dli_saddr - (uint64_t)info.dli_fbase);
+            LOG_INFO(LOG_CIF, "trying to add cif for %s (%s+0x%llx) at runtime\n", info.dli_sname, info.dli_fname, (uint64_t)info.dli_saddr - (uint64_t)info.dli_fbase);
             cif_cache_add(info.dli_saddr, lookup_method_signature(info.dli_fname, info.dli_sname), info.dli_sname);
+            entry = cif_cache_get((void*)pc);
         }
-        os_unfair_lock_lock(&cif_cache_lock);
     }
-    ctx.cif_native = (ffi_cif *)CFDictionaryGetValue(cif_cache_native, (void*)pc);
-    ctx.cif_arm64 = (ffi_cif_arm64 *)CFDictionaryGetValue(cif_cache_arm64, (void*)pc);
+    return call_native_entry(emulator, entry, pc);
+}
+
+hidden uint64_t call_native_gate(struct emulator_ctx *emulator, struct native_gate *gate) {
+    __atomic_fetch_add(&gate->calls, 1, __ATOMIC_RELAXED);
+    const struct entry_point *entry = native_gate_entry(gate);
+    if (entry == NULL) {
+        // unknown target, look it up like a fetch fault
+        return call_native(emulator, gate->target);
+    }
+    return call_native_entry(emulator, entry, gate->target);
+}
+
+hidden uint64_t call_native_entry(struct emulator_ctx *emulator, const struct entry_point *entry, uint64_t pc) {
+    uc_engine *uc = emulator->uc;
+    struct native_call_context ctx;
+    
+    // call context, shims may look at any argument register
+    struct arm64_call_context call_context;
+    uint32_t x_mask = REG_ALL_X_ARGUMENTS, v_mask = REG_ALL_V_ARGUMENTS;
+    const struct prepared_cifs *cifs = entry ? entry_point_cifs(entry) : NULL;
+    if (cifs) {
+        x_mask = cifs->cif_arm64.x_mask;
+        v_mask = cifs->cif_arm64.v_mask;
+    }
+    reg_read_arguments(uc, &call_context, x_mask, v_mask, &ctx.sp);
     ctx.pc = pc;
-    ctx.sp = sp;
     ctx.arm64_call_context = &call_context;
-    os_unfair_lock_unlock(&cif_cache_lock);
-    if (CIF_IS_CIF(ctx.cif_native) && ctx.cif_arm64) {
-        // call with cif
-        ctx.before = ctx.after = NULL;
-        call_native_with_context(uc, &ctx);
-        return SHIM_RETURN;
-    } else if (ctx.cif_native == CIF_MARKER_SHIM && ctx.cif_arm64 != NULL) {
-        // call shim
-        shim_ptr shim = (shim_ptr)ctx.cif_arm64;
-        ctx.cif_arm64 = NULL;
-        printf("calling shim for %s at %p\n", cif_get_name((void*)pc), shim);
-        return shim(uc, &ctx);
-    } else if (ctx.cif_native == CIF_MARKER_WRAPPER && ctx.cif_arm64 != NULL) {
-        // call with wrapper
-        printf("calling wrapper for %p\n", (void*)pc);
-        struct call_wrapper *wrapper = (struct call_wrapper*)ctx.cif_arm64;
-        ctx.cif_native = wrapper->cif_native;
-        ctx.cif_arm64 = wrapper->cif_arm64;
-        ctx.before = wrapper->emulated_to_native;
-        ctx.after = wrapper->native_to_emulated;
-        call_native_with_context(uc, &ctx);
-        return SHIM_RETURN;
-    } else {
+    if (entry == NULL || (entry->kind == ENTRY_POINT_SHIM && entry->shim == NULL)) {
         Dl_info info = {.dli_sname = "(unknown)"};
         dladdr((void*)pc, &info);
-        printf("missing cif for %p (%s+0x%llx:%s)\n", (void*)pc, info.dli_fname, pc - (uint64_t)info.dli_fbase, info.dli_sname);
+        LOG_ERROR(LOG_CIF, "missing cif for %p (%s+0x%llx:%s)\n", (void*)pc, info.dli_fname, pc - (uint64_t)info.dli_fbase, info.dli_sname);
         abort();
+    } else if (entry->kind == ENTRY_POINT_SHIM) {
+        LOG_DEBUG(LOG_CALLS, "calling shim for %s at %p\n", entry->name, entry->shim);
+    } else if (entry->kind == ENTRY_POINT_WRAPPER) {
+        LOG_DEBUG(LOG_CALLS, "calling wrapper for %p\n", (void*)pc);
+    }
+    return call_entry_point(uc, entry, &ctx);
+}
+
+static uint64_t call_entry_point_kind(uc_engine *uc, const struct entry_point *entry, struct native_call_context *ctx) {
+    switch (entry->kind) {
+        case ENTRY_POINT_CIF: {
+            const struct prepared_cifs *cifs = entry_point_cifs(entry);
+            ctx->cif_native = (ffi_cif *)&cifs->cif_native;
+            ctx->cif_arm64 = (ffi_cif_arm64 *)&cifs->cif_arm64;
+            ctx->before = ctx->after = NULL;
+            call_native_with_context(uc, ctx);
+            return SHIM_RETURN;
+        }
+        case ENTRY_POINT_SHIM:
+            ctx->cif_native = NULL;
+            ctx->cif_arm64 = NULL;
+            return entry->shim(uc, ctx);
+        case ENTRY_POINT_WRAPPER: {
+            const struct prepared_cifs *cifs = entry_point_cifs(entry);
+            ctx->cif_native = (ffi_cif *)&cifs->cif_native;
+            ctx->cif_arm64 = (ffi_cif_arm64 *)&cifs->cif_arm64;
+            ctx->before = entry->emulated_to_native;
+            ctx->after = entry->native_to_emulated;
+            call_native_with_context(uc, ctx);
+            return SHIM_RETURN;
+        }
+        default:
+            abort();
+    }
+}
+
+hidden uint64_t call_entry_point(uc_engine *uc, const struct entry_point *entry, struct native_call_context *ctx) {
+    if (entry_stats_enabled || timeline_enabled) {
+        static const char *timeline_categories[] = {
+            [ENTRY_POINT_CIF] = "native",
+            [ENTRY_POINT_SHIM] = "shim",
+            [ENTRY_POINT_WRAPPER] = "wrapper",
+        };
+        struct emulator_ctx *emulator = get_emulator_ctx();
+        uint64_t start = entry_stats_now();
+        uint64_t next = call_entry_point_kind(uc, entry, ctx);
+        // a complete event, not begin and end: run_emulator catches C++
+        // exceptions thrown through here, which would leave a begin unmatched
+        if (timeline_enabled) {
+            timeline_record_complete(emulator, timeline_categories[entry->kind], entry->name, start);
+        }
+        if (entry_stats_enabled) {
+            entry_stats_record(emulator, entry, ENTRY_STATS_NATIVE, start);
+        }
+        return next;
     }
+    return call_entry_point_kind(uc, entry, ctx);
 }
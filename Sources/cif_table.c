@@ -0,0 +1,153 @@
+//
+//  cif_table.c
+//  aah
+//
+//  Open addressing with linear probing, keyed by code address.
+//  Address 0 marks an empty slot. Removed entries keep their address with a
+//  NULL value, so probes for later keys still pass them, and are dropped when
+//  the table grows.
+//
+
+#include "cif_table.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+struct cif_table_slot {
+    _Atomic uint64_t address;
+    _Atomic(void *) value;
+};
+
+struct cif_table_slots {
+    uint32_t mask;
+    uint32_t count; // entries with a value
+    uint32_t used; // slots with an address, including removed entries
+    struct cif_table_slots *retired;
+    struct cif_table_slot slot[];
+};
+
+struct cif_table {
+    _Atomic(struct cif_table_slots *) slots;
+    pthread_mutex_t write_lock; // portable, writers are rare
+};
+
+static inline uint32_t cif_table_hash(uint64_t address) {
+    // code addresses are 4-byte aligned
+    uint64_t h = (address >> 2) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32);
+}
+
+static struct cif_table_slots * cif_table_alloc_slots(uint32_t capacity) {
+    uint32_t size = 16;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    struct cif_table_slots *slots = calloc(1, sizeof(struct cif_table_slots) + size * sizeof(struct cif_table_slot));
+    if (slots == NULL) {
+        fprintf(stderr, "cif_table: out of memory\n");
+        abort();
+    }
+    slots->mask = size - 1;
+    return slots;
+}
+
+hidden struct cif_table * cif_table_create(uint32_t capacity) {
+    struct cif_table *table = calloc(1, sizeof(struct cif_table));
+    atomic_init(&table->slots, cif_table_alloc_slots(capacity * 2));
+    pthread_mutex_init(&table->write_lock, NULL);
+    return table;
+}
+
+hidden void * cif_table_get(struct cif_table *table, uint64_t address) {
+    struct cif_table_slots *slots = atomic_load_explicit(&table->slots, memory_order_acquire);
+    for (uint32_t i = cif_table_hash(address);; i++) {
+        struct cif_table_slot *slot = &slots->slot[i & slots->mask];
+        uint64_t slot_address = atomic_load_explicit(&slot->address, memory_order_acquire);
+        if (slot_address == address) {
+            return atomic_load_explicit(&slot->value, memory_order_acquire);
+        } else if (slot_address == 0) {
+            return NULL;
+        }
+    }
+}
+
+// called with write_lock held
+static struct cif_table_slot * cif_table_find_slot(struct cif_table_slots *slots, uint64_t address) {
+    for (uint32_t i = cif_table_hash(address);; i++) {
+        struct cif_table_slot *slot = &slots->slot[i & slots->mask];
+        uint64_t slot_address = atomic_load_explicit(&slot->address, memory_order_relaxed);
+        if (slot_address == address || slot_address == 0) {
+            return slot;
+        }
+    }
+}
+
+// called with write_lock held
+static struct cif_table_slots * cif_table_grow(struct cif_table *table, struct cif_table_slots *old_slots) {
+    struct cif_table_slots *slots = cif_table_alloc_slots(2 * (old_slots->mask + 1));
+    for (uint32_t i = 0; i <= old_slots->mask; i++) {
+        uint64_t address = atomic_load_explicit(&old_slots->slot[i].address, memory_order_relaxed);
+        void *value = atomic_load_explicit(&old_slots->slot[i].value, memory_order_relaxed);
+        if (address && value) {
+            struct cif_table_slot *slot = cif_table_find_slot(slots, address);
+            atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+            atomic_store_explicit(&slot->address, address, memory_order_relaxed);
+        }
+    }
+    slots->count = slots->used = old_slots->count;
+    // readers may still be probing the old slots, so they are never freed
+    // the table only grows, so retired slots add up to less than the live ones
+    slots->retired = old_slots;
+    atomic_store_explicit(&table->slots, slots, memory_order_release);
+    return slots;
+}
+
+hidden void * cif_table_set(struct cif_table *table, uint64_t address, void *value, bool overwrite) {
+    if (address == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&table->write_lock);
+    struct cif_table_slots *slots = atomic_load_explicit(&table->slots, memory_order_relaxed);
+    if (4 * (slots->used + 1) > 3 * (slots->mask + 1)) {
+        slots = cif_table_grow(table, slots);
+    }
+    struct cif_table_slot *slot = cif_table_find_slot(slots, address);
+    if (atomic_load_explicit(&slot->address, memory_order_relaxed) == 0) {
+        // new entry: value must be visible before the address
+        atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+        atomic_store_explicit(&slot->address, address, memory_order_release);
+        slots->count++;
+        slots->used++;
+    } else if (atomic_load_explicit(&slot->value, memory_order_relaxed) == NULL) {
+        // removed entry
+        atomic_store_explicit(&slot->value, value, memory_order_release);
+        slots->count++;
+    } else if (overwrite) {
+        atomic_store_explicit(&slot->value, value, memory_order_release);
+    } else {
+        value = atomic_load_explicit(&slot->value, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&table->write_lock);
+    return value;
+}
+
+hidden uint32_t cif_table_remove_range(struct cif_table *table, uint64_t begin, uint64_t end) {
+    pthread_mutex_lock(&table->write_lock);
+    struct cif_table_slots *slots = atomic_load_explicit(&table->slots, memory_order_relaxed);
+    uint32_t removed = 0;
+    for (uint32_t i = 0; i <= slots->mask; i++) {
+        uint64_t address = atomic_load_explicit(&slots->slot[i].address, memory_order_relaxed);
+        if (address >= begin && address < end && atomic_load_explicit(&slots->slot[i].value, memory_order_relaxed)) {
+            atomic_store_explicit(&slots->slot[i].value, NULL, memory_order_release);
+            removed++;
+        }
+    }
+    slots->count -= removed;
+    pthread_mutex_unlock(&table->write_lock);
+    return removed;
+}
+
+hidden uint32_t cif_table_count(struct cif_table *table) {
+    return atomic_load_explicit(&table->slots, memory_order_acquire)->count;
+}
@@ -0,0 +1,29 @@
+//
+//  cif_table.h
+//  aah
+//
+//  Concurrent address -> pointer table for the cif cache.
+//
+//  Lookups take no lock: slots are published with release stores, and a
+//  grown table is swapped in atomically while readers keep probing the
+//  old one. Writers are serialized among themselves but never block readers.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef hidden
+#define hidden __attribute__ ((visibility ("hidden")))
+#endif
+
+struct cif_table;
+
+hidden struct cif_table * cif_table_create(uint32_t capacity);
+// returns NULL if address is not in the table
+hidden void * cif_table_get(struct cif_table *table, uint64_t address);
+// returns the value left in the table: value, or the old one if it exists and !overwrite
+hidden void * cif_table_set(struct cif_table *table, uint64_t address, void *value, bool overwrite);
+// removes entries with begin <= address < end, returns how many
+// the values are not freed, readers may still be using them
+hidden uint32_t cif_table_remove_range(struct cif_table *table, uint64_t begin, uint64_t end);
+hidden uint32_t cif_table_count(struct cif_table *table);
@@ -0,0 +1,150 @@
+//
+//  coverage.c
+//  aah
+//
+//  Block coverage and heat (COVERAGE_FILE): a UC_HOOK_BLOCK per emulated
+//  text segment, so only emulated code is instrumented, counts entries
+//  into each block. Counters are shared by all threads and updated without
+//  atomic read-modify-writes, so concurrent updates may be lost.
+//  Unloaded images stop counting and their hooks are deleted on each
+//  engine's next sync.
+//
+
+#include "aah.h"
+#include "coverage.h"
+#include <os/lock.h>
+
+#define COVERAGE_MAX_IMAGES 256
+
+struct coverage_image {
+    uint64_t header;
+    uint64_t text_begin, text_end;
+    const char *path;
+    uint32_t *counters; // per instruction, for blocks starting there
+    bool unloaded; // accessed atomically
+};
+
+static const char *coverage_path = NULL;
+static struct coverage_image coverage_images[COVERAGE_MAX_IMAGES];
+static uint32_t coverage_image_count = 0; // published with release
+static uint32_t coverage_unload_count = 0; // bumped after an image is marked unloaded
+static os_unfair_lock coverage_lock = OS_UNFAIR_LOCK_INIT;
+
+static void cb_coverage_block(uc_engine *uc, uint64_t address, uint32_t size, struct coverage_image *image) {
+    // until this engine deletes the hook, another image may be loaded there
+    if (__atomic_load_n(&image->unloaded, __ATOMIC_RELAXED)) {
+        return;
+    }
+    uint32_t *counter = &image->counters[(address - image->text_begin) / 4];
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static void write_coverage(void) {
+    FILE *fp = fopen(coverage_path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "couldn't open coverage file %s: %s\n", coverage_path, strerror(errno));
+        return;
+    }
+    uint32_t count = __atomic_load_n(&coverage_image_count, __ATOMIC_ACQUIRE);
+    struct coverage_header header = {
+        .magic = COVERAGE_MAGIC,
+        .version = COVERAGE_VERSION,
+        .image_count = count
+    };
+    fwrite(&header, sizeof(header), 1, fp);
+    for (uint32_t i = 0; i < count; i++) {
+        const struct coverage_image *image = &coverage_images[i];
+        struct coverage_image_header image_header = {
+            .header = image->header,
+            .text_offset = image->text_begin - image->header,
+            .text_size = image->text_end - image->text_begin,
+            .path_length = (uint32_t)strlen(image->path),
+            .flags = __atomic_load_n(&image->unloaded, __ATOMIC_RELAXED) ? COVERAGE_IMAGE_UNLOADED : 0
+        };
+        uint64_t padding = 0;
+        fwrite(&image_header, sizeof(image_header), 1, fp);
+        fwrite(image->path, image_header.path_length, 1, fp);
+        fwrite(&padding, (8 - image_header.path_length % 8) % 8, 1, fp);
+        fwrite(image->counters, sizeof(uint32_t), image_header.text_size / 4, fp);
+    }
+    fclose(fp);
+    LOG_INFO(LOG_EMULATOR, "wrote coverage of %u images to %s\n", count, coverage_path);
+}
+
+hidden void init_coverage(void) {
+    coverage_path = getenv("COVERAGE_FILE");
+    if (coverage_path == NULL || *coverage_path == '\0') {
+        coverage_path = NULL;
+        return;
+    }
+    atexit(write_coverage);
+}
+
+hidden void coverage_add_image(const struct mach_header_64 *mh, uint64_t text_begin, uint64_t text_size) {
+    if (coverage_path == NULL) {
+        return;
+    }
+    Dl_info info = {NULL};
+    dladdr(mh, &info);
+    os_unfair_lock_lock(&coverage_lock);
+    uint32_t count = coverage_image_count;
+    if (count == COVERAGE_MAX_IMAGES) {
+        os_unfair_lock_unlock(&coverage_lock);
+        LOG_WARN(LOG_EMULATOR, "too many images for coverage, not adding %s\n", info.dli_fname);
+        return;
+    }
+    struct coverage_image *image = &coverage_images[count];
+    image->header = (uint64_t)mh;
+    image->text_begin = text_begin;
+    image->text_end = text_begin + text_size;
+    image->path = strdup(info.dli_fname ? info.dli_fname : "(unknown)");
+    image->counters = calloc(text_size / 4, sizeof(uint32_t));
+    __atomic_store_n(&coverage_image_count, count + 1, __ATOMIC_RELEASE);
+    os_unfair_lock_unlock(&coverage_lock);
+}
+
+hidden void coverage_remove_image(const struct mach_header_64 *mh) {
+    if (coverage_path == NULL) {
+        return;
+    }
+    os_unfair_lock_lock(&coverage_lock);
+    for (uint32_t i = 0; i < coverage_image_count; i++) {
+        struct coverage_image *image = &coverage_images[i];
+        if (image->header == (uint64_t)mh && !image->unloaded) {
+            // its counters are kept and written at exit
+            __atomic_store_n(&image->unloaded, true, __ATOMIC_RELAXED);
+            LOG_INFO(LOG_EMULATOR, "stopped coverage of %s\n", image->path);
+        }
+    }
+    __atomic_add_fetch(&coverage_unload_count, 1, __ATOMIC_RELEASE);
+    os_unfair_lock_unlock(&coverage_lock);
+}
+
+hidden void coverage_sync(struct emulator_ctx *ctx) {
+    uint32_t count = __atomic_load_n(&coverage_image_count, __ATOMIC_ACQUIRE);
+    uint32_t unload_count = __atomic_load_n(&coverage_unload_count, __ATOMIC_ACQUIRE);
+    if (ctx->coverage_unloads != unload_count) {
+        ctx->coverage_unloads = unload_count;
+        for (uint32_t i = 0; i < ctx->coverage_images; i++) {
+            if (ctx->coverage_hooks[i] && __atomic_load_n(&coverage_images[i].unloaded, __ATOMIC_RELAXED)) {
+                uc_hook_del(ctx->uc, ctx->coverage_hooks[i]);
+                ctx->coverage_hooks[i] = 0;
+            }
+        }
+    }
+    if (ctx->coverage_images < count && ctx->coverage_hooks == NULL) {
+        ctx->coverage_hooks = calloc(COVERAGE_MAX_IMAGES, sizeof(uc_hook));
+    }
+    for (; ctx->coverage_images < count; ctx->coverage_images++) {
+        struct coverage_image *image = &coverage_images[ctx->coverage_images];
+        if (__atomic_load_n(&image->unloaded, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        // the range is inclusive
+        uc_err err = uc_hook_add(ctx->uc, &ctx->coverage_hooks[ctx->coverage_images], UC_HOOK_BLOCK, (void*)cb_coverage_block, image, image->text_begin, image->text_end - 1);
+        if (err != UC_ERR_OK) {
+            fprintf(stderr, "uc_hook_add: %u %s\n", err, uc_strerror(err));
+            abort();
+        }
+    }
+}
@@ -0,0 +1,40 @@
+//
+//  coverage.h
+//  aah
+//
+//  Block coverage file, written by coverage.c at exit when COVERAGE_FILE
+//  is set, and read by Tools/print_coverage.c.
+//
+//  A header, then for each emulated image a coverage_image header, its
+//  path padded with zeros to a multiple of 8 bytes, and text_size / 4
+//  counters: how many times the block starting at each instruction of the
+//  text segment was entered. Images that were unloaded keep their counts
+//  up to then.
+//
+
+#ifndef coverage_h
+#define coverage_h
+
+#include <stdint.h>
+
+#define COVERAGE_MAGIC 0x43484141 // "AAHC"
+#define COVERAGE_VERSION 1
+
+#define COVERAGE_IMAGE_UNLOADED (1 << 0)
+
+struct coverage_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t image_count;
+    uint32_t reserved;
+};
+
+struct coverage_image_header {
+    uint64_t header; // where it was loaded
+    uint64_t text_offset; // from the mach header to the text segment, usually 0
+    uint64_t text_size;
+    uint32_t path_length;
+    uint32_t flags; // COVERAGE_IMAGE_*
+};
+
+#endif /* coverage_h */
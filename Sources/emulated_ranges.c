@@ -0,0 +1,199 @@
+//
+//  emulated_ranges.c
+//  aah
+//
+
+#include "emulated_ranges.h"
+#include <stdlib.h>
+#include <string.h>
+
+hidden uint32_t emulated_ranges_find(const struct emulated_ranges *snapshot, uint64_t address) {
+    // find the last range that begins at or before address
+    uint32_t low = 0, high = snapshot->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (snapshot->ranges[mid].begin <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low > 0 && address < snapshot->ranges[low - 1].end) {
+        return snapshot->ranges[low - 1].flags;
+    }
+    return 0;
+}
+
+hidden struct emulated_ranges * emulated_ranges_insert(const struct emulated_ranges *old, uint64_t begin, uint64_t end, uint32_t flags) {
+    struct emulated_ranges *new = malloc(sizeof(struct emulated_ranges) + (old->count + 1) * sizeof(struct emulated_range));
+    uint32_t pos = 0;
+    while (pos < old->count && old->ranges[pos].begin < begin) {
+        pos++;
+    }
+    memcpy(new->ranges, old->ranges, pos * sizeof(struct emulated_range));
+    new->ranges[pos] = (struct emulated_range){.begin = begin, .end = end, .flags = flags};
+    memcpy(&new->ranges[pos + 1], &old->ranges[pos], (old->count - pos) * sizeof(struct emulated_range));
+    new->count = old->count + 1;
+    return new;
+}
+
+hidden struct emulated_ranges * emulated_ranges_remove(const struct emulated_ranges *old, uint64_t begin) {
+    struct emulated_ranges *new = malloc(sizeof(struct emulated_ranges) + old->count * sizeof(struct emulated_range));
+    new->count = 0;
+    for (uint32_t i = 0; i < old->count; i++) {
+        if (old->ranges[i].begin != begin) {
+            new->ranges[new->count++] = old->ranges[i];
+        }
+    }
+    return new;
+}
+
+// MARK: table
+
+struct emulated_ranges_reader {
+    struct emulated_ranges_reader *next;
+    uint64_t epoch; // table epoch when the current lookup started, 0 between lookups
+    bool in_use; // by a thread
+};
+
+struct emulated_ranges_retired {
+    struct emulated_ranges_retired *next;
+    const struct emulated_ranges *snapshot;
+    uint64_t epoch; // lookups that start at or after it load a newer snapshot
+};
+
+hidden const struct emulated_ranges emulated_ranges_empty = {.count = 0};
+
+static void release_reader(void *value) {
+    struct emulated_ranges_reader *reader = value;
+    __atomic_store_n(&reader->in_use, false, __ATOMIC_RELEASE);
+}
+
+static struct emulated_ranges_reader * register_reader(struct emulated_ranges_table *table) {
+    struct emulated_ranges_reader *reader;
+    // reuse the record of an exited thread
+    for (reader = __atomic_load_n(&table->readers, __ATOMIC_ACQUIRE); reader; reader = reader->next) {
+        bool in_use = false;
+        if (!__atomic_load_n(&reader->in_use, __ATOMIC_RELAXED) && __atomic_compare_exchange_n(&reader->in_use, &in_use, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (reader == NULL) {
+        reader = calloc(1, sizeof(struct emulated_ranges_reader));
+        reader->in_use = true;
+        reader->next = __atomic_load_n(&table->readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&table->readers, &reader->next, reader, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(table->reader_key, reader);
+    return reader;
+}
+
+hidden uint32_t emulated_ranges_table_find(struct emulated_ranges_table *table, uint64_t address) {
+    if (__atomic_load_n(&table->current, __ATOMIC_ACQUIRE) == &emulated_ranges_empty) {
+        // never freed, and there is no reader key yet before the first snapshot
+        return 0;
+    }
+    struct emulated_ranges_reader *reader = pthread_getspecific(table->reader_key);
+    if (reader == NULL) {
+        reader = register_reader(table);
+    }
+    // nested in a lookup that was interrupted by a signal, the outer epoch protects both
+    uint64_t outer = reader->epoch;
+    if (outer == 0) {
+        __atomic_store_n(&reader->epoch, __atomic_load_n(&table->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        // the writer either sees the epoch, or this loads a snapshot it hasn't retired
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    uint32_t flags = emulated_ranges_find(__atomic_load_n(&table->current, __ATOMIC_ACQUIRE), address);
+    if (outer == 0) {
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    }
+    return flags;
+}
+
+// called with write_lock held
+static void reclaim_snapshots(struct emulated_ranges_table *table) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t oldest = UINT64_MAX;
+    for (struct emulated_ranges_reader *reader = __atomic_load_n(&table->readers, __ATOMIC_ACQUIRE); reader; reader = reader->next) {
+        uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    for (struct emulated_ranges_retired **next = &table->retired; *next;) {
+        struct emulated_ranges_retired *retired = *next;
+        if (retired->epoch <= oldest) {
+            *next = retired->next;
+            free((void *)retired->snapshot);
+            free(retired);
+        } else {
+            next = &retired->next;
+        }
+    }
+}
+
+// called with write_lock held
+static void publish_snapshot(struct emulated_ranges_table *table, struct emulated_ranges *snapshot) {
+    const struct emulated_ranges *old = table->current;
+    if (snapshot->count == 0) {
+        free(snapshot);
+        snapshot = (struct emulated_ranges *)&emulated_ranges_empty;
+    }
+    __atomic_store_n(&table->current, snapshot, __ATOMIC_RELEASE);
+    uint64_t epoch = __atomic_add_fetch(&table->epoch, 1, __ATOMIC_SEQ_CST);
+    if (old != &emulated_ranges_empty) {
+        struct emulated_ranges_retired *retired = malloc(sizeof(struct emulated_ranges_retired));
+        retired->snapshot = old;
+        retired->epoch = epoch;
+        retired->next = table->retired;
+        table->retired = retired;
+    }
+    reclaim_snapshots(table);
+}
+
+hidden void emulated_ranges_table_add(struct emulated_ranges_table *table, const struct emulated_range *ranges, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&table->write_lock);
+    if (!table->has_reader_key) {
+        // lookups only use it once they find a snapshot that isn't empty
+        pthread_key_create(&table->reader_key, release_reader);
+        table->has_reader_key = true;
+    }
+    struct emulated_ranges *snapshot = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        // intermediate snapshots were never published
+        struct emulated_ranges *next = emulated_ranges_insert(snapshot ? snapshot : table->current, ranges[i].begin, ranges[i].end, ranges[i].flags);
+        free(snapshot);
+        snapshot = next;
+    }
+    publish_snapshot(table, snapshot);
+    pthread_mutex_unlock(&table->write_lock);
+}
+
+hidden void emulated_ranges_table_remove(struct emulated_ranges_table *table, const uint64_t *begins, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&table->write_lock);
+    struct emulated_ranges *snapshot = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        struct emulated_ranges *next = emulated_ranges_remove(snapshot ? snapshot : table->current, begins[i]);
+        free(snapshot);
+        snapshot = next;
+    }
+    publish_snapshot(table, snapshot);
+    pthread_mutex_unlock(&table->write_lock);
+}
+
+hidden uint32_t emulated_ranges_table_retired_count(struct emulated_ranges_table *table) {
+    pthread_mutex_lock(&table->write_lock);
+    uint32_t count = 0;
+    for (struct emulated_ranges_retired *retired = table->retired; retired; retired = retired->next) {
+        count++;
+    }
+    pthread_mutex_unlock(&table->write_lock);
+    return count;
+}
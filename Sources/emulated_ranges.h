@@ -0,0 +1,74 @@
+//
+//  emulated_ranges.h
+//  aah
+//
+//  Address ranges of emulated images, as immutable snapshots sorted by
+//  begin. Writers make a new snapshot and publish it, readers binary search
+//  whichever one they loaded. Doesn't depend on macOS.
+//
+//  A table publishes snapshots and frees the ones it replaced once no
+//  lookup can still be using them: each thread has a reader record with
+//  the table's epoch when its current lookup started, and a snapshot
+//  retired at epoch e is freed when no lookup that started before e is
+//  still running.
+//
+
+#ifndef emulated_ranges_h
+#define emulated_ranges_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifndef hidden
+#define hidden __attribute__ ((visibility ("hidden")))
+#endif
+
+struct emulated_range {
+    uint64_t begin;
+    uint64_t end;
+    uint32_t flags;
+};
+
+struct emulated_ranges {
+    uint32_t count;
+    struct emulated_range ranges[];
+};
+
+struct emulated_ranges_reader;
+struct emulated_ranges_retired;
+
+struct emulated_ranges_table {
+    const struct emulated_ranges *current; // accessed atomically
+    uint64_t epoch; // bumped after each snapshot is published, accessed atomically
+    struct emulated_ranges_reader *readers; // one per thread, never freed, reused after their thread exits
+    struct emulated_ranges_retired *retired; // under write_lock
+    pthread_key_t reader_key; // created before the first snapshot is published
+    bool has_reader_key; // under write_lock
+    pthread_mutex_t write_lock;
+};
+
+extern hidden const struct emulated_ranges emulated_ranges_empty;
+
+#define EMULATED_RANGES_TABLE_INITIALIZER { \
+    .current = &emulated_ranges_empty, \
+    .epoch = 1, \
+    .write_lock = PTHREAD_MUTEX_INITIALIZER \
+}
+
+// returns the flags of the range containing address, 0 if there is none
+hidden uint32_t emulated_ranges_find(const struct emulated_ranges *snapshot, uint64_t address);
+// return a new snapshot, the old one is left to its readers
+hidden struct emulated_ranges * emulated_ranges_insert(const struct emulated_ranges *old, uint64_t begin, uint64_t end, uint32_t flags);
+// removes the ranges that begin at begin
+hidden struct emulated_ranges * emulated_ranges_remove(const struct emulated_ranges *old, uint64_t begin);
+
+// emulated_ranges_find in the current snapshot, lock-free
+hidden uint32_t emulated_ranges_table_find(struct emulated_ranges_table *table, uint64_t address);
+// add or remove several ranges, like those of an image, in one new snapshot
+hidden void emulated_ranges_table_add(struct emulated_ranges_table *table, const struct emulated_range *ranges, uint32_t count);
+hidden void emulated_ranges_table_remove(struct emulated_ranges_table *table, const uint64_t *begins, uint32_t count);
+// replaced snapshots that lookups may still be using
+hidden uint32_t emulated_ranges_table_retired_count(struct emulated_ranges_table *table);
+
+#endif /* emulated_ranges_h */
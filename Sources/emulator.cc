@@ -1,66 +1,51 @@
 extern "C" {
     #include "aah.h"
     #include <pthread.h>
+    #include <os/lock.h>
+    #include <sys/mman.h>
+    #include <mach/mach_time.h>
 }
 #include <exception>
 
 static bool cb_invalid_rw(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, struct emulator_ctx *ctx);
 static bool cb_invalid_fetch(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, struct emulator_ctx *ctx);
 static bool cb_print_disasm(uc_engine *uc, uint64_t address, uint32_t size, struct emulator_ctx *ctx);
+static void cb_interrupt(uc_engine *uc, uint32_t intno, struct emulator_ctx *ctx);
 static void destroy_emulator_ctx(void *ptr);
 
 static pthread_key_t emulator_ctx_key;
 static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 
+// contexts of exited threads, reused by new threads with their mappings and translated code
+static struct emulator_ctx *ctx_pool = NULL;
+static unsigned ctx_pool_count = 0;
+static unsigned ctx_pool_size = 4;
+static time_t ctx_pool_idle_time = 60;
+static os_unfair_lock ctx_pool_lock = OS_UNFAIR_LOCK_INIT;
+
+// all contexts, pooled ones included, and the totals of freed ones
+static struct emulator_ctx *ctx_all = NULL;
+static struct emulator_stats ctx_freed_stats;
+static os_unfair_lock ctx_stats_lock = OS_UNFAIR_LOCK_INIT;
+static mach_timebase_info_data_t ctx_timebase;
+
 static void dont_print_regs(uc_engine *uc,int) {};
 
 static void print_regs(uc_engine *uc, int print_all) {
-    uint64_t x[32], pc, sp, lr, fp;
-    uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
-    uc_reg_read(uc, UC_ARM64_REG_SP, &sp);
-    uc_reg_read(uc, UC_ARM64_REG_FP, &fp);
-    uc_reg_read(uc, UC_ARM64_REG_LR, &lr);
-    uc_reg_read(uc, UC_ARM64_REG_X0, &x[0]);
-    uc_reg_read(uc, UC_ARM64_REG_X1, &x[1]);
-    uc_reg_read(uc, UC_ARM64_REG_X2, &x[2]);
-    uc_reg_read(uc, UC_ARM64_REG_X3, &x[3]);
-    uc_reg_read(uc, UC_ARM64_REG_X4, &x[4]);
-    uc_reg_read(uc, UC_ARM64_REG_X5, &x[5]);
-    uc_reg_read(uc, UC_ARM64_REG_X6, &x[6]);
-    uc_reg_read(uc, UC_ARM64_REG_X7, &x[7]);
-    uc_reg_read(uc, UC_ARM64_REG_X8, &x[8]);
-    if (print_all) {
-        uc_reg_read(uc, UC_ARM64_REG_X9, &x[9]);
-        uc_reg_read(uc, UC_ARM64_REG_X10, &x[10]);
-        uc_reg_read(uc, UC_ARM64_REG_X11, &x[11]);
-        uc_reg_read(uc, UC_ARM64_REG_X12, &x[12]);
-        uc_reg_read(uc, UC_ARM64_REG_X13, &x[13]);
-        uc_reg_read(uc, UC_ARM64_REG_X14, &x[14]);
-        uc_reg_read(uc, UC_ARM64_REG_X15, &x[15]);
-        uc_reg_read(uc, UC_ARM64_REG_X16, &x[16]);
-        uc_reg_read(uc, UC_ARM64_REG_X17, &x[17]);
-        uc_reg_read(uc, UC_ARM64_REG_X18, &x[18]);
-        uc_reg_read(uc, UC_ARM64_REG_X19, &x[19]);
-        uc_reg_read(uc, UC_ARM64_REG_X20, &x[20]);
-        uc_reg_read(uc, UC_ARM64_REG_X21, &x[21]);
-        uc_reg_read(uc, UC_ARM64_REG_X22, &x[22]);
-        uc_reg_read(uc, UC_ARM64_REG_X23, &x[23]);
-        uc_reg_read(uc, UC_ARM64_REG_X24, &x[24]);
-        uc_reg_read(uc, UC_ARM64_REG_X25, &x[25]);
-        uc_reg_read(uc, UC_ARM64_REG_X26, &x[26]);
-        uc_reg_read(uc, UC_ARM64_REG_X27, &x[27]);
-        uc_reg_read(uc, UC_ARM64_REG_X28, &x[28]);
-        /*uc_reg_read(uc, UC_ARM64_REG_V0, &v[0]);
-        uc_reg_read(uc, UC_ARM64_REG_V1, &v[1]);
-        uc_reg_read(uc, UC_ARM64_REG_V2, &v[2]);
-        uc_reg_read(uc, UC_ARM64_REG_V3, &v[3]);
-        uc_reg_read(uc, UC_ARM64_REG_V4, &v[4]);
-        uc_reg_read(uc, UC_ARM64_REG_V5, &v[5]);
-        uc_reg_read(uc, UC_ARM64_REG_V6, &v[6]);
-        uc_reg_read(uc, UC_ARM64_REG_V7, &v[7]);*/
+    // x0-x8 or x0-x28, then pc, sp, fp, lr
+    uint64_t x[33];
+    int regs[33];
+    int last_reg = print_all ? 28 : 8;
+    for (int i=0; i <= last_reg; i++) {
+        regs[i] = UC_ARM64_REG_X0 + i;
     }
+    regs[last_reg+1] = UC_ARM64_REG_PC;
+    regs[last_reg+2] = UC_ARM64_REG_SP;
+    regs[last_reg+3] = UC_ARM64_REG_FP;
+    regs[last_reg+4] = UC_ARM64_REG_LR;
+    reg_read_list(uc, regs, last_reg+5, x, sizeof(uint64_t));
+    uint64_t pc = x[last_reg+1], sp = x[last_reg+2], fp = x[last_reg+3], lr = x[last_reg+4];
     
-    int last_reg = print_all ? 28 : 8;
     for (int i=0; i <=last_reg; i++) {
         printf("x%d:0x%016llx ", i, x[i]);
         if (i % 4 == 3) {
@@ -74,17 +59,112 @@ static void print_regs(uc_engine *uc, int print_all) {
     printf("lr:0x%016llx\n", lr);
 }
 
+static void init_debug_options(struct emulator_ctx *ctx) {
+    if (getenv("PRINT_DISASSEMBLY") && strtol(getenv("PRINT_DISASSEMBLY"), NULL, 10)) {
+        print_disasm(ctx, 1);
+    } else {
+        print_disasm(ctx, 0);
+    }
+    
+    if (getenv("PRINT_REGS") && strtol(getenv("PRINT_REGS"), NULL, 10)) {
+        // print some registers sometimes
+        ctx->maybe_print_regs = print_regs;
+    } else {
+        ctx->maybe_print_regs = dont_print_regs;
+    }
+    
+    if (getenv("PRINT_CACHE_STATS") && strtol(getenv("PRINT_CACHE_STATS"), NULL, 10)) {
+        ctx->print_cache_stats = true;
+    }
+}
+
+static void free_emulator_stack(struct emulator_ctx *ctx) {
+    if (ctx->stack) {
+        mem_unmap(ctx, (uint64_t)ctx->stack, ctx->stack_size);
+        munmap((char*)ctx->stack - getpagesize(), ctx->stack_size + getpagesize());
+        ctx->stack = NULL;
+    }
+}
+
+static void init_emulator_stack(struct emulator_ctx *ctx) {
+    // keep the old stack if it's big enough
+    size_t stack_size = pthread_get_stacksize_np(pthread_self());
+    if (ctx->stack == NULL || ctx->stack_size < stack_size) {
+        free_emulator_stack(ctx);
+        // pages are committed when touched, with a guard page below
+        size_t guard_size = getpagesize();
+        stack_size = (stack_size + guard_size - 1) & ~(guard_size - 1);
+        void *stack = mmap(NULL, stack_size + guard_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (stack == MAP_FAILED) {
+            fprintf(stderr, "couldn't allocate emulated stack: %s\n", strerror(errno));
+            abort();
+        }
+        mprotect(stack, guard_size, PROT_NONE);
+        ctx->stack = (char*)stack + guard_size;
+        ctx->stack_size = stack_size;
+        // a pooled context can still map memory the host has since unmapped and reused for the stack
+        mem_unmap_range(ctx, (uint64_t)stack, (uint64_t)ctx->stack + ctx->stack_size);
+        // map all of it now, the guard page is never mapped
+        uc_err err = mem_map_ptr(ctx, (uint64_t)ctx->stack, ctx->stack_size, UC_PROT_READ | UC_PROT_WRITE);
+        if (err != UC_ERR_OK) {
+            fprintf(stderr, "uc_mem_map_ptr(stack): %u %s\n", err, uc_strerror(err));
+            abort();
+        }
+    }
+    uint64_t stack_top = ((uint64_t)ctx->stack) + ctx->stack_size;
+    LOG_INFO(LOG_EMULATOR, "Emulated stack is %p to %p\n", ctx->stack, (void*)stack_top);
+    uc_reg_write(ctx->uc, UC_ARM64_REG_SP, &stack_top);
+}
+
+static struct emulator_ctx* lease_emulator_ctx() {
+    os_unfair_lock_lock(&ctx_pool_lock);
+    struct emulator_ctx *ctx = ctx_pool;
+    if (ctx) {
+        ctx_pool = ctx->pool_next;
+        ctx_pool_count--;
+    }
+    os_unfair_lock_unlock(&ctx_pool_lock);
+    if (ctx == NULL) {
+        return NULL;
+    }
+    
+    // reset registers and flags left by the previous thread, keep mappings and translated code
+    LOG_INFO(LOG_EMULATOR, "reusing emulator context %p\n", ctx);
+    uint64_t zero[64] = {0};
+    reg_write_range(ctx->uc, UC_ARM64_REG_X0, 29, zero, sizeof(uint64_t));
+    uc_reg_write(ctx->uc, UC_ARM64_REG_FP, &zero[0]);
+    uc_reg_write(ctx->uc, UC_ARM64_REG_LR, &zero[0]);
+    reg_write_range(ctx->uc, UC_ARM64_REG_V0, 32, zero, 2 * sizeof(uint64_t));
+    uc_reg_write(ctx->uc, UC_ARM64_REG_NZCV, &zero[0]);
+    init_emulator_stack(ctx);
+    ctx->pool_next = NULL;
+    ctx->gate = NULL;
+    init_debug_options(ctx);
+    trace_attach(ctx);
+    return ctx;
+}
+
 hidden struct emulator_ctx* init_emulator_ctx() {
-    struct emulator_ctx *ctx = (struct emulator_ctx*)calloc(1, sizeof(struct emulator_ctx));
+    struct emulator_ctx *ctx = lease_emulator_ctx();
+    if (ctx) {
+        pthread_setspecific(emulator_ctx_key, ctx);
+        return ctx;
+    }
+    ctx = (struct emulator_ctx*)calloc(1, sizeof(struct emulator_ctx));
     pthread_setspecific(emulator_ctx_key, ctx);
+    os_unfair_lock_lock(&ctx_stats_lock);
+    ctx->all_next = ctx_all;
+    ctx_all = ctx;
+    os_unfair_lock_unlock(&ctx_stats_lock);
     uc_err err;
-    printf("init unicorn\n");
+    LOG_INFO(LOG_EMULATOR, "init unicorn\n");
     // initialize unicorn
     err = uc_open(UC_ARCH_ARM64, UC_MODE_ARM, &ctx->uc);
     if (err != UC_ERR_OK) {
         fprintf(stderr, "uc_open: %u %s\n", err, uc_strerror(err));
         abort();
     }
+    perf_map_add_code_caches();
     
     // catch invalid memory access
     uc_hook mem_hook;
@@ -102,28 +182,25 @@ hidden struct emulator_ctx* init_emulator_ctx() {
         abort();
     }
     
-    if (getenv("PRINT_DISASSEMBLY") && strtol(getenv("PRINT_DISASSEMBLY"), NULL, 10)) {
-        print_disasm(ctx, 1);
-    } else {
-        ctx->instr_hook = 0;
+    // catch native call gates
+    uc_hook intr_hook;
+    err = uc_hook_add(ctx->uc, &intr_hook, UC_HOOK_INTR, (void*)cb_interrupt, ctx, 1, 0);
+    if (err != UC_ERR_OK) {
+        fprintf(stderr, "uc_hook_add: %u %s\n", err, uc_strerror(err));
+        abort();
     }
+    native_gates_map(ctx);
     
-    if (getenv("PRINT_REGS") && strtol(getenv("PRINT_REGS"), NULL, 10)) {
-        // print some registers sometimes
-        ctx->maybe_print_regs = print_regs;
-    } else {
-        ctx->maybe_print_regs = dont_print_regs;
-    }
+    // map memory for stack, before regions known to other threads that may have been reused for it
+    init_emulator_stack(ctx);
+    mem_registry_sync(ctx);
+    
+    init_debug_options(ctx);
+    trace_attach(ctx);
     
-    // map memory for stack
-    ctx->stack_size = pthread_get_stacksize_np(pthread_self());
-    ctx->stack = malloc(ctx->stack_size);
-    uint64_t stack_top = ((uint64_t)ctx->stack) + ctx->stack_size;
-    printf("Emulated stack is %p to %p\n", ctx->stack, (void*)stack_top);
-    uc_reg_write(ctx->uc, UC_ARM64_REG_SP, &stack_top);
     ctx->return_ptr = (uint64_t)ctx;
     ctx->pagezero_size = getsegbyname(SEG_PAGEZERO)->vmsize;
-    printf("Page zero is 0x%lx\n", ctx->pagezero_size);
+    LOG_INFO(LOG_EMULATOR, "Page zero is 0x%lx\n", ctx->pagezero_size);
     
     // enable FPU
     uint32_t cpacr_el1;
@@ -143,6 +220,16 @@ hidden struct emulator_ctx* init_emulator_ctx() {
 
 static void init_key() {
     pthread_key_create(&emulator_ctx_key, destroy_emulator_ctx);
+    if (getenv("EMULATOR_POOL_SIZE")) {
+        ctx_pool_size = (unsigned)strtoul(getenv("EMULATOR_POOL_SIZE"), NULL, 10);
+    }
+    if (getenv("EMULATOR_POOL_IDLE")) {
+        ctx_pool_idle_time = (time_t)strtol(getenv("EMULATOR_POOL_IDLE"), NULL, 10);
+    }
+    mach_timebase_info(&ctx_timebase);
+    if (getenv("EMULATOR_STATS") && strtol(getenv("EMULATOR_STATS"), NULL, 10)) {
+        atexit(aah_print_emulator_stats);
+    }
 }
 
 hidden void init_emulator_ctx_key() {
@@ -182,18 +269,151 @@ hidden void print_disasm(struct emulator_ctx *ctx, int level) {
     }
 }
 
-static void destroy_emulator_ctx(void *ptr) {
-    struct emulator_ctx *ctx = (struct emulator_ctx *)ptr;
-    // TODO: is it running?
+static void add_emulator_stats(struct emulator_stats *total, const struct emulator_stats *stats) {
+    total->emu_starts += __atomic_load_n(&stats->emu_starts, __ATOMIC_RELAXED);
+    for (int i = 0; i < EMULATOR_EXIT_COUNT; i++) {
+        total->exits[i] += __atomic_load_n(&stats->exits[i], __ATOMIC_RELAXED);
+    }
+    total->rw_faults += __atomic_load_n(&stats->rw_faults, __ATOMIC_RELAXED);
+    total->fetch_faults += __atomic_load_n(&stats->fetch_faults, __ATOMIC_RELAXED);
+    total->fault_maps += __atomic_load_n(&stats->fault_maps, __ATOMIC_RELAXED);
+    total->fault_mapped_bytes += __atomic_load_n(&stats->fault_mapped_bytes, __ATOMIC_RELAXED);
+    total->remaps += __atomic_load_n(&stats->remaps, __ATOMIC_RELAXED);
+    total->emulated_ns += __atomic_load_n(&stats->emulated_ns, __ATOMIC_RELAXED);
+    total->native_ns += __atomic_load_n(&stats->native_ns, __ATOMIC_RELAXED);
+    // oldest first
+    uint32_t next = __atomic_load_n(&stats->fault_range_next, __ATOMIC_RELAXED);
+    uint32_t first = next > EMULATOR_STATS_FAULT_RANGES ? next - EMULATOR_STATS_FAULT_RANGES : 0;
+    for (uint32_t i = first; i < next; i++) {
+        total->fault_ranges[total->fault_range_next++ % EMULATOR_STATS_FAULT_RANGES] = stats->fault_ranges[i % EMULATOR_STATS_FAULT_RANGES];
+    }
+}
+
+void aah_get_emulator_stats(struct emulator_stats *stats) {
+    memset(stats, 0, sizeof(struct emulator_stats));
+    os_unfair_lock_lock(&ctx_stats_lock);
+    add_emulator_stats(stats, &ctx_freed_stats);
+    stats->contexts = ctx_freed_stats.contexts;
+    for (struct emulator_ctx *ctx = ctx_all; ctx; ctx = ctx->all_next) {
+        add_emulator_stats(stats, &ctx->stats);
+        stats->contexts++;
+    }
+    os_unfair_lock_unlock(&ctx_stats_lock);
+}
+
+void aah_print_emulator_stats(void) {
+    struct emulator_stats stats;
+    aah_get_emulator_stats(&stats);
+    printf("emulator stats: %llu contexts\n", stats.contexts);
+    printf("  %llu uc_emu_start: %llu returned, %llu native call gates, %llu native fetches, %llu samples, %llu errors\n", stats.emu_starts,
+           stats.exits[EMULATOR_EXIT_RETURN], stats.exits[EMULATOR_EXIT_GATE], stats.exits[EMULATOR_EXIT_FETCH_PROT], stats.exits[EMULATOR_EXIT_SAMPLE], stats.exits[EMULATOR_EXIT_ERROR]);
+    printf("  faults: %llu read/write, %llu fetch, %llu mapped regions (%llu bytes), %llu remaps\n",
+           stats.rw_faults, stats.fetch_faults, stats.fault_maps, stats.fault_mapped_bytes, stats.remaps);
+    printf("  time: %.3f ms emulated, %.3f ms native\n", stats.emulated_ns / 1e6, stats.native_ns / 1e6);
+    uint32_t first = stats.fault_range_next > EMULATOR_STATS_FAULT_RANGES ? stats.fault_range_next - EMULATOR_STATS_FAULT_RANGES : 0;
+    for (uint32_t i = first; i < stats.fault_range_next; i++) {
+        printf("  mapped by fault: %p-%p\n", (void*)stats.fault_ranges[i % EMULATOR_STATS_FAULT_RANGES].begin, (void*)stats.fault_ranges[i % EMULATOR_STATS_FAULT_RANGES].end);
+    }
+}
+
+hidden void emulator_ctx_request_samples(void) {
+    // contexts can't be freed while in the list
+    os_unfair_lock_lock(&ctx_stats_lock);
+    for (struct emulator_ctx *ctx = ctx_all; ctx; ctx = ctx->all_next) {
+        if (__atomic_load_n(&ctx->in_emulation, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&ctx->sample_pending, true, __ATOMIC_RELEASE);
+            uc_emu_stop(ctx->uc);
+        }
+    }
+    os_unfair_lock_unlock(&ctx_stats_lock);
+}
+
+static inline uint64_t ticks_to_ns(uint64_t ticks) {
+    return ticks * ctx_timebase.numer / ctx_timebase.denom;
+}
+
+static void record_fault_map(struct emulator_ctx *ctx, uint64_t address) {
+    const struct mem_interval *region = mem_intervals_find(&ctx->mem_intervals, address);
+    if (region == NULL) {
+        return;
+    }
+    stat_add(&ctx->stats.fault_maps, 1);
+    stat_add(&ctx->stats.fault_mapped_bytes, region->end - region->begin);
+    uint32_t next = ctx->stats.fault_range_next;
+    ctx->stats.fault_ranges[next % EMULATOR_STATS_FAULT_RANGES].begin = region->begin;
+    ctx->stats.fault_ranges[next % EMULATOR_STATS_FAULT_RANGES].end = region->end;
+    __atomic_store_n(&ctx->stats.fault_range_next, next + 1, __ATOMIC_RELEASE);
+}
+
+static void free_emulator_ctx(struct emulator_ctx *ctx) {
+    os_unfair_lock_lock(&ctx_stats_lock);
+    for (struct emulator_ctx **next = &ctx_all; *next; next = &(*next)->all_next) {
+        if (*next == ctx) {
+            *next = ctx->all_next;
+            break;
+        }
+    }
+    add_emulator_stats(&ctx_freed_stats, &ctx->stats);
+    ctx_freed_stats.contexts++;
+    os_unfair_lock_unlock(&ctx_stats_lock);
+    free_emulator_stack(ctx);
     uc_free(ctx->uc);
-    free(ctx->stack);
+    trace_detach(ctx);
+    entry_stats_retire(ctx);
     cs_close(&ctx->capstone);
     ffi_closure_free(ctx->closure);
+    mem_intervals_free(&ctx->mem_intervals);
+    free(ctx->coverage_hooks);
+    free(ctx);
+}
+
+static void destroy_emulator_ctx(void *ptr) {
+    struct emulator_ctx *ctx = (struct emulator_ctx *)ptr;
+    // TODO: is it running?
+    if (ctx->print_cache_stats) {
+        printf("native call cache: %llu hits, %llu misses\n", ctx->native_call_cache_hits, ctx->native_call_cache_misses);
+        printf("objc dispatch cache: %llu hits, %llu misses\n", ctx->objc_dispatch_cache_hits, ctx->objc_dispatch_cache_misses);
+    }
+    ctx->native_call_cache_hits = ctx->native_call_cache_misses = 0;
+    ctx->objc_dispatch_cache_hits = ctx->objc_dispatch_cache_misses = 0;
     pthread_setspecific(emulator_ctx_key, NULL);
+    
+    // return to the pool, and trim contexts that have been idle for too long
+    time_t now = time(NULL);
+    struct emulator_ctx *trimmed = NULL;
+    os_unfair_lock_lock(&ctx_pool_lock);
+    for (struct emulator_ctx **next = &ctx_pool; *next;) {
+        struct emulator_ctx *pooled = *next;
+        if (now - pooled->pool_released >= ctx_pool_idle_time) {
+            *next = pooled->pool_next;
+            pooled->pool_next = trimmed;
+            trimmed = pooled;
+            ctx_pool_count--;
+        } else {
+            next = &pooled->pool_next;
+        }
+    }
+    if (ctx_pool_count < ctx_pool_size) {
+        ctx->pool_released = now;
+        ctx->pool_next = ctx_pool;
+        ctx_pool = ctx;
+        ctx_pool_count++;
+        ctx = NULL;
+    }
+    os_unfair_lock_unlock(&ctx_pool_lock);
+    
+    if (ctx) {
+        free_emulator_ctx(ctx);
+    }
+    while (trimmed) {
+        struct emulator_ctx *next = trimmed->pool_next;
+        free_emulator_ctx(trimmed);
+        trimmed = next;
+    }
 }
 
 void run_emulator(struct emulator_ctx *ctx, uint64_t start_address) {
-    printf("running emulator at %p\n", (void*)start_address);
+    LOG_DEBUG(LOG_EMULATOR, "running emulator at %p\n", (void*)start_address);
     ctx->maybe_print_regs(ctx->uc, 1);
     
     uc_engine *uc = ctx->uc;
@@ -202,21 +422,54 @@ void run_emulator(struct emulator_ctx *ctx, uint64_t start_address) {
     Dl_info info;
     uc_reg_write(uc, UC_ARM64_REG_LR, &ctx->return_ptr);
     for(;;) {
+        mem_registry_sync(ctx);
+        coverage_sync(ctx);
+        uint64_t start = mach_absolute_time();
+        if (timeline_enabled) {
+            timeline_record(ctx, 'B', "emulator", "emulation");
+        }
+        __atomic_store_n(&ctx->in_emulation, true, __ATOMIC_RELEASE);
         err = uc_emu_start(uc, start_address, ctx->return_ptr, 0, 0);
+        __atomic_store_n(&ctx->in_emulation, false, __ATOMIC_RELEASE);
+        if (timeline_enabled) {
+            timeline_record(ctx, 'E', "emulator", "emulation");
+        }
+        bool sampled = __atomic_exchange_n(&ctx->sample_pending, false, __ATOMIC_ACQUIRE);
+        stat_add(&ctx->stats.emulated_ns, ticks_to_ns(mach_absolute_time() - start));
+        stat_add(&ctx->stats.emu_starts, 1);
         uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
+        struct native_gate *gate = err == UC_ERR_OK ? ctx->gate : NULL;
+        ctx->gate = NULL;
+        if (sampled && err == UC_ERR_OK && gate == NULL && pc != ctx->return_ptr) {
+            // stopped by the sampler, resume where it stopped
+            stat_add(&ctx->stats.exits[EMULATOR_EXIT_SAMPLE], 1);
+            sampler_record(ctx);
+            start_address = pc;
+            continue;
+        }
+        if (gate) {
+            // stopped by a native call gate
+            pc = gate->target;
+        }
         if (pc == ctx->return_ptr) {
-            printf("emulation done\n");
+            stat_add(&ctx->stats.exits[EMULATOR_EXIT_RETURN], 1);
+            LOG_DEBUG(LOG_EMULATOR, "emulation done\n");
             return;
-        } else if (err == UC_ERR_FETCH_PROT) {
+        } else if (gate || err == UC_ERR_FETCH_PROT) {
+            stat_add(&ctx->stats.exits[gate ? EMULATOR_EXIT_GATE : EMULATOR_EXIT_FETCH_PROT], 1);
             uint64_t last_lr;
             uc_reg_read(uc, UC_ARM64_REG_LR, &last_lr);
             ctx->maybe_print_regs(uc, 0);
+            uint64_t emulated_ns = ctx->stats.emulated_ns, native_ns = ctx->stats.native_ns;
+            start = mach_absolute_time();
             try {
-                start_address = call_native(uc, pc);
+                start_address = gate ? call_native_gate(ctx, gate) : call_native(ctx, pc);
             }
             catch (const std::exception& e) {
                 // find catch block
             }
+            // exclusive, nested calls are already counted
+            stat_add(&ctx->stats.native_ns, ticks_to_ns(mach_absolute_time() - start) - (ctx->stats.emulated_ns - emulated_ns) - (ctx->stats.native_ns - native_ns));
             if (start_address == SHIM_RETURN) {
                 start_address = last_lr;
             }
@@ -231,7 +484,8 @@ void run_emulator(struct emulator_ctx *ctx, uint64_t start_address) {
                 info.dli_fname = NULL;
                 info.dli_fbase = 0;
             }
-            printf("emulation finished badly at %p (%s+0x%llx:%s): %s\n", (void*)pc, info.dli_fname, pc ? pc - (uint64_t)info.dli_fbase : 0, info.dli_sname, uc_strerror(err));
+            stat_add(&ctx->stats.exits[EMULATOR_EXIT_ERROR], 1);
+            LOG_ERROR(LOG_EMULATOR, "emulation finished badly at %p (%s+0x%llx:%s): %s\n", (void*)pc, info.dli_fname, pc ? pc - (uint64_t)info.dli_fbase : 0, info.dli_sname, uc_strerror(err));
             abort();
         }
     };
@@ -256,19 +510,25 @@ static inline const char * uc_mem_type_to_string(uc_mem_type type) {
 static bool cb_invalid_rw(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, struct emulator_ctx *ctx) {
     uint64_t pc;
     uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
-    printf("cb_invalid_rw %s %p from %p\n", uc_mem_type_to_string(type), (void*)address, (void*)pc);
+    LOG_WARN(LOG_MEMORY, "cb_invalid_rw %s %p from %p\n", uc_mem_type_to_string(type), (void*)address, (void*)pc);
+    stat_add(&ctx->stats.rw_faults, 1);
     if (address < ctx->pagezero_size) {
         // in page zero
         return false;
     }
     
     // might be ok, find and map
-    return mem_map_region_containing(uc, address, UC_PROT_READ | UC_PROT_WRITE);
+    if (mem_map_region_containing(ctx, address, UC_PROT_READ | UC_PROT_WRITE)) {
+        record_fault_map(ctx, address);
+        return true;
+    }
+    return false;
 }
 
 
 static bool cb_invalid_fetch(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, struct emulator_ctx *ctx) {
     Dl_info info;
+    stat_add(&ctx->stats.fetch_faults, 1);
     if (address < ctx->pagezero_size) {
         // in page zero
         return false;
@@ -279,11 +539,19 @@ static bool cb_invalid_fetch(uc_engine *uc, uc_mem_type type, uint64_t address,
     } else if (dladdr((void*)address, &info)) {
         if (should_emulate_image((struct mach_header_64*)info.dli_fbase)) {
             // map as executable
-            printf("cb_invalid_fetch %s %p: mapping as executable\n", uc_mem_type_to_string(type), (void*)address);
-            return mem_map_region_containing(uc, address, UC_PROT_ALL);
+            LOG_DEBUG(LOG_MEMORY, "cb_invalid_fetch %s %p: mapping as executable\n", uc_mem_type_to_string(type), (void*)address);
+            if (mem_map_region_containing(ctx, address, UC_PROT_ALL)) {
+                record_fault_map(ctx, address);
+                return true;
+            }
+            return false;
         } else if (type == UC_MEM_FETCH_UNMAPPED) {
             // call to native unmapped memory
-            return mem_map_region_containing(uc, address, UC_PROT_READ);
+            if (mem_map_region_containing(ctx, address, UC_PROT_READ)) {
+                record_fault_map(ctx, address);
+                return true;
+            }
+            return false;
         } else {
             // call to native mapped memory? caught in run_emulator
             return false;
@@ -313,3 +581,13 @@ static bool cb_print_disasm(uc_engine *uc, uint64_t address, uint32_t size, stru
     
     return true;
 }
+
+static void cb_interrupt(uc_engine *uc, uint32_t intno, struct emulator_ctx *ctx) {
+    uint64_t pc;
+    uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
+    ctx->gate = native_gate_at(pc);
+    if (ctx->gate == NULL) {
+        LOG_WARN(LOG_EMULATOR, "unhandled interrupt %u at %p\n", intno, (void*)pc);
+    }
+    uc_emu_stop(uc);
+}
@@ -0,0 +1,221 @@
+//
+//  entry_stats.c
+//  aah
+//
+//  Per entry point call counts and times (ENTRY_STATS=1), to find which
+//  functions dominate transition costs. Each emulator context has its own
+//  shard, indexed by entry->index, so counting never touches shared cache
+//  lines. Shards of freed contexts are merged into entry_stats_retired.
+//
+
+#include "aah.h"
+#include <mach/mach_time.h>
+#include <math.h>
+#include <os/lock.h>
+
+#define ENTRY_STATS_PAGE_SIZE 256
+#define ENTRY_STATS_MAX_PAGES 4096 // 1M entry points
+#define ENTRY_STATS_BUCKETS 16 // powers of 4 ns, the last one is >= 1s
+
+struct entry_stats_counter {
+    uint64_t calls;
+    uint64_t time; // ns, inclusive of nested calls
+    uint32_t histogram[ENTRY_STATS_BUCKETS];
+};
+
+struct entry_stats_slot {
+    const struct entry_point *entry;
+    struct entry_stats_counter counters[ENTRY_STATS_DIRECTIONS];
+};
+
+// only written by its context's thread, read racily when printing
+struct entry_stats_shard {
+    struct entry_stats_shard *next;
+    struct entry_stats_slot *pages[ENTRY_STATS_MAX_PAGES];
+};
+
+hidden bool entry_stats_enabled = false;
+static mach_timebase_info_data_t entry_stats_timebase;
+static struct entry_stats_shard *entry_stats_shards = NULL;
+static struct entry_stats_shard entry_stats_retired;
+static os_unfair_lock entry_stats_lock = OS_UNFAIR_LOCK_INIT;
+
+hidden void init_entry_stats(void) {
+    if (getenv("ENTRY_STATS") && strtol(getenv("ENTRY_STATS"), NULL, 10)) {
+        mach_timebase_info(&entry_stats_timebase);
+        entry_stats_enabled = true;
+        atexit(aah_print_entry_stats);
+    }
+}
+
+hidden uint64_t entry_stats_now(void) {
+    return mach_absolute_time();
+}
+
+static inline void add_relaxed(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static struct entry_stats_slot * shard_slot(struct entry_stats_shard *shard, uint32_t index) {
+    uint32_t page = index / ENTRY_STATS_PAGE_SIZE;
+    if (page >= ENTRY_STATS_MAX_PAGES) {
+        return NULL;
+    }
+    struct entry_stats_slot *slots = shard->pages[page];
+    if (slots == NULL) {
+        slots = calloc(ENTRY_STATS_PAGE_SIZE, sizeof(struct entry_stats_slot));
+        __atomic_store_n(&shard->pages[page], slots, __ATOMIC_RELEASE);
+    }
+    return &slots[index % ENTRY_STATS_PAGE_SIZE];
+}
+
+hidden void entry_stats_record(struct emulator_ctx *ctx, const struct entry_point *entry, enum entry_stats_direction direction, uint64_t start) {
+    uint64_t ns = (entry_stats_now() - start) * entry_stats_timebase.numer / entry_stats_timebase.denom;
+    struct entry_stats_shard *shard = ctx->entry_stats;
+    if (shard == NULL) {
+        shard = ctx->entry_stats = calloc(1, sizeof(struct entry_stats_shard));
+        os_unfair_lock_lock(&entry_stats_lock);
+        shard->next = entry_stats_shards;
+        entry_stats_shards = shard;
+        os_unfair_lock_unlock(&entry_stats_lock);
+    }
+    struct entry_stats_slot *slot = shard_slot(shard, entry->index);
+    if (slot == NULL) {
+        return;
+    }
+    slot->entry = entry;
+    struct entry_stats_counter *counter = &slot->counters[direction];
+    add_relaxed(&counter->calls, 1);
+    add_relaxed(&counter->time, ns);
+    uint32_t bucket = (63 - __builtin_clzll(ns | 1)) / 2;
+    if (bucket >= ENTRY_STATS_BUCKETS) {
+        bucket = ENTRY_STATS_BUCKETS - 1;
+    }
+    __atomic_store_n(&counter->histogram[bucket], counter->histogram[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+// adds src into dst, under entry_stats_lock
+static void shard_merge(struct entry_stats_shard *dst, struct entry_stats_shard *src) {
+    for (uint32_t page = 0; page < ENTRY_STATS_MAX_PAGES; page++) {
+        struct entry_stats_slot *slots = __atomic_load_n(&src->pages[page], __ATOMIC_ACQUIRE);
+        if (slots == NULL) {
+            continue;
+        }
+        for (uint32_t i = 0; i < ENTRY_STATS_PAGE_SIZE; i++) {
+            const struct entry_stats_slot *from = &slots[i];
+            if (from->entry == NULL) {
+                continue;
+            }
+            struct entry_stats_slot *to = shard_slot(dst, page * ENTRY_STATS_PAGE_SIZE + i);
+            to->entry = from->entry;
+            for (int d = 0; d < ENTRY_STATS_DIRECTIONS; d++) {
+                to->counters[d].calls += __atomic_load_n(&from->counters[d].calls, __ATOMIC_RELAXED);
+                to->counters[d].time += __atomic_load_n(&from->counters[d].time, __ATOMIC_RELAXED);
+                for (int b = 0; b < ENTRY_STATS_BUCKETS; b++) {
+                    to->counters[d].histogram[b] += __atomic_load_n(&from->counters[d].histogram[b], __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+}
+
+static void shard_free_pages(struct entry_stats_shard *shard) {
+    for (uint32_t page = 0; page < ENTRY_STATS_MAX_PAGES; page++) {
+        free(shard->pages[page]);
+    }
+}
+
+hidden void entry_stats_retire(struct emulator_ctx *ctx) {
+    struct entry_stats_shard *shard = ctx->entry_stats;
+    if (shard == NULL) {
+        return;
+    }
+    os_unfair_lock_lock(&entry_stats_lock);
+    for (struct entry_stats_shard **next = &entry_stats_shards; *next; next = &(*next)->next) {
+        if (*next == shard) {
+            *next = shard->next;
+            break;
+        }
+    }
+    shard_merge(&entry_stats_retired, shard);
+    os_unfair_lock_unlock(&entry_stats_lock);
+    shard_free_pages(shard);
+    free(shard);
+    ctx->entry_stats = NULL;
+}
+
+// MARK: report
+
+static uint64_t total_time(const struct entry_stats_slot *slot) {
+    return slot->counters[ENTRY_STATS_NATIVE].time + slot->counters[ENTRY_STATS_EMULATED].time;
+}
+
+static int compare_slots(const void *a, const void *b) {
+    uint64_t ta = total_time(*(const struct entry_stats_slot **)a), tb = total_time(*(const struct entry_stats_slot **)b);
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+// upper bound of the bucket containing the given fraction of calls
+static double percentile_us(const struct entry_stats_counter *counter, double fraction) {
+    uint64_t target = counter->calls * fraction, seen = 0;
+    for (int b = 0; b < ENTRY_STATS_BUCKETS - 1; b++) {
+        seen += counter->histogram[b];
+        if (seen > target) {
+            return (double)(1ULL << (2 * (b + 1))) / 1000.0;
+        }
+    }
+    return INFINITY;
+}
+
+static void print_counter(const char *what, const struct entry_stats_counter *counter) {
+    if (counter->calls == 0) {
+        return;
+    }
+    printf("    %-8s %10llu calls %12.3f ms total %10.3f us mean, p50 < %.3f us, p99 < %.3f us\n", what,
+           counter->calls, counter->time / 1e6, counter->time / 1e3 / counter->calls,
+           percentile_us(counter, 0.5), percentile_us(counter, 0.99));
+}
+
+// on demand from the debugger, and at exit with ENTRY_STATS=1
+void aah_print_entry_stats(void) {
+    if (!entry_stats_enabled) {
+        printf("entry point stats are disabled, set ENTRY_STATS=1\n");
+        return;
+    }
+    // totals of live and retired shards
+    struct entry_stats_shard *totals = calloc(1, sizeof(struct entry_stats_shard));
+    os_unfair_lock_lock(&entry_stats_lock);
+    shard_merge(totals, &entry_stats_retired);
+    for (struct entry_stats_shard *shard = entry_stats_shards; shard; shard = shard->next) {
+        shard_merge(totals, shard);
+    }
+    os_unfair_lock_unlock(&entry_stats_lock);
+
+    struct entry_stats_slot **slots = NULL;
+    size_t count = 0;
+    for (uint32_t page = 0; page < ENTRY_STATS_MAX_PAGES; page++) {
+        for (uint32_t i = 0; totals->pages[page] && i < ENTRY_STATS_PAGE_SIZE; i++) {
+            if (totals->pages[page][i].entry) {
+                slots = realloc(slots, (count + 1) * sizeof(*slots));
+                slots[count++] = &totals->pages[page][i];
+            }
+        }
+    }
+    qsort(slots, count, sizeof(*slots), compare_slots);
+
+    static const char *kind_names[] = {
+        [ENTRY_POINT_CIF] = "native",
+        [ENTRY_POINT_SHIM] = "shim",
+        [ENTRY_POINT_WRAPPER] = "wrapper",
+    };
+    printf("entry point stats: %zu entry points called, by total time\n", count);
+    for (size_t i = 0; i < count; i++) {
+        const struct entry_point *entry = slots[i]->entry;
+        printf("  %s (%p)\n", entry->name ? entry->name : "(unknown)", entry->address);
+        print_counter(kind_names[entry->kind], &slots[i]->counters[ENTRY_STATS_NATIVE]);
+        print_counter("emulated", &slots[i]->counters[ENTRY_STATS_EMULATED]);
+    }
+    free(slots);
+    shard_free_pages(totals);
+    free(totals);
+}
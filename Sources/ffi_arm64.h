@@ -18,6 +18,12 @@ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
 TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
 SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 
+#ifndef ffi_arm64_h
+#define ffi_arm64_h
+
+#include <stdint.h>
+#include <ffi.h>
+
 #define AARCH64_RET_VOID	0
 #define AARCH64_RET_INT64	1
 #define AARCH64_RET_INT128	2
@@ -62,6 +68,9 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 #define AARCH64_FLAG_ARG_V_BIT	7
 #define AARCH64_FLAG_ARG_V	(1 << AARCH64_FLAG_ARG_V_BIT)
 
+/* Emulated code follows Apple's variant of the AAPCS64 on any host.  */
+#define AARCH64_APPLE_ABI	1
+
 #define N_X_ARG_REG		8
 #define N_V_ARG_REG		8
 #define CALL_CONTEXT_SIZE	(N_V_ARG_REG * 16 + N_X_ARG_REG * 8)
@@ -83,6 +92,28 @@ struct arm64_call_context
   uint64_t x[N_X_ARG_REG+1];
 };
 
+/* Where an argument is found on entry to a function, the same in both
+   marshalling directions.  Computed once per cif by ffi_prep_cif_arm64.  */
+enum arm64_arg_location
+{
+  ARM64_ARG_X,			/* integer in x[reg], extended from type */
+  ARM64_ARG_X_COMPOSITE,	/* size bytes in x[reg] onwards */
+  ARM64_ARG_X_INDIRECT,		/* pointer to a composite in x[reg] */
+  ARM64_ARG_V,			/* HFA, one element in each of v[reg] onwards */
+  ARM64_ARG_STACK,		/* size bytes at stack + offset */
+  ARM64_ARG_STACK_INDIRECT,	/* pointer to a composite at stack + offset */
+};
+
+struct arm64_arg_move
+{
+  uint8_t location;
+  uint8_t type;			/* FFI_TYPE_* of ARM64_ARG_X */
+  uint8_t reg;
+  uint8_t h;			/* AARCH64_RET_* of ARM64_ARG_V */
+  uint32_t size;
+  uint32_t offset;
+};
+
 typedef struct {
   ffi_abi abi;
   uint32_t nargs;
@@ -91,6 +122,8 @@ typedef struct {
   uint32_t bytes;
   uint32_t flags;
   uint32_t aarch64_nfixedargs;
+  struct arm64_arg_move *moves;	/* one per argument */
+  uint32_t x_mask, v_mask;	/* live argument registers, x8 for AARCH64_RET_IN_MEM */
 } ffi_cif_arm64;
 
 #define FFI_ALIGN(v, a)  (((((size_t) (v))-1) | ((a)-1))+1)
@@ -114,6 +147,14 @@ hidden ffi_status ffi_prep_cif_arm64(ffi_cif_arm64 *cif,
                              unsigned int ntotalargs,
                              ffi_type *rtype, ffi_type **atypes);
 
+/* Frees the argument placement plan, arg_types belong to the caller.  */
+hidden void ffi_dispose_cif_arm64(ffi_cif_arm64 *cif);
+
+/* Places arguments by the plan: registers into context, which the caller
+   zeroes, and the rest into stack, which has room for cif->bytes.  */
+hidden void ffi_arm64_place_arguments(const ffi_cif_arm64 *cif, void **args,
+                                      struct arm64_call_context *context, void *stack);
+
 hidden int ffi_closure_SYSV_inner_arm64 (ffi_cif_arm64 *cif,
                                   void (*fun)(ffi_cif_arm64*,void*,void**,void*),
                                   void *user_data,
@@ -121,3 +162,7 @@ hidden int ffi_closure_SYSV_inner_arm64 (ffi_cif_arm64 *cif,
                                   void *stack, void *rvalue);
 
 hidden int arm64_rflags_for_type(ffi_type *rtype);
+/* The AARCH64_RET_* constant if ty is a homogeneous floating point aggregate, else 0.  */
+hidden int is_vfp_type(const ffi_type *ty);
+
+#endif /* ffi_arm64_h */
@@ -0,0 +1,735 @@
+//
+//  ffi_arm64_cif.c
+//  aah
+//
+//  AAPCS64 classification and argument placement plans for ffi_cif_arm64,
+//  adapted from libffi's aarch64 port. Doesn't depend on macOS or unicorn.
+//
+
+#include <ffi.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ffi_arm64.h"
+
+/* Representation of the procedure call argument marshalling
+   state.
+
+   The terse state variable names match the names used in the AARCH64
+   PCS. */
+
+struct arg_state
+{
+  unsigned ngrn;                /* Next general-purpose register number. */
+  unsigned nsrn;                /* Next vector register number. */
+  size_t nsaa;                  /* Next stack offset. */
+
+#if AARCH64_APPLE_ABI
+  unsigned allocating_variadic;
+#endif
+};
+
+/* Initialize a procedure call argument marshalling state.  */
+static void
+arg_init (struct arg_state *state)
+{
+  state->ngrn = 0;
+  state->nsrn = 0;
+  state->nsaa = 0;
+#if AARCH64_APPLE_ABI
+  state->allocating_variadic = 0;
+#endif
+}
+
+/* A subroutine of is_vfp_type.  Given a structure type, return the type code
+   of the first non-structure element.  Recurse for structure elements.
+   Return -1 if the structure is in fact empty, i.e. no nested elements.  */
+
+static int is_hfa0 (const ffi_type *ty)
+{
+  ffi_type **elements = ty->elements;
+  int i, ret = -1;
+
+  if (elements != NULL)
+    for (i = 0; elements[i]; ++i)
+      {
+        ret = elements[i]->type;
+        if (ret == FFI_TYPE_STRUCT || ret == FFI_TYPE_COMPLEX)
+          {
+            ret = is_hfa0 (elements[i]);
+            if (ret < 0)
+              continue;
+          }
+        break;
+      }
+
+  return ret;
+}
+
+/* A subroutine of is_vfp_type.  Given a structure type, return true if all
+   of the non-structure elements are the same as CANDIDATE.  */
+
+static int is_hfa1 (const ffi_type *ty, int candidate)
+{
+  ffi_type **elements = ty->elements;
+  int i;
+
+  if (elements != NULL)
+    for (i = 0; elements[i]; ++i)
+      {
+        int t = elements[i]->type;
+        if (t == FFI_TYPE_STRUCT || t == FFI_TYPE_COMPLEX)
+          {
+            if (!is_hfa1 (elements[i], candidate))
+              return 0;
+          }
+        else if (t != candidate)
+          return 0;
+      }
+
+  return 1;
+}
+
+/* Determine if TY may be allocated to the FP registers.  This is both an
+   fp scalar type as well as an homogenous floating point aggregate (HFA).
+   That is, a structure consisting of 1 to 4 members of all the same type,
+   where that type is an fp scalar.
+
+   Returns non-zero iff TY is an HFA.  The result is the AARCH64_RET_*
+   constant for the type.  */
+
+int is_vfp_type (const ffi_type *ty)
+{
+  ffi_type **elements;
+  int candidate, i;
+  size_t size, ele_count;
+
+  /* Quickest tests first.  */
+  candidate = ty->type;
+  switch (candidate)
+    {
+    default:
+      return 0;
+    case FFI_TYPE_FLOAT:
+    case FFI_TYPE_DOUBLE:
+    case FFI_TYPE_LONGDOUBLE:
+      ele_count = 1;
+      goto done;
+    case FFI_TYPE_COMPLEX:
+      candidate = ty->elements[0]->type;
+      switch (candidate)
+	{
+	case FFI_TYPE_FLOAT:
+	case FFI_TYPE_DOUBLE:
+	case FFI_TYPE_LONGDOUBLE:
+	  ele_count = 2;
+	  goto done;
+	}
+      return 0;
+    case FFI_TYPE_STRUCT:
+      break;
+    }
+
+  /* No HFA types are smaller than 4 bytes, or larger than 64 bytes.  */
+  size = ty->size;
+  if (size < 4 || size > 64)
+    return 0;
+
+  /* Find the type of the first non-structure member.  */
+  elements = ty->elements;
+  candidate = elements[0]->type;
+  if (candidate == FFI_TYPE_STRUCT || candidate == FFI_TYPE_COMPLEX)
+    {
+      for (i = 0; ; ++i)
+        {
+          candidate = is_hfa0 (elements[i]);
+          if (candidate >= 0)
+            break;
+        }
+    }
+
+  /* If the first member is not a floating point type, it's not an HFA.
+     Also quickly re-check the size of the structure.  */
+  switch (candidate)
+    {
+    case FFI_TYPE_FLOAT:
+      ele_count = size / sizeof(float);
+      if (size != ele_count * sizeof(float))
+        return 0;
+      break;
+    case FFI_TYPE_DOUBLE:
+    case FFI_TYPE_LONGDOUBLE:
+      ele_count = size / sizeof(double);
+      if (size != ele_count * sizeof(double))
+        return 0;
+      break;
+    default:
+      return 0;
+    }
+  if (ele_count > 4)
+    return 0;
+
+  /* Finally, make sure that all scalar elements are the same type.  */
+  for (i = 0; elements[i]; ++i)
+    {
+      int t = elements[i]->type;
+      if (t == FFI_TYPE_STRUCT || t == FFI_TYPE_COMPLEX)
+        {
+          if (!is_hfa1 (elements[i], candidate))
+            return 0;
+        }
+      else if (t != candidate)
+        return 0;
+    }
+
+  /* All tests succeeded.  Encode the result.  */
+ done:
+  return candidate * 4 + (4 - (int)ele_count);
+}
+
+/* Structures without members, like {?=} in some signatures, and
+   aggregates of them take no space and return nothing.  */
+static int is_empty_aggregate (const ffi_type *ty)
+{
+  ffi_type **ptr;
+
+  if (ty->type != FFI_TYPE_STRUCT || ty->size != 0 || ty->elements == NULL)
+    return 0;
+  for (ptr = ty->elements; *ptr != NULL; ptr++)
+    if (!is_empty_aggregate (*ptr))
+      return 0;
+  return 1;
+}
+
+static ffi_status initialize_aggregate(ffi_type *arg, size_t *offsets)
+{
+  ffi_type **ptr;
+
+  if (UNLIKELY(arg == NULL || arg->elements == NULL))
+    return FFI_BAD_TYPEDEF;
+
+  arg->size = 0;
+  arg->alignment = 0;
+
+  ptr = &(arg->elements[0]);
+
+  if (UNLIKELY(ptr == 0))
+    return FFI_BAD_TYPEDEF;
+
+  while ((*ptr) != NULL)
+    {
+      if (is_empty_aggregate (*ptr))
+	{
+	  if (offsets)
+	    *offsets++ = arg->size;
+	  ptr++;
+	  continue;
+	}
+
+      if (UNLIKELY(((*ptr)->size == 0)
+		    && (initialize_aggregate((*ptr), NULL) != FFI_OK)))
+	return FFI_BAD_TYPEDEF;
+
+      /* Perform a sanity check on the argument type */
+      FFI_ASSERT_VALID_TYPE(*ptr);
+
+      arg->size = FFI_ALIGN(arg->size, (*ptr)->alignment);
+      if (offsets)
+	*offsets++ = arg->size;
+      arg->size += (*ptr)->size;
+
+      arg->alignment = (arg->alignment > (*ptr)->alignment) ?
+	arg->alignment : (*ptr)->alignment;
+
+      ptr++;
+    }
+
+  /* Structure size includes tail padding.  This is important for
+     structures that fit in one register on ABIs like the PowerPC64
+     Linux ABI that right justify small structs in a register.
+     It's also needed for nested structure layout, for example
+     struct A { long a; char b; }; struct B { struct A x; char y; };
+     should find y at an offset of 2*sizeof(long) and result in a
+     total size of 3*sizeof(long).  */
+  arg->size = FFI_ALIGN (arg->size, arg->alignment);
+
+  /* On some targets, the ABI defines that structures have an additional
+     alignment beyond the "natural" one based on their elements.  */
+#ifdef FFI_AGGREGATE_ALIGNMENT
+  if (FFI_AGGREGATE_ALIGNMENT > arg->alignment)
+    arg->alignment = FFI_AGGREGATE_ALIGNMENT;
+#endif
+
+  if (arg->size == 0)
+    return FFI_BAD_TYPEDEF;
+  else
+    return FFI_OK;
+}
+
+ffi_status
+ffi_prep_cif_machdep_arm64 (ffi_cif_arm64 *cif)
+{
+  ffi_type *rtype = cif->rtype;
+  size_t bytes = cif->bytes;
+  int flags, i, n;
+
+  switch (rtype->type)
+    {
+    case FFI_TYPE_VOID:
+      flags = AARCH64_RET_VOID;
+      break;
+    case FFI_TYPE_UINT8:
+      flags = AARCH64_RET_UINT8;
+      break;
+    case FFI_TYPE_UINT16:
+      flags = AARCH64_RET_UINT16;
+      break;
+    case FFI_TYPE_UINT32:
+      flags = AARCH64_RET_UINT32;
+      break;
+    case FFI_TYPE_SINT8:
+      flags = AARCH64_RET_SINT8;
+      break;
+    case FFI_TYPE_SINT16:
+      flags = AARCH64_RET_SINT16;
+      break;
+    case FFI_TYPE_INT:
+    case FFI_TYPE_SINT32:
+      flags = AARCH64_RET_SINT32;
+      break;
+    case FFI_TYPE_SINT64:
+    case FFI_TYPE_UINT64:
+      flags = AARCH64_RET_INT64;
+      break;
+    case FFI_TYPE_POINTER:
+      flags = (sizeof(void *) == 4 ? AARCH64_RET_UINT32 : AARCH64_RET_INT64);
+      break;
+
+    case FFI_TYPE_FLOAT:
+    case FFI_TYPE_DOUBLE:
+    case FFI_TYPE_LONGDOUBLE:
+    case FFI_TYPE_STRUCT:
+    case FFI_TYPE_COMPLEX:
+      flags = is_vfp_type (rtype);
+      if (flags == 0)
+	{
+	  size_t s = rtype->size;
+	  if (s == 0)
+	    flags = AARCH64_RET_VOID;
+	  else if (s > 16)
+	    {
+	      flags = AARCH64_RET_VOID | AARCH64_RET_IN_MEM;
+	      bytes += 8;
+	    }
+	  else if (s == 16)
+	    flags = AARCH64_RET_INT128;
+	  else if (s == 8)
+	    flags = AARCH64_RET_INT64;
+	  else
+	    flags = AARCH64_RET_INT128 | AARCH64_RET_NEED_COPY;
+	}
+      break;
+
+    default:
+      abort();
+    }
+
+  for (i = 0, n = cif->nargs; i < n; i++)
+    if (is_vfp_type (cif->arg_types[i]))
+      {
+	flags |= AARCH64_FLAG_ARG_V;
+	break;
+      }
+
+  /* Round the stack up to a multiple of the stack alignment requirement. */
+  cif->bytes = (unsigned) FFI_ALIGN(bytes, 16);
+  cif->flags = flags;
+  cif->aarch64_nfixedargs = 0;
+
+  return FFI_OK;
+}
+
+ffi_status
+ffi_prep_cif_machdep_var_arm64(ffi_cif_arm64 *cif, unsigned int nfixedargs,
+			 unsigned int ntotalargs)
+{
+  ffi_status status = ffi_prep_cif_machdep_arm64 (cif);
+  cif->aarch64_nfixedargs = nfixedargs;
+  return status;
+}
+
+#define STACK_ARG_SIZE(x) FFI_ALIGN(x, 16)
+
+static ffi_status prep_arg_moves (ffi_cif_arm64 *cif);
+
+// adapted from ffi_prep_cif_core
+ffi_status ffi_prep_cif_arm64(ffi_cif_arm64 *cif,
+                             unsigned int isvariadic,
+                             unsigned int nfixedargs,
+                             unsigned int ntotalargs,
+                             ffi_type *rtype, ffi_type **atypes) {
+  unsigned bytes = 0;
+  unsigned int i;
+  ffi_type **ptr;
+
+  FFI_ASSERT(cif != NULL);
+  FFI_ASSERT((!isvariadic) || (nfixedargs >= 1));
+  FFI_ASSERT(nfixedargs <= ntotalargs);
+
+  cif->abi = FFI_DEFAULT_ABI;
+  cif->arg_types = atypes;
+  cif->nargs = ntotalargs;
+  cif->rtype = rtype;
+
+  cif->flags = 0;
+
+  /* Initialize the return type if necessary */
+  if ((cif->rtype->size == 0) && !is_empty_aggregate (cif->rtype)
+      && (initialize_aggregate(cif->rtype, NULL) != FFI_OK))
+    return FFI_BAD_TYPEDEF;
+
+  /* Perform a sanity check on the return type */
+  FFI_ASSERT_VALID_TYPE(cif->rtype);
+
+  /* Make space for the return structure pointer */
+  if (cif->rtype->type == FFI_TYPE_STRUCT) {
+    bytes = STACK_ARG_SIZE(sizeof(void*));
+  }
+
+  for (ptr = cif->arg_types, i = cif->nargs; i > 0; i--, ptr++)
+    {
+      if (is_empty_aggregate (*ptr))
+	continue;
+
+      /* Initialize any uninitialized aggregate type definitions */
+      if (((*ptr)->size == 0)
+	  && (initialize_aggregate((*ptr), NULL) != FFI_OK))
+	return FFI_BAD_TYPEDEF;
+
+      /* Perform a sanity check on the argument type, do this
+	 check after the initialization.  */
+      FFI_ASSERT_VALID_TYPE(*ptr);
+
+	{
+	  /* Add any padding if necessary */
+	  if (((*ptr)->alignment - 1) & bytes)
+	    bytes = (unsigned)FFI_ALIGN(bytes, (*ptr)->alignment);
+	  bytes += STACK_ARG_SIZE((*ptr)->size);
+	}
+    }
+
+  cif->bytes = bytes;
+  cif->moves = NULL;
+
+  /* Perform machine dependent cif processing */
+  ffi_status status;
+  if (isvariadic)
+	status = ffi_prep_cif_machdep_var_arm64(cif, nfixedargs, ntotalargs);
+  else
+	status = ffi_prep_cif_machdep_arm64(cif);
+
+  if (status != FFI_OK)
+    return status;
+  return prep_arg_moves(cif);
+}
+
+/* Allocate an aligned slot on the stack and return its offset.  */
+static size_t
+allocate_to_stack (struct arg_state *state, size_t alignment, size_t size)
+{
+  size_t nsaa = state->nsaa;
+
+  /* Round up the NSAA to the larger of 8 or the natural
+     alignment of the argument's type.  */
+#if AARCH64_APPLE_ABI
+  if (state->allocating_variadic && alignment < 8)
+    alignment = 8;
+#else
+  if (alignment < 8)
+    alignment = 8;
+#endif
+    
+  nsaa = FFI_ALIGN (nsaa, alignment);
+  state->nsaa = nsaa + size;
+
+  return nsaa;
+}
+
+/* Either allocate an appropriate register for the argument type, or if
+   none are available, allocate a stack slot.  */
+
+static void
+allocate_int_to_reg_or_stack (ffi_cif_arm64 *cif, struct arm64_arg_move *move,
+			      struct arg_state *state, size_t size, int indirect)
+{
+  if (state->ngrn < N_X_ARG_REG)
+    {
+      move->location = indirect ? ARM64_ARG_X_INDIRECT : ARM64_ARG_X;
+      move->reg = state->ngrn++;
+      cif->x_mask |= 1 << move->reg;
+      return;
+    }
+
+  state->ngrn = N_X_ARG_REG;
+  move->location = indirect ? ARM64_ARG_STACK_INDIRECT : ARM64_ARG_STACK;
+  move->offset = allocate_to_stack (state, size, size);
+}
+
+/* Run the AAPCS64 allocation once and record where each argument goes,
+   so that marshalling in either direction doesn't classify types.  */
+
+static ffi_status
+prep_arg_moves (ffi_cif_arm64 *cif)
+{
+  struct arg_state state;
+  unsigned i, n, h;
+
+  cif->moves = cif->nargs ? calloc (cif->nargs, sizeof (struct arm64_arg_move)) : NULL;
+  if (cif->nargs && cif->moves == NULL)
+    return FFI_BAD_TYPEDEF;
+  cif->x_mask = (cif->flags & AARCH64_RET_IN_MEM) ? 1 << 8 : 0;
+  cif->v_mask = 0;
+
+  arg_init (&state);
+  for (i = 0; i < cif->nargs; i++)
+    {
+      ffi_type *ty = cif->arg_types[i];
+      struct arm64_arg_move *move = &cif->moves[i];
+      size_t s = ty->size;
+
+      move->type = ty->type;
+      move->size = (uint32_t)s;
+      switch (ty->type)
+	{
+	case FFI_TYPE_INT:
+	case FFI_TYPE_UINT8:
+	case FFI_TYPE_SINT8:
+	case FFI_TYPE_UINT16:
+	case FFI_TYPE_SINT16:
+	case FFI_TYPE_UINT32:
+	case FFI_TYPE_SINT32:
+	case FFI_TYPE_UINT64:
+	case FFI_TYPE_SINT64:
+	case FFI_TYPE_POINTER:
+	  allocate_int_to_reg_or_stack (cif, move, &state, s, 0);
+	  break;
+
+	case FFI_TYPE_FLOAT:
+	case FFI_TYPE_DOUBLE:
+	case FFI_TYPE_LONGDOUBLE:
+	case FFI_TYPE_STRUCT:
+	case FFI_TYPE_COMPLEX:
+	  if (s == 0)
+	    {
+	      /* Empty structures take no registers or stack.  */
+	      move->location = ARM64_ARG_X_COMPOSITE;
+	      break;
+	    }
+	  h = is_vfp_type (ty);
+	  if (h)
+	    {
+	      n = 4 - (h & 3);
+	      if (state.nsrn + n <= N_V_ARG_REG)
+		{
+		  move->location = ARM64_ARG_V;
+		  move->reg = state.nsrn;
+		  move->h = h;
+		  cif->v_mask |= ((1 << n) - 1) << state.nsrn;
+		  state.nsrn += n;
+		}
+	      else
+		{
+		  state.nsrn = N_V_ARG_REG;
+		  move->location = ARM64_ARG_STACK;
+		  move->offset = allocate_to_stack (&state, ty->alignment, s);
+		}
+	    }
+	  else if (s > 16)
+	    {
+	      /* Replace Composite type of size greater than 16 with a
+		 pointer.  */
+	      move->size = sizeof (void *);
+	      allocate_int_to_reg_or_stack (cif, move, &state, sizeof (void *), 1);
+	    }
+	  else
+	    {
+	      n = (s + 7) / 8;
+	      if (state.ngrn + n <= N_X_ARG_REG)
+		{
+		  move->location = ARM64_ARG_X_COMPOSITE;
+		  move->reg = state.ngrn;
+		  cif->x_mask |= ((1 << n) - 1) << state.ngrn;
+		  state.ngrn += n;
+		}
+	      else
+		{
+		  state.ngrn = N_X_ARG_REG;
+		  move->location = ARM64_ARG_STACK;
+		  move->offset = allocate_to_stack (&state, ty->alignment, s);
+		}
+	    }
+	  break;
+
+	default:
+	  free (cif->moves);
+	  cif->moves = NULL;
+	  return FFI_BAD_TYPEDEF;
+	}
+
+#if AARCH64_APPLE_ABI
+      if (i + 1 == cif->aarch64_nfixedargs)
+	{
+	  state.ngrn = N_X_ARG_REG;
+	  state.nsrn = N_V_ARG_REG;
+	  state.allocating_variadic = 1;
+	}
+#endif
+    }
+
+  return FFI_OK;
+}
+
+void ffi_dispose_cif_arm64 (ffi_cif_arm64 *cif)
+{
+  free (cif->moves);
+  cif->moves = NULL;
+}
+
+hidden int arm64_rflags_for_type(ffi_type *rtype) {
+    int rflags = 0;
+    switch(rtype->type) {
+        case FFI_TYPE_VOID:
+            rflags = AARCH64_RET_VOID;
+            break;
+        case FFI_TYPE_UINT8:
+            rflags = AARCH64_RET_UINT8;
+            break;
+        case FFI_TYPE_UINT16:
+            rflags = AARCH64_RET_UINT16;
+            break;
+        case FFI_TYPE_UINT32:
+            rflags = AARCH64_RET_UINT32;
+            break;
+        case FFI_TYPE_SINT8:
+            rflags = AARCH64_RET_SINT8;
+            break;
+        case FFI_TYPE_SINT16:
+            rflags = AARCH64_RET_SINT16;
+            break;
+        case FFI_TYPE_INT:
+        case FFI_TYPE_SINT32:
+            rflags = AARCH64_RET_SINT32;
+            break;
+        case FFI_TYPE_SINT64:
+        case FFI_TYPE_UINT64:
+            rflags = AARCH64_RET_INT64;
+            break;
+        case FFI_TYPE_POINTER:
+            rflags = AARCH64_RET_INT64;
+            break;
+        case FFI_TYPE_FLOAT:
+        case FFI_TYPE_DOUBLE:
+        case FFI_TYPE_LONGDOUBLE:
+        case FFI_TYPE_STRUCT:
+        case FFI_TYPE_COMPLEX:
+            rflags = is_vfp_type (rtype);
+            if (rflags == 0) {
+                size_t s = rtype->size;
+                if (s == 0) {
+                    rflags = AARCH64_RET_VOID;
+                } else if (s > 16) {
+                    rflags = AARCH64_RET_VOID | AARCH64_RET_IN_MEM;
+                } else if (s == 16) {
+                    rflags = AARCH64_RET_INT128;
+                } else {
+                    rflags = AARCH64_RET_INT64;
+                }
+            }
+            break;
+        default:
+            abort();
+    }
+    return rflags;
+}
+
+static void extend_hfa_type (struct arm64_call_context *context, unsigned nsrn, void *src, int h) {
+    size_t size;
+    if (h >= AARCH64_RET_S4 && h <= AARCH64_RET_S1) {
+        size = 4;
+    } else if (h >= AARCH64_RET_D4 && h <= AARCH64_RET_D1) {
+        size = 8;
+    } else if (h >= AARCH64_RET_Q4 && h <= AARCH64_RET_Q1) {
+        size = 16;
+    } else {
+        abort();
+    }
+    // one element per register, in the low bits
+    for (int i = 0; i < 4 - (h & 3); i++) {
+        memcpy(&context->v[nsrn + i], src + i * size, size);
+    }
+}
+
+static uint64_t extend_integer_type (void *source, int type) {
+    switch (type) {
+        case FFI_TYPE_UINT8:
+            return *(uint8_t *) source;
+        case FFI_TYPE_SINT8:
+            return *(int8_t *) source;
+        case FFI_TYPE_UINT16:
+            return *(uint16_t *) source;
+        case FFI_TYPE_SINT16:
+            return *(int16_t *) source;
+        case FFI_TYPE_UINT32:
+            return *(uint32_t *) source;
+        case FFI_TYPE_INT:
+        case FFI_TYPE_SINT32:
+            return *(int32_t *) source;
+        case FFI_TYPE_UINT64:
+        case FFI_TYPE_SINT64:
+            return *(uint64_t *) source;
+        case FFI_TYPE_POINTER:
+            return *(uintptr_t *) source;
+        default:
+          abort();
+    }
+}
+
+/* Place the arguments of a call into emulated code by the plan of CIF:
+   registers into CONTEXT, which the caller zeroes, and the rest into
+   STACK, which has room for cif->bytes.  */
+
+void ffi_arm64_place_arguments (const ffi_cif_arm64 *cif, void **args,
+				struct arm64_call_context *context, void *stack)
+{
+    int i, nargs;
+    for (i = 0, nargs = cif->nargs; i < nargs; i++) {
+        const struct arm64_arg_move *move = &cif->moves[i];
+        void *a = args[i];
+        switch (move->location) {
+            case ARM64_ARG_X:
+                context->x[move->reg] = extend_integer_type(a, move->type);
+                break;
+            case ARM64_ARG_X_COMPOSITE:
+                memcpy(&context->x[move->reg], a, move->size);
+                break;
+            case ARM64_ARG_X_INDIRECT:
+                /* If the argument is a composite type that is larger than 16
+                   bytes, then the argument has been copied to memory, and
+                   the argument is replaced by a pointer to the copy.  */
+                context->x[move->reg] = (uint64_t)a;
+                break;
+            case ARM64_ARG_V:
+                // put hfa type into registers starting at reg
+                extend_hfa_type(context, move->reg, a, move->h);
+                break;
+            case ARM64_ARG_STACK:
+                memcpy(stack + move->offset, a, move->size);
+                break;
+            case ARM64_ARG_STACK_INDIRECT:
+                memcpy(stack + move->offset, &args[i], sizeof(void *));
+                break;
+            default:
+                abort();
+        }
+    }
+}
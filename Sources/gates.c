@@ -0,0 +1,160 @@
+//
+//  gates.c
+//  aah
+//
+//  Native call gates: a read-only page of svc instructions, mapped only in
+//  the emulators. Emulated code that branches to a gate raises an interrupt,
+//  which stops emulation cleanly, instead of failing to fetch from a
+//  non-executable native page.
+//
+
+#include "aah.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <os/lock.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define GATE_INSTRUCTION 0xd4000001 // svc #0
+#define GATE_SIZE 4
+#define GATE_PAGE_SIZE (NATIVE_GATE_COUNT * GATE_SIZE)
+
+static uint32_t *gate_page = NULL;
+// gate_page[i] calls gates[i]
+static struct native_gate gates[NATIVE_GATE_COUNT];
+static _Atomic uint32_t gate_count = 0;
+static bool gate_bind_all = true;
+static bool gate_warned = false;
+// native address -> gate index + 1, only used when binding
+static CFMutableDictionaryRef gate_index_table = NULL;
+static os_unfair_lock gate_lock = OS_UNFAIR_LOCK_INIT;
+static pthread_once_t gate_once = PTHREAD_ONCE_INIT;
+
+static void print_gate_stats(void) {
+    uint32_t count = atomic_load(&gate_count);
+    printf("native call gates: %u bound\n", count);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t calls = __atomic_load_n(&gates[i].calls, __ATOMIC_RELAXED);
+        if (calls) {
+            const struct entry_point *entry = __atomic_load_n(&gates[i].entry, __ATOMIC_RELAXED);
+            printf("  %p %s: %llu calls\n", (void*)gates[i].target, entry && entry->name ? entry->name : "(unknown)", calls);
+        }
+    }
+}
+
+static void init_gates(void) {
+    gate_page = mmap(NULL, GATE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (gate_page == MAP_FAILED) {
+        fprintf(stderr, "couldn't allocate native call gates: %s\n", strerror(errno));
+        abort();
+    }
+    for (int i = 0; i < NATIVE_GATE_COUNT; i++) {
+        gate_page[i] = GATE_INSTRUCTION;
+    }
+    // never executed natively, and never changes
+    mprotect(gate_page, GATE_PAGE_SIZE, PROT_READ);
+    gate_index_table = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    LOG_INFO(LOG_EMULATOR, "Native call gates are %p to %p\n", gate_page, (void*)gate_page + GATE_PAGE_SIZE);
+    
+    if (getenv("BIND_NATIVE_GATES")) {
+        gate_bind_all = strtol(getenv("BIND_NATIVE_GATES"), NULL, 10) != 0;
+    }
+    if (getenv("PRINT_CACHE_STATS") && strtol(getenv("PRINT_CACHE_STATS"), NULL, 10)) {
+        atexit(print_gate_stats);
+    }
+}
+
+hidden bool native_gates_bind_all(void) {
+    pthread_once(&gate_once, init_gates);
+    return gate_bind_all;
+}
+
+hidden void native_gates_map(struct emulator_ctx *ctx) {
+    pthread_once(&gate_once, init_gates);
+    uc_err err = mem_map_ptr(ctx, (uint64_t)gate_page, GATE_PAGE_SIZE, UC_PROT_READ | UC_PROT_EXEC);
+    if (err != UC_ERR_OK) {
+        fprintf(stderr, "uc_mem_map_ptr(native call gates): %u %s\n", err, uc_strerror(err));
+        abort();
+    }
+}
+
+hidden uint64_t native_gate_for_address(uint64_t address) {
+    pthread_once(&gate_once, init_gates);
+    os_unfair_lock_lock(&gate_lock);
+    uintptr_t index = (uintptr_t)CFDictionaryGetValue(gate_index_table, (const void *)address);
+    uint32_t count = atomic_load_explicit(&gate_count, memory_order_relaxed);
+    if (index == 0 && count < NATIVE_GATE_COUNT) {
+        gates[count].target = address;
+        index = count + 1;
+        atomic_store_explicit(&gate_count, count + 1, memory_order_release);
+        CFDictionarySetValue(gate_index_table, (const void *)address, (const void *)index);
+    }
+    os_unfair_lock_unlock(&gate_lock);
+    if (index == 0) {
+        // later targets are called through fetch faults
+        if (!__atomic_exchange_n(&gate_warned, true, __ATOMIC_RELAXED)) {
+            LOG_WARN(LOG_EMULATOR, "out of native call gates at %p, calls to later ones will fault\n", (void*)address);
+        }
+        return 0;
+    }
+    return (uint64_t)&gate_page[index - 1];
+}
+
+hidden struct native_gate * native_gate_at(uint64_t pc) {
+    // pc is after the svc
+    uint64_t offset = pc - GATE_SIZE - (uint64_t)gate_page;
+    if (offset % GATE_SIZE || offset / GATE_SIZE >= atomic_load_explicit(&gate_count, memory_order_acquire)) {
+        return NULL;
+    }
+    return &gates[offset / GATE_SIZE];
+}
+
+hidden const struct entry_point * native_gate_entry(struct native_gate *gate) {
+    // read the generation before the cif cache, like the native call cache
+    uint32_t generation = cif_cache_get_generation() + 1;
+    // entry and generation are published together, so a writer that lost a
+    // race can't pair its stale entry with a newer generation
+    uint32_t sequence = __atomic_load_n(&gate->sequence, __ATOMIC_ACQUIRE);
+    if ((sequence & 1) == 0) {
+        const struct entry_point *entry = __atomic_load_n(&gate->entry, __ATOMIC_RELAXED);
+        uint32_t gate_generation = __atomic_load_n(&gate->generation, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (gate_generation == generation && __atomic_load_n(&gate->sequence, __ATOMIC_RELAXED) == sequence) {
+            return entry;
+        }
+    }
+    const struct entry_point *entry = cif_cache_get((void*)gate->target);
+    // if another thread is writing, leave it, the next call retries
+    if (entry && (sequence & 1) == 0 && __atomic_compare_exchange_n(&gate->sequence, &sequence, sequence + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // readers that see the new entry or generation see an odd sequence
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&gate->entry, entry, __ATOMIC_RELAXED);
+        __atomic_store_n(&gate->generation, generation, __ATOMIC_RELAXED);
+        __atomic_store_n(&gate->sequence, sequence + 2, __ATOMIC_RELEASE);
+    }
+    return entry;
+}
+
+hidden void native_gates_remove_range(uint64_t begin, uint64_t end) {
+    pthread_once(&gate_once, init_gates);
+    os_unfair_lock_lock(&gate_lock);
+    uint32_t count = atomic_load_explicit(&gate_count, memory_order_relaxed);
+    for (uint32_t i = 0; i < count; i++) {
+        struct native_gate *gate = &gates[i];
+        if (gate->target < begin || gate->target >= end) {
+            continue;
+        }
+        // a library loaded here later gets new gates
+        CFDictionaryRemoveValue(gate_index_table, (const void *)gate->target);
+        // drop the cached entry, waiting for a call that is resolving it
+        uint32_t sequence;
+        do {
+            sequence = __atomic_load_n(&gate->sequence, __ATOMIC_RELAXED) & ~1U;
+        } while (!__atomic_compare_exchange_n(&gate->sequence, &sequence, sequence + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&gate->entry, NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&gate->generation, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&gate->sequence, sequence + 2, __ATOMIC_RELEASE);
+    }
+    os_unfair_lock_unlock(&gate_lock);
+}
@@ -5,88 +5,106 @@ static void map_image(const struct mach_header_64 *mh, intptr_t vmaddr_slide);
 static void setup_image_emulation(const struct mach_header_64 *mh, intptr_t vmaddr_slide);
 static void load_lazy_symbols(const struct mach_header_64 *mh, intptr_t vmaddr_slide);
 static void did_load_image(const struct mach_header* mh, intptr_t vmaddr_slide);
+static void did_remove_image(const struct mach_header* mh, intptr_t vmaddr_slide);
 
 hidden void init_loader() {
     _dyld_register_func_for_add_image(did_load_image);
+    _dyld_register_func_for_remove_image(did_remove_image);
 }
 
 static void did_load_image(const struct mach_header* mh, intptr_t vmaddr_slide) {
     const struct mach_header_64 *mh64 = (const struct mach_header_64*)mh;
     if (should_emulate_image(mh64)) {
+        Dl_info info;
+        dladdr(mh, &info);
+        trace_add_image(mh64, info.dli_fname);
         setup_image_emulation(mh64, vmaddr_slide);
         load_lazy_symbols(mh64, vmaddr_slide);
         load_objc_entrypoints(mh64, vmaddr_slide);
     }
     map_image(mh64, vmaddr_slide);
+    // new images can attach categories and add emulated ranges
+    objc_dispatch_cache_invalidate();
 }
 
-#define MH_MAGIC_EMULATED 0x456D400C
-
-static uint32_t emulated_range_count = 0;
-static uc_mem_region *emulated_range = NULL;
+// replaced as a whole when images are added or removed, see emulated_ranges.h
+static struct emulated_ranges_table emulated_ranges = EMULATED_RANGES_TABLE_INITIALIZER;
 
-static void add_emulated_range(uint64_t base, uint64_t size, uint32_t flags) {
-    int pos = 0;
-    if ((flags & AAH_RANGE_EMULATE) == 0) {
-        fprintf(stderr, "emulated range must be marked with AAH_RANGE_EMULATE\n");
-        abort();
+static void did_remove_image(const struct mach_header* mh, intptr_t vmaddr_slide) {
+    const struct mach_header_64 *mh64 = (const struct mach_header_64*)mh;
+    bool emulated = should_emulate_image(mh64);
+    if (emulated) {
+        trace_remove_image(mh64);
+        coverage_remove_image(mh64);
     }
-    if (emulated_range == NULL) {
-        emulated_range_count = 8;
-        emulated_range = calloc(emulated_range_count, sizeof(uc_mem_region));
-    } else {
-        while (emulated_range[pos].begin != 0) { pos++; }
+    uint64_t emulated_begins[mh64->ncmds];
+    uint32_t emulated_count = 0;
+    void *lc_ptr = (void*)mh64 + sizeof(struct mach_header_64);
+    for(uint32_t i = 0; i < mh64->ncmds; i++) {
+        const struct segment_command_64 *sc = lc_ptr;
+        if (sc->cmd == LC_SEGMENT_64 && sc->vmaddr + vmaddr_slide && sc->vmsize) {
+            uint64_t begin = sc->vmaddr + vmaddr_slide;
+            if (emulated) {
+                emulated_begins[emulated_count++] = begin;
+            }
+            if (sc->initprot & VM_PROT_EXECUTE) {
+                // calls into the image must not find its entry points, or a library loaded here later would get them
+                cif_cache_remove_range(begin, begin + sc->vmsize);
+                native_gates_remove_range(begin, begin + sc->vmsize);
+            }
+            // map_image mapped it in every engine
+            mem_registry_remove(begin, begin + sc->vmsize);
+        }
+        lc_ptr += sc->cmdsize;
     }
-    printf("adding emulated range %d: %p-%p (%d)\n", pos, base, base+size, flags);
-    emulated_range[pos].begin = base;
-    emulated_range[pos].end = base + size;
-    emulated_range[pos].perms = flags;
-    if ((pos + 1) == emulated_range_count) {
-        emulated_range_count += 8;
-        emulated_range = realloc(emulated_range, emulated_range_count * sizeof(uc_mem_region));
-        bzero(&emulated_range[emulated_range_count-8], 8 * sizeof(uc_mem_region));
+    if (emulated_count) {
+        LOG_DEBUG(LOG_LOADER, "removing %u emulated ranges at %p\n", emulated_count, mh);
+        emulated_ranges_table_remove(&emulated_ranges, emulated_begins, emulated_count);
     }
+    // dispatch caches may hold its methods
+    objc_dispatch_cache_invalidate();
 }
 
+#define MH_MAGIC_EMULATED 0x456D400C
+
 hidden int should_emulate_image(const struct mach_header_64 *mh) {
     return mh->magic == MH_MAGIC_64 && mh->reserved == MH_MAGIC_EMULATED;
 }
 
 hidden uint32_t should_emulate_at(uint64_t address) {
-    for (int i = 0; i < emulated_range_count; i++) {
-        if (address >= emulated_range[i].begin && address < emulated_range[i].end) {
-            return emulated_range[i].perms;
-        } else if (emulated_range[i].begin == 0) {
-            return 0;
-        }
-    }
-    return 0;
+    return emulated_ranges_table_find(&emulated_ranges, address);
 }
 
 static void setup_image_emulation(const struct mach_header_64 *mh, intptr_t vmaddr_slide) {
     Dl_info info;
     dladdr(mh, &info);
-    printf("Setting up emulation for %s with slide 0x%lx\n", info.dli_fname, vmaddr_slide);
+    LOG_INFO(LOG_LOADER, "Setting up emulation for %s with slide 0x%lx\n", info.dli_fname, vmaddr_slide);
+    perf_map_add_image(mh, vmaddr_slide);
     
     void *lc_ptr = (void*)mh + sizeof(struct mach_header_64);
     uint32_t flag = AAH_RANGE_EMULATE;
     if (strcmp(strrchr(info.dli_fname, '/'), "/libc++em.dylib") == 0) {
         flag |= AAH_RANGE_LIBCPP;
     }
+    // published together, so lookups see all of the image or none of it
+    struct emulated_range ranges[mh->ncmds];
+    uint32_t range_count = 0;
     for(uint32_t i = 0; i < mh->ncmds; i++) {
         const struct segment_command_64 *sc = lc_ptr;
         if (sc->cmd == LC_SEGMENT_64) {
             intptr_t seg_base = sc->vmaddr + vmaddr_slide;
             if (strncmp(sc->segname, SEG_TEXT, sizeof(sc->segname)) == 0) {
                 // make text segment non-executable
-                printf("Found text segment at 0x%lx\n", seg_base);
+                LOG_DEBUG(LOG_LOADER, "Found text segment at 0x%lx\n", seg_base);
                 if (mprotect((void*)seg_base, sc->vmsize, PROT_READ)) {
                     fprintf(stderr, "mprotect: %s\n", strerror(errno));
                     abort();
                 }
+                coverage_add_image(mh, seg_base, sc->vmsize);
             }
             if (seg_base && sc->vmsize) {
-                add_emulated_range(seg_base, sc->vmsize, flag);
+                LOG_DEBUG(LOG_LOADER, "adding emulated range %p-%p (%d)\n", (void*)seg_base, (void*)(seg_base + sc->vmsize), flag);
+                ranges[range_count++] = (struct emulated_range){seg_base, seg_base + sc->vmsize, flag};
             }
             
             // check sections
@@ -106,6 +124,7 @@ static void setup_image_emulation(const struct mach_header_64 *mh, intptr_t vmad
         }
         lc_ptr += sc->cmdsize;
     }
+    emulated_ranges_table_add(&emulated_ranges, ranges, range_count);
 }
 
 hidden void* resolve_symbol(const char *lib_name, const char *symbol_name) {
@@ -180,7 +199,7 @@ static void load_lazy_symbols(const struct mach_header_64 *mh, intptr_t vmaddr_s
         } else if (sc->cmd == LC_MAIN) {
             lc_main = (const struct entry_point_command*)sc;
             void *pmain = (void*)(vmaddr_slide + lc_text->vmaddr + lc_main->entryoff);
-            printf("main at %p\n", pmain);
+            LOG_INFO(LOG_LOADER, "main at %p\n", pmain);
             cif_cache_add(pmain, "ii???", "main");
         }
         lc_ptr += sc->cmdsize;
@@ -188,7 +207,7 @@ static void load_lazy_symbols(const struct mach_header_64 *mh, intptr_t vmaddr_s
     
     // load lazy symbols
     if (lc_linkedit && lc_symtab && lc_dysymtab && la_symbol_section && lc_dysymtab->nindirectsyms) {
-        printf("loading lazy symbols\n");
+        LOG_DEBUG(LOG_LOADER, "loading lazy symbols\n");
         uint64_t linkedit_base = lc_linkedit->vmaddr + vmaddr_slide - lc_linkedit->fileoff;
         const uint32_t *indirect_symtab = (const uint32_t *)(linkedit_base + lc_dysymtab->indirectsymoff);
         const struct nlist_64 *symtab = (const struct nlist_64 *)(linkedit_base + lc_symtab->symoff);
@@ -218,18 +237,32 @@ static void load_lazy_symbols(const struct mach_header_64 *mh, intptr_t vmaddr_s
             Dl_info info;
             dladdr(symbol, &info);
             
-            printf("  symbol %s (%zu: %s (%s)) -> %p\n", symbol_name, lib_index, lib_name, info.dli_fname, symbol);
+            LOG_TRACE(LOG_LOADER, "  symbol %s (%zu: %s (%s)) -> %p\n", symbol_name, lib_index, lib_name, info.dli_fname, symbol);
             
             // fill cif cache
             cif_cache_add(symbol, lookup_method_signature(lib_name, symbol_name+1), symbol_name);
+            
+            // native functions and shims are called through a gate, lazy pointers are only used by stubs
+            // with BIND_NATIVE_GATES=0 only shims are, unknown targets are looked up when called
+            const struct entry_point *entry = symbol ? cif_cache_get(symbol) : NULL;
+            bool bind_gate = entry && entry->kind == ENTRY_POINT_SHIM;
+            if (symbol && !bind_gate && native_gates_bind_all()) {
+                bind_gate = !should_emulate_at((uint64_t)symbol);
+            }
+            if (bind_gate) {
+                uint64_t gate = native_gate_for_address((uint64_t)symbol);
+                if (gate) {
+                    indirect_symbol_bindings[i] = (void*)gate;
+                }
+            }
         }
     } else {
-        printf("not loading lazy symbols\n");
+        LOG_DEBUG(LOG_LOADER, "not loading lazy symbols\n");
     }
 }
 
 static void map_image(const struct mach_header_64 *mh, intptr_t vmaddr_slide) {
-    uc_engine *uc = get_emulator_ctx()->uc;
+    struct emulator_ctx *ctx = get_emulator_ctx();
     Dl_info info;
     dladdr((void*)mh, &info);
     //printf("Mapping image %s\n", info.dli_fname);
@@ -245,8 +278,8 @@ static void map_image(const struct mach_header_64 *mh, intptr_t vmaddr_slide) {
                 // luckily, VM_PROT_* == UC_PROT_*
                 perms |= UC_PROT_EXEC;
             }
-            if (!mem_is_mapped(uc, seg_addr, seg_size, perms)) {
-                mem_map_region_containing(uc, seg_addr, perms);
+            if (!mem_is_mapped(ctx, seg_addr, seg_size, perms)) {
+                mem_map_region_containing(ctx, seg_addr, perms);
             }
         }
         lc_ptr += sc->cmdsize;
@@ -0,0 +1,360 @@
+//
+//  log.c
+//  aah
+//
+//  Bounded multi-producer queue of unformatted messages (sequence numbers
+//  per slot, producers claim slots with a compare and swap), drained by a
+//  background thread. The thread sleeps while the queue is empty, and is
+//  woken by the first message written to it. Messages are dropped and
+//  counted when it's full.
+//
+
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define LOG_BUFFER_RECORDS 4096
+#define LOG_MAX_ARGS 12
+#define LOG_STRINGS_SIZE 400 // records are 512 bytes
+#define LOG_DRAIN_INTERVAL 1000 // microseconds to collect more messages after waking up
+#define LOG_NULL_STRING UINT64_MAX
+
+struct log_record {
+    uint64_t sequence; // == position when free, position + 1 when written
+    const char *format;
+    uint64_t args[LOG_MAX_ARGS]; // %s arguments are offsets into strings
+    char strings[LOG_STRINGS_SIZE];
+};
+
+hidden uint8_t log_levels[LOG_CATEGORY_COUNT] = {
+    [0 ... LOG_CATEGORY_COUNT - 1] = LOG_LEVEL_INFO
+};
+
+static const char *log_category_names[LOG_CATEGORY_COUNT] = {
+    [LOG_EMULATOR] = "emulator",
+    [LOG_CALLS] = "calls",
+    [LOG_CIF] = "cif",
+    [LOG_LOADER] = "loader",
+    [LOG_MEMORY] = "memory",
+};
+
+static const char *log_level_names[] = {
+    [LOG_LEVEL_NONE] = "none",
+    [LOG_LEVEL_ERROR] = "error",
+    [LOG_LEVEL_WARN] = "warn",
+    [LOG_LEVEL_INFO] = "info",
+    [LOG_LEVEL_DEBUG] = "debug",
+    [LOG_LEVEL_TRACE] = "trace",
+};
+
+static struct log_record log_buffer[LOG_BUFFER_RECORDS];
+static uint64_t log_head = 0; // next position to claim
+static uint64_t log_tail = 0; // next position to write, under log_drain_lock
+static uint64_t log_dropped = 0;
+static bool log_sync = false;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+// set by the drain thread before it sleeps, cleared by the producer that wakes it
+static bool log_drain_waiting = false;
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+// MARK: formats
+
+enum log_arg_kind {
+    LOG_ARG_END,
+    LOG_ARG_INT,
+    LOG_ARG_INT64,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+};
+
+// advances *format past the next conversion, and copies it to spec if not NULL
+// returns LOG_ARG_END at the end of the format, literal text is skipped
+static enum log_arg_kind next_conversion(const char **format, char *spec, size_t spec_size) {
+    const char *p = *format;
+    for (;;) {
+        p = strchr(p, '%');
+        if (p == NULL) {
+            *format = p;
+            return LOG_ARG_END;
+        } else if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+        break;
+    }
+    const char *start = p++;
+    p += strspn(p, "-+ #0123456789.");
+    bool wide = false;
+    for (; *p && strchr("hlqjztL", *p); p++) {
+        wide |= *p == 'l' || *p == 'q' || *p == 'j' || *p == 'z' || *p == 't';
+    }
+    enum log_arg_kind kind;
+    switch (*p) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+            kind = wide ? LOG_ARG_INT64 : LOG_ARG_INT;
+            break;
+        case 'p':
+            kind = LOG_ARG_INT64;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            kind = LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            kind = LOG_ARG_STRING;
+            break;
+        default:
+            // unsupported, stop here
+            *format = NULL;
+            return LOG_ARG_END;
+    }
+    p++;
+    if (spec) {
+        size_t length = (size_t)(p - start) < spec_size ? (size_t)(p - start) : spec_size - 1;
+        memcpy(spec, start, length);
+        spec[length] = '\0';
+    }
+    *format = p;
+    return kind;
+}
+
+static void log_capture(struct log_record *record, const char *format, va_list ap) {
+    size_t strings_used = 0;
+    enum log_arg_kind kind;
+    for (int i = 0; i < LOG_MAX_ARGS && (kind = next_conversion(&format, NULL, 0)) != LOG_ARG_END; i++) {
+        switch (kind) {
+            case LOG_ARG_INT:
+                record->args[i] = va_arg(ap, unsigned int);
+                break;
+            case LOG_ARG_INT64:
+                record->args[i] = va_arg(ap, uint64_t);
+                break;
+            case LOG_ARG_DOUBLE: {
+                double value = va_arg(ap, double);
+                memcpy(&record->args[i], &value, sizeof(value));
+                break;
+            }
+            case LOG_ARG_STRING: {
+                const char *string = va_arg(ap, const char *);
+                if (string == NULL) {
+                    record->args[i] = LOG_NULL_STRING;
+                    break;
+                }
+                size_t length = strnlen(string, LOG_STRINGS_SIZE - strings_used - 1);
+                memcpy(record->strings + strings_used, string, length);
+                record->strings[strings_used + length] = '\0';
+                record->args[i] = strings_used;
+                strings_used += length + (strings_used + length + 1 < LOG_STRINGS_SIZE);
+                break;
+            }
+            case LOG_ARG_END:
+                break;
+        }
+    }
+}
+
+static void log_format(FILE *fp, const struct log_record *record) {
+    const char *format = record->format;
+    char spec[32];
+    enum log_arg_kind kind;
+    for (int i = 0; format; i++) {
+        const char *literal = format;
+        kind = i < LOG_MAX_ARGS ? next_conversion(&format, spec, sizeof(spec)) : LOG_ARG_END;
+        if (kind == LOG_ARG_END) {
+            // the rest, %% included
+            for (const char *p = literal; *p; p++) {
+                fputc(*p, fp);
+                p += p[0] == '%' && p[1] == '%';
+            }
+            return;
+        }
+        const char *spec_start = format - strlen(spec);
+        for (const char *p = literal; p < spec_start; p++) {
+            fputc(*p, fp);
+            p += p[0] == '%' && p[1] == '%';
+        }
+        switch (kind) {
+            case LOG_ARG_INT:
+                fprintf(fp, spec, (unsigned int)record->args[i]);
+                break;
+            case LOG_ARG_INT64:
+                fprintf(fp, spec, record->args[i]);
+                break;
+            case LOG_ARG_DOUBLE: {
+                double value;
+                memcpy(&value, &record->args[i], sizeof(value));
+                fprintf(fp, spec, value);
+                break;
+            }
+            case LOG_ARG_STRING:
+                fprintf(fp, spec, record->args[i] == LOG_NULL_STRING ? "(null)" : record->strings + record->args[i]);
+                break;
+            case LOG_ARG_END:
+                break;
+        }
+    }
+}
+
+// MARK: queue
+
+static void log_drain(void) {
+    pthread_mutex_lock(&log_drain_lock);
+    for (;; log_tail++) {
+        struct log_record *record = &log_buffer[log_tail % LOG_BUFFER_RECORDS];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != log_tail + 1) {
+            break;
+        }
+        log_format(stdout, record);
+        __atomic_store_n(&record->sequence, log_tail + LOG_BUFFER_RECORDS, __ATOMIC_RELEASE);
+    }
+    uint64_t dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        printf("(%llu log messages dropped)\n", dropped);
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&log_drain_lock);
+}
+
+// true if the next record to write has been written by its producer
+static bool log_pending(void) {
+    pthread_mutex_lock(&log_drain_lock);
+    bool pending = __atomic_load_n(&log_buffer[log_tail % LOG_BUFFER_RECORDS].sequence, __ATOMIC_SEQ_CST) == log_tail + 1;
+    pthread_mutex_unlock(&log_drain_lock);
+    return pending;
+}
+
+static void * log_drain_thread(void *arg) {
+    for (;;) {
+        log_drain();
+        // producers that write after this see the flag and wake us up
+        __atomic_store_n(&log_drain_waiting, true, __ATOMIC_SEQ_CST);
+        if (log_pending()) {
+            __atomic_store_n(&log_drain_waiting, false, __ATOMIC_RELAXED);
+            continue;
+        }
+        pthread_mutex_lock(&log_wake_lock);
+        while (__atomic_load_n(&log_drain_waiting, __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&log_wake, &log_wake_lock);
+        }
+        pthread_mutex_unlock(&log_wake_lock);
+        usleep(LOG_DRAIN_INTERVAL);
+    }
+    return NULL;
+}
+
+static void start_log_thread(void) {
+    for (uint64_t i = 0; i < LOG_BUFFER_RECORDS; i++) {
+        log_buffer[i].sequence = i;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, log_drain_thread, NULL);
+    pthread_detach(thread);
+    atexit(log_drain);
+}
+
+hidden void log_write(enum log_category category, enum log_level level, const char *format, ...) {
+    va_list ap;
+    if (log_sync || level == LOG_LEVEL_ERROR) {
+        log_flush();
+        struct log_record record;
+        record.format = format;
+        va_start(ap, format);
+        log_capture(&record, format, ap);
+        va_end(ap);
+        log_format(stdout, &record);
+        fflush(stdout);
+        return;
+    }
+
+    pthread_once(&log_once, start_log_thread);
+    struct log_record *record;
+    uint64_t position = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    for (;;) {
+        record = &log_buffer[position % LOG_BUFFER_RECORDS];
+        uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        if (sequence == position) {
+            if (__atomic_compare_exchange_n(&log_head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (sequence < position) {
+            // full, never wait for the writer
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            position = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        }
+    }
+    record->format = format;
+    va_start(ap, format);
+    log_capture(record, format, ap);
+    va_end(ap);
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_drain_waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&log_drain_waiting, false, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&log_wake_lock);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_wake_lock);
+    }
+}
+
+hidden void log_flush(void) {
+    if (__atomic_load_n(&log_head, __ATOMIC_RELAXED)) {
+        log_drain();
+    }
+}
+
+// MARK: levels
+
+static int parse_level(const char *name, size_t length) {
+    for (int level = LOG_LEVEL_NONE; level <= LOG_LEVEL_TRACE; level++) {
+        if (strlen(log_level_names[level]) == length && strncmp(name, log_level_names[level], length) == 0) {
+            return level;
+        }
+    }
+    if (length == 1 && *name >= '0' && *name <= '5') {
+        return *name - '0';
+    }
+    return -1;
+}
+
+hidden void init_log(void) {
+    if (getenv("AAH_LOG_SYNC") && strtol(getenv("AAH_LOG_SYNC"), NULL, 10)) {
+        log_sync = true;
+    }
+    // AAH_LOG=level or category=level, separated by commas
+    const char *spec = getenv("AAH_LOG");
+    while (spec && *spec) {
+        size_t length = strcspn(spec, ",");
+        const char *equals = memchr(spec, '=', length);
+        const char *level_name = equals ? equals + 1 : spec;
+        int level = parse_level(level_name, spec + length - level_name);
+        if (level < 0) {
+            fprintf(stderr, "unknown log level in AAH_LOG: %.*s\n", (int)length, spec);
+        } else if (equals == NULL) {
+            memset(log_levels, level, sizeof(log_levels));
+        } else {
+            int category;
+            for (category = 0; category < LOG_CATEGORY_COUNT; category++) {
+                const char *name = log_category_names[category];
+                if (strlen(name) == (size_t)(equals - spec) && strncmp(spec, name, equals - spec) == 0) {
+                    log_levels[category] = level;
+                    break;
+                }
+            }
+            if (category == LOG_CATEGORY_COUNT) {
+                fprintf(stderr, "unknown log category in AAH_LOG: %.*s\n", (int)(equals - spec), spec);
+            }
+        }
+        spec += length + (spec[length] == ',');
+    }
+    for (int category = 0; category < LOG_CATEGORY_COUNT; category++) {
+        if (log_levels[category] > LOG_LEVEL_MAX) {
+            fprintf(stderr, "log level %s for %s is not compiled in, using %s\n", log_level_names[log_levels[category]], log_category_names[category], log_level_names[LOG_LEVEL_MAX]);
+            log_levels[category] = LOG_LEVEL_MAX;
+        }
+    }
+}
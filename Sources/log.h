@@ -0,0 +1,70 @@
+//
+//  log.h
+//  aah
+//
+//  Leveled logging by category. Levels above LOG_LEVEL_MAX are removed at
+//  compile time, the others cost a load and compare when disabled.
+//  Enabled messages record the format and raw arguments in a lock-free
+//  buffer, and are formatted and written by a background thread.
+//
+//  Formats support the usual conversions, but not positional arguments or
+//  * widths. %s arguments are copied, and may be truncated.
+//
+
+#ifndef log_h
+#define log_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef hidden
+#define hidden __attribute__ ((visibility ("hidden")))
+#endif
+
+enum log_level {
+    LOG_LEVEL_NONE,
+    LOG_LEVEL_ERROR, // written before returning, after everything already logged
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,  // default
+    LOG_LEVEL_DEBUG, // every transition between native and emulated code
+    LOG_LEVEL_TRACE,
+};
+
+enum log_category {
+    LOG_EMULATOR,
+    LOG_CALLS,
+    LOG_CIF,
+    LOG_LOADER,
+    LOG_MEMORY,
+    LOG_CATEGORY_COUNT
+};
+
+#ifndef LOG_LEVEL_MAX
+#if DEBUG
+#define LOG_LEVEL_MAX LOG_LEVEL_TRACE
+#else
+#define LOG_LEVEL_MAX LOG_LEVEL_INFO
+#endif
+#endif
+
+extern hidden uint8_t log_levels[LOG_CATEGORY_COUNT];
+
+// reads AAH_LOG and AAH_LOG_SYNC
+hidden void init_log(void);
+hidden void log_write(enum log_category category, enum log_level level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+// writes everything logged so far
+hidden void log_flush(void);
+
+#define LOG(category, level, ...) do { \
+    if ((level) <= LOG_LEVEL_MAX && (level) <= log_levels[category]) { \
+        log_write(category, level, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define LOG_ERROR(category, ...) LOG(category, LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(category, ...) LOG(category, LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(category, ...) LOG(category, LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(category, ...) LOG(category, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(category, ...) LOG(category, LOG_LEVEL_TRACE, __VA_ARGS__)
+
+#endif /* log_h */
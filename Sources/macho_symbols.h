@@ -0,0 +1,72 @@
+//
+//  macho_symbols.h
+//  aah
+//
+//  Segments and defined symbols of 64-bit Mach-O images, read from a file
+//  or from an image loaded by dyld. Used by sampler.c, perf_map_writer.c and
+//  the tools.
+//
+
+#ifndef macho_symbols_h
+#define macho_symbols_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+
+struct macho_symbol {
+    uint64_t address; // with the slide
+    const char *name;
+};
+
+static inline const struct load_command * macho_next_command(const struct load_command *lc) {
+    return (const struct load_command *)((const uint8_t *)lc + lc->cmdsize);
+}
+
+// NULL if there is none
+static inline const struct segment_command_64 * macho_segment(const struct mach_header_64 *mh, const char *name) {
+    const struct load_command *lc = (const struct load_command *)(mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++, lc = macho_next_command(lc)) {
+        if (lc->cmd == LC_SEGMENT_64 && strncmp(((const struct segment_command_64 *)lc)->segname, name, 16) == 0) {
+            return (const struct segment_command_64 *)lc;
+        }
+    }
+    return NULL;
+}
+
+// symbols defined in a section, in symbol table order, NULL if there are none
+// linkedit is what symbol table offsets are relative to: the start of the
+// file, or the loaded __LINKEDIT segment minus its file offset
+// the array is malloc'd, the names point into linkedit
+static inline struct macho_symbol * macho_defined_symbols(const struct mach_header_64 *mh, const uint8_t *linkedit, int64_t slide, uint32_t *count) {
+    const struct symtab_command *symtab = NULL;
+    const struct load_command *lc = (const struct load_command *)(mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++, lc = macho_next_command(lc)) {
+        if (lc->cmd == LC_SYMTAB) {
+            symtab = (const struct symtab_command *)lc;
+        }
+    }
+    *count = 0;
+    if (symtab == NULL || symtab->nsyms == 0) {
+        return NULL;
+    }
+    const struct nlist_64 *nl = (const struct nlist_64 *)(linkedit + symtab->symoff);
+    const char *strings = (const char *)linkedit + symtab->stroff;
+    struct macho_symbol *symbols = malloc(symtab->nsyms * sizeof(struct macho_symbol));
+    if (symbols == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < symtab->nsyms; i++) {
+        if ((nl[i].n_type & N_STAB) || (nl[i].n_type & N_TYPE) != N_SECT) {
+            continue;
+        }
+        symbols[*count].address = nl[i].n_value + slide;
+        symbols[*count].name = strings + nl[i].n_un.n_strx;
+        (*count)++;
+    }
+    return symbols;
+}
+
+#endif /* macho_symbols_h */
@@ -9,7 +9,7 @@ void aah_Block_object_assign(void *, const void *, const int);
 extern void AXPushNotificationToSystemForBroadcast(void*);
 
 int aah_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg) {
-    printf("caching cif for pthread start routine %p\n", start_routine);
+    LOG_DEBUG(LOG_CALLS, "caching cif for pthread start routine %p\n", start_routine);
     cif_cache_add(start_routine, "??", "(start_routine for a pthread)");
     return pthread_create(thread, attr, start_routine, arg);
 };
@@ -17,7 +17,7 @@ int aah_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*st
 int pthread_key_create(pthread_key_t *key, void (*destructor)(void *));
 int aah_pthread_key_create(pthread_key_t *key, void (*destructor)(void *)) {
     if (destructor != NULL) {
-        printf("caching cif for pthread tsd destructor %p\n", destructor);
+        LOG_DEBUG(LOG_CALLS, "caching cif for pthread tsd destructor %p\n", destructor);
         cif_cache_add(destructor, "v?", "(destructor for thread-specific-data)");
     }
     return pthread_key_create(key, destructor);
@@ -25,13 +25,41 @@ int aah_pthread_key_create(pthread_key_t *key, void (*destructor)(void *)) {
 
 void aah_ax_bug_thing(void* whatever) {};
 
+// invalidate cached objc dispatch when methods change
+IMP aah_method_setImplementation(Method m, IMP imp) {
+    IMP old = method_setImplementation(m, imp);
+    objc_dispatch_cache_invalidate();
+    return old;
+}
+
+void aah_method_exchangeImplementations(Method m1, Method m2) {
+    method_exchangeImplementations(m1, m2);
+    objc_dispatch_cache_invalidate();
+}
+
+BOOL aah_class_addMethod(Class cls, SEL name, IMP imp, const char *types) {
+    BOOL added = class_addMethod(cls, name, imp, types);
+    objc_dispatch_cache_invalidate();
+    return added;
+}
+
+IMP aah_class_replaceMethod(Class cls, SEL name, IMP imp, const char *types) {
+    IMP old = class_replaceMethod(cls, name, imp, types);
+    objc_dispatch_cache_invalidate();
+    return old;
+}
+
 typedef struct interpose_s { void *new_func; void *orig_func; } interpose_t;
 static const interpose_t interposing_functions[] __attribute__ ((used, section("__DATA, __interpose"))) = {
     { (void*) aah_Block_copy, (void*)_Block_copy},
     { (void*) aah_Block_object_assign, (void*)_Block_object_assign},
     { (void*) aah_pthread_create, (void*)pthread_create},
     { (void*) aah_pthread_key_create, (void*)pthread_key_create},
-    { (void*) aah_ax_bug_thing, (void*)AXPushNotificationToSystemForBroadcast }
+    { (void*) aah_ax_bug_thing, (void*)AXPushNotificationToSystemForBroadcast },
+    { (void*) aah_method_setImplementation, (void*)method_setImplementation},
+    { (void*) aah_method_exchangeImplementations, (void*)method_exchangeImplementations},
+    { (void*) aah_class_addMethod, (void*)class_addMethod},
+    { (void*) aah_class_replaceMethod, (void*)class_replaceMethod}
 };
 
 @implementation NSBundle (Marzipan)
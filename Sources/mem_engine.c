@@ -0,0 +1,53 @@
+//
+//  mem_engine.c
+//  aah
+//
+
+#include "mem_engine.h"
+
+hidden uc_err mem_engine_map_ptr(uc_engine *uc, struct mem_intervals *intervals, uint64_t address, uint64_t size, uint32_t perms) {
+    uc_err err = uc_mem_map_ptr(uc, address, size, perms, (void*)address);
+    if (err == UC_ERR_OK) {
+        mem_intervals_add(intervals, address, address + size, perms);
+    }
+    return err;
+}
+
+hidden uc_err mem_engine_unmap(uc_engine *uc, struct mem_intervals *intervals, uint64_t address, uint64_t size) {
+    uc_err err = uc_mem_unmap(uc, address, size);
+    if (err == UC_ERR_OK) {
+        mem_intervals_remove(intervals, address, address + size);
+    }
+    return err;
+}
+
+hidden uc_err mem_engine_unmap_range(uc_engine *uc, struct mem_intervals *intervals, uint64_t begin, uint64_t end) {
+    for (uint32_t index = mem_intervals_lower_bound(intervals, begin); index < intervals->count && intervals->items[index].begin < end; index = mem_intervals_lower_bound(intervals, begin)) {
+        const struct mem_interval *region = &intervals->items[index];
+        uint64_t unmap_begin = region->begin > begin ? region->begin : begin;
+        uint64_t unmap_end = region->end < end ? region->end : end;
+        uc_err err = mem_engine_unmap(uc, intervals, unmap_begin, unmap_end - unmap_begin);
+        if (err != UC_ERR_OK) {
+            return err;
+        }
+    }
+    return UC_ERR_OK;
+}
+
+hidden bool mem_engine_remap(uc_engine *uc, struct mem_intervals *intervals, uint64_t address, uint64_t size, uint32_t perms, uc_err *err_ptr) {
+    uint64_t end = address + size;
+    uint32_t index = mem_intervals_lower_bound(intervals, address);
+    if (index == intervals->count || intervals->items[index].begin >= end) {
+        return false;
+    }
+    // unmap the overlapping parts of existing regions, and map the new one with their permissions
+    for (; index < intervals->count && intervals->items[index].begin < end; index++) {
+        perms |= intervals->items[index].perms;
+    }
+    uc_err err = mem_engine_unmap_range(uc, intervals, address, end);
+    if (err == UC_ERR_OK) {
+        err = mem_engine_map_ptr(uc, intervals, address, size, perms);
+    }
+    *err_ptr = err;
+    return true;
+}
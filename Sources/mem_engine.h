@@ -0,0 +1,25 @@
+//
+//  mem_engine.h
+//  aah
+//
+//  Maps host memory at the same address in a unicorn engine, keeping the
+//  engine's mem_intervals in sync. Doesn't depend on macOS.
+//
+
+#ifndef mem_engine_h
+#define mem_engine_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unicorn/unicorn.h>
+#include "mem_intervals.h"
+
+hidden uc_err mem_engine_map_ptr(uc_engine *uc, struct mem_intervals *intervals, uint64_t address, uint64_t size, uint32_t perms);
+hidden uc_err mem_engine_unmap(uc_engine *uc, struct mem_intervals *intervals, uint64_t address, uint64_t size);
+// unmaps whatever is mapped in the range
+hidden uc_err mem_engine_unmap_range(uc_engine *uc, struct mem_intervals *intervals, uint64_t begin, uint64_t end);
+// replaces the regions overlapping the range with one mapping of the range, with their permissions added
+// returns false if it doesn't overlap any region, otherwise the result is in err_ptr
+hidden bool mem_engine_remap(uc_engine *uc, struct mem_intervals *intervals, uint64_t address, uint64_t size, uint32_t perms, uc_err *err_ptr);
+
+#endif /* mem_engine_h */
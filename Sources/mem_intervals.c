@@ -0,0 +1,76 @@
+//
+//  mem_intervals.c
+//  aah
+//
+//  Lookups are binary searches and don't allocate.
+//
+
+#include "mem_intervals.h"
+#include <stdlib.h>
+#include <string.h>
+
+hidden uint32_t mem_intervals_lower_bound(const struct mem_intervals *intervals, uint64_t address) {
+    uint32_t low = 0, high = intervals->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (intervals->items[mid].end <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void mem_intervals_insert_at(struct mem_intervals *intervals, uint32_t index, uint64_t begin, uint64_t end, uint32_t perms) {
+    if (intervals->count == intervals->capacity) {
+        intervals->capacity = intervals->capacity ? 2 * intervals->capacity : 64;
+        intervals->items = realloc(intervals->items, intervals->capacity * sizeof(struct mem_interval));
+    }
+    memmove(&intervals->items[index + 1], &intervals->items[index], (intervals->count - index) * sizeof(struct mem_interval));
+    intervals->items[index] = (struct mem_interval){.begin = begin, .end = end, .perms = perms};
+    intervals->count++;
+}
+
+hidden void mem_intervals_add(struct mem_intervals *intervals, uint64_t begin, uint64_t end, uint32_t perms) {
+    if (begin >= end) {
+        return;
+    }
+    mem_intervals_insert_at(intervals, mem_intervals_lower_bound(intervals, begin), begin, end, perms);
+}
+
+hidden void mem_intervals_remove(struct mem_intervals *intervals, uint64_t begin, uint64_t end) {
+    uint32_t index = mem_intervals_lower_bound(intervals, begin);
+    while (index < intervals->count && intervals->items[index].begin < end) {
+        struct mem_interval *item = &intervals->items[index];
+        if (item->begin < begin && item->end > end) {
+            // split in two
+            uint64_t tail_end = item->end;
+            item->end = begin;
+            mem_intervals_insert_at(intervals, index + 1, end, tail_end, item->perms);
+            return;
+        } else if (item->begin < begin) {
+            item->end = begin;
+            index++;
+        } else if (item->end > end) {
+            item->begin = end;
+            return;
+        } else {
+            memmove(item, item + 1, (intervals->count - index - 1) * sizeof(struct mem_interval));
+            intervals->count--;
+        }
+    }
+}
+
+hidden const struct mem_interval * mem_intervals_find(const struct mem_intervals *intervals, uint64_t address) {
+    uint32_t index = mem_intervals_lower_bound(intervals, address);
+    if (index < intervals->count && intervals->items[index].begin <= address) {
+        return &intervals->items[index];
+    }
+    return NULL;
+}
+
+hidden void mem_intervals_free(struct mem_intervals *intervals) {
+    free(intervals->items);
+    memset(intervals, 0, sizeof(*intervals));
+}
@@ -0,0 +1,43 @@
+//
+//  mem_intervals.h
+//  aah
+//
+//  Sorted, non-overlapping address intervals with permissions, used to
+//  mirror the mappings of a unicorn engine so that queries don't have to
+//  call uc_mem_regions. Doesn't depend on unicorn.
+//
+
+#ifndef mem_intervals_h
+#define mem_intervals_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef hidden
+#define hidden __attribute__ ((visibility ("hidden")))
+#endif
+
+struct mem_interval {
+    uint64_t begin;
+    uint64_t end; // exclusive
+    uint32_t perms;
+};
+
+struct mem_intervals {
+    struct mem_interval *items; // sorted by begin
+    uint32_t count;
+    uint32_t capacity;
+};
+
+// the range must not overlap existing intervals
+hidden void mem_intervals_add(struct mem_intervals *intervals, uint64_t begin, uint64_t end, uint32_t perms);
+// splits intervals that are partially removed
+hidden void mem_intervals_remove(struct mem_intervals *intervals, uint64_t begin, uint64_t end);
+// returns the interval containing address, or NULL
+hidden const struct mem_interval * mem_intervals_find(const struct mem_intervals *intervals, uint64_t address);
+// returns the index of the first interval that ends after address, intervals[index..] may overlap a range starting there
+hidden uint32_t mem_intervals_lower_bound(const struct mem_intervals *intervals, uint64_t address);
+hidden void mem_intervals_free(struct mem_intervals *intervals);
+
+#endif /* mem_intervals_h */
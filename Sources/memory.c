@@ -1,4 +1,32 @@
 #include "aah.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <os/lock.h>
+#include <stdatomic.h>
+
+// host regions mapped in any engine, in order, replayed into the others
+// append-only, the count is the version, entries are only retired
+struct mem_registry_entry {
+    uint64_t begin;
+    uint64_t size;
+    uint32_t perms;
+    bool retired; // unmapped by the host, not replayed
+};
+
+static struct mem_registry_entry *mem_registry = NULL;
+static uint32_t mem_registry_capacity = 0;
+static _Atomic uint32_t mem_registry_count = 0;
+// ranges unmapped by the host, in order, unmapped from the engines that still map them
+struct mem_registry_retirement {
+    uint64_t begin;
+    uint64_t end;
+};
+
+static struct mem_registry_retirement *mem_retirements = NULL;
+static uint32_t mem_retirements_capacity = 0;
+static _Atomic uint32_t mem_retirements_count = 0;
+// begin -> index + 1 of the latest entry, to skip duplicates
+static CFMutableDictionaryRef mem_registry_index = NULL;
+static os_unfair_lock mem_registry_lock = OS_UNFAIR_LOCK_INIT;
 
 const char *mem_perm_str[] = {
     [0] = "none",
@@ -20,59 +48,169 @@ const char *mem_get_tag(void *address) {
     }
 }
 
-void mem_print_uc_regions(uc_engine *uc) {
-    if (uc == NULL) {
-        uc = get_emulator_ctx()->uc;
+hidden uc_err mem_map_ptr(struct emulator_ctx *ctx, uint64_t address, uint64_t size, uint32_t perms) {
+    return mem_engine_map_ptr(ctx->uc, &ctx->mem_intervals, address, size, perms);
+}
+
+hidden uc_err mem_unmap(struct emulator_ctx *ctx, uint64_t address, uint64_t size) {
+    return mem_engine_unmap(ctx->uc, &ctx->mem_intervals, address, size);
+}
+
+void mem_print_uc_regions(struct emulator_ctx *ctx) {
+    if (ctx == NULL) {
+        ctx = get_emulator_ctx();
     }
-    uc_mem_region *regions;
-    uint32_t num_regions;
-    
-    uc_mem_regions(uc, &regions, &num_regions);
-    qsort_b(regions, num_regions, sizeof(uc_mem_region), ^int(const void * rpa, const void * rpb) {
-        const uc_mem_region *ra = (const uc_mem_region*)rpa;
-        const uc_mem_region *rb = (const uc_mem_region*)rpb;
-        return (int64_t)ra->begin - (int64_t)rb->end;
-    });
-    printf("%d regions:\n", num_regions);
-    for(uint32_t i = 0; i < num_regions; i++) {
-        printf("  %p->%p %s %s\n", (void*)regions[i].begin, (void*)regions[i].end, mem_perm_str[regions[i].perms], mem_get_tag((void*)regions[i].begin));
-    }
-    free(regions);
+    // already sorted
+    const struct mem_intervals *regions = &ctx->mem_intervals;
+    printf("%d regions:\n", regions->count);
+    for(uint32_t i = 0; i < regions->count; i++) {
+        const struct mem_interval *region = &regions->items[i];
+        printf("  %p->%p %s %s\n", (void*)region->begin, (void*)(region->end - 1), mem_perm_str[region->perms], mem_get_tag((void*)region->begin));
+    }
+}
+
+bool mem_remap_region(struct emulator_ctx *ctx, uint64_t address, size_t size, uint32_t perms, uc_err *err_ptr) {
+    stat_add(&ctx->stats.remaps, 1);
+    if (!mem_engine_remap(ctx->uc, &ctx->mem_intervals, address, size, perms, err_ptr)) {
+        fprintf(stderr, "mem_remap_region: did not find region\n");
+        return false;
+    }
+    if (*err_ptr != UC_ERR_OK) {
+        LOG_WARN(LOG_MEMORY, "mem_remap_region(%p, 0x%lx): %s\n", (void*)address, size, uc_strerror(*err_ptr));
+    }
+    return true;
 }
 
-bool mem_remap_region(uc_engine *uc, uint64_t address, size_t size, uint32_t perms, uc_err *err_ptr) {
-    uc_mem_region *regions;
-    uint32_t num_regions;
-    uint64_t end = address + size - 1;
-    uc_mem_regions(uc, &regions, &num_regions);
-    // find overlapping region and unmap it
-    // assume regions only expand from the end
-    for(uint32_t i = 0; i < num_regions; i++) {
-        if ((address >= regions[i].begin && address <= regions[i].end) ||
-            (end >= regions[i].begin && end <= regions[i].end)) {
-            size_t region_size = regions[i].end - regions[i].begin + 1;
-            perms |= regions[i].perms;
-            uc_err err = uc_mem_unmap(uc, regions[i].begin, region_size);
-            if (err != UC_ERR_OK) {
-                printf("uc_mem_unmap(%p, 0x%lx): %s\n", (void*)regions[i].begin, region_size, uc_strerror(err));
-                break;
-            }
-            err = uc_mem_map_ptr(uc, address, size, perms, (void*)address);
-            if (err != UC_ERR_OK) {
-                printf("uc_mem_map_ptr(%p, 0x%lx): %s\n", (void*)regions[i].begin, region_size, uc_strerror(err));
-                break;
-            }
-            *err_ptr = err;
-            free(regions);
-            return true;
+static void mem_registry_add(uint64_t begin, uint64_t size, uint32_t perms) {
+    os_unfair_lock_lock(&mem_registry_lock);
+    if (mem_registry_index == NULL) {
+        mem_registry_index = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    }
+    uint32_t count = atomic_load_explicit(&mem_registry_count, memory_order_relaxed);
+    uintptr_t index = (uintptr_t)CFDictionaryGetValue(mem_registry_index, (const void *)begin);
+    if (index && mem_registry[index - 1].retired) {
+        index = 0;
+    }
+    if (index && mem_registry[index - 1].size == size && (mem_registry[index - 1].perms & perms) == perms) {
+        // already known
+        os_unfair_lock_unlock(&mem_registry_lock);
+        return;
+    }
+    if (count == mem_registry_capacity) {
+        mem_registry_capacity = mem_registry_capacity ? 2 * mem_registry_capacity : 256;
+        mem_registry = realloc(mem_registry, mem_registry_capacity * sizeof(struct mem_registry_entry));
+    }
+    mem_registry[count].begin = begin;
+    mem_registry[count].size = size;
+    mem_registry[count].perms = perms | (index ? mem_registry[index - 1].perms : 0);
+    mem_registry[count].retired = false;
+    CFDictionarySetValue(mem_registry_index, (const void *)begin, (const void *)(uintptr_t)(count + 1));
+    atomic_store_explicit(&mem_registry_count, count + 1, memory_order_release);
+    os_unfair_lock_unlock(&mem_registry_lock);
+}
+
+static bool mem_map_host_region(struct emulator_ctx *ctx, uint64_t region_address, uint64_t region_size, uint32_t perms) {
+    uc_err uerr = mem_map_ptr(ctx, region_address, region_size, perms);
+    if (uerr != UC_ERR_OK) {
+        LOG_DEBUG(LOG_MEMORY, "uc_mem_map_ptr(%p, 0x%llx, %s): %s, trying to remap\n", (void*)region_address, region_size, mem_perm_str[perms], uc_strerror(uerr));
+        bool found = mem_remap_region(ctx, region_address, region_size, perms, &uerr);
+        if (uerr != UC_ERR_OK || !found) {
+            LOG_ERROR(LOG_MEMORY, "uc_mem_map_ptr(%p, 0x%llx, %s): %s\n", (void*)region_address, region_size, mem_perm_str[perms], uc_strerror(uerr));
+            mem_print_uc_regions(ctx);
+            return false;
         }
     }
-    fprintf(stderr, "mem_remap_region: did not find region\n");
-    free(regions);
-    return false;
+    return true;
+}
+
+hidden void mem_unmap_range(struct emulator_ctx *ctx, uint64_t begin, uint64_t end) {
+    uc_err err = mem_engine_unmap_range(ctx->uc, &ctx->mem_intervals, begin, end);
+    if (err != UC_ERR_OK) {
+        LOG_WARN(LOG_MEMORY, "mem_unmap_range(%p, %p): %s\n", (void*)begin, (void*)end, uc_strerror(err));
+    }
 }
 
-bool mem_map_region_containing(uc_engine *uc, uint64_t address, uint32_t perms) {
+hidden void mem_registry_remove(uint64_t begin, uint64_t end) {
+    os_unfair_lock_lock(&mem_registry_lock);
+    uint32_t count = atomic_load_explicit(&mem_registry_count, memory_order_relaxed);
+    for (uint32_t i = 0; i < count; i++) {
+        struct mem_registry_entry *entry = &mem_registry[i];
+        if (entry->begin < end && entry->begin + entry->size > begin) {
+            entry->retired = true;
+        }
+    }
+    uint32_t retirements = atomic_load_explicit(&mem_retirements_count, memory_order_relaxed);
+    if (retirements == mem_retirements_capacity) {
+        mem_retirements_capacity = mem_retirements_capacity ? 2 * mem_retirements_capacity : 64;
+        mem_retirements = realloc(mem_retirements, mem_retirements_capacity * sizeof(struct mem_registry_retirement));
+    }
+    mem_retirements[retirements].begin = begin;
+    mem_retirements[retirements].end = end;
+    atomic_store_explicit(&mem_retirements_count, retirements + 1, memory_order_release);
+    os_unfair_lock_unlock(&mem_registry_lock);
+}
+
+// false if the host unmapped or split the region since it was added
+static bool mem_host_region_is_current(uint64_t begin, uint64_t size) {
+    vm_address_t region_address = (vm_address_t)begin;
+    vm_size_t region_size;
+    vm_region_basic_info_data_64_t info;
+    mach_msg_type_number_t count = VM_REGION_BASIC_INFO_COUNT_64;
+    memory_object_name_t object;
+    kern_return_t err = vm_region_64(mach_task_self(), &region_address, &region_size, VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info, &count, &object);
+    return err == KERN_SUCCESS && region_address <= begin && begin + size <= region_address + region_size && info.protection != VM_PROT_NONE;
+}
+
+hidden void mem_registry_sync(struct emulator_ctx *ctx) {
+    uint32_t count = atomic_load_explicit(&mem_registry_count, memory_order_acquire);
+    uint32_t retirements = atomic_load_explicit(&mem_retirements_count, memory_order_acquire);
+    if (ctx->mem_registry_version == count && ctx->mem_retirements_version == retirements) {
+        return;
+    }
+    // the arrays can move and entries can be retired: copy what's new and check it
+    // with the kernel after unlocking, so syncing threads don't serialize on vm_region_64
+    // entries retired after the copy are unmapped by the next sync
+    uint32_t retirement_count = retirements - ctx->mem_retirements_version;
+    struct mem_registry_retirement *new_retirements = malloc(retirement_count * sizeof(struct mem_registry_retirement));
+    struct mem_registry_entry *new_entries = malloc((count - ctx->mem_registry_version) * sizeof(struct mem_registry_entry));
+    uint32_t entry_count = 0;
+    os_unfair_lock_lock(&mem_registry_lock);
+    memcpy(new_retirements, &mem_retirements[ctx->mem_retirements_version], retirement_count * sizeof(struct mem_registry_retirement));
+    for (uint32_t i = ctx->mem_registry_version; i < count; i++) {
+        if (!mem_registry[i].retired) {
+            new_entries[entry_count++] = mem_registry[i];
+        }
+    }
+    os_unfair_lock_unlock(&mem_registry_lock);
+
+    uint64_t stack_begin = (uint64_t)ctx->stack, stack_end = stack_begin + ctx->stack_size;
+    for (uint32_t i = 0; i < retirement_count; i++) {
+        // except this context's stack, if the host has reused the memory for it
+        uint64_t begin = new_retirements[i].begin, end = new_retirements[i].end;
+        mem_unmap_range(ctx, begin, end < stack_begin ? end : stack_begin);
+        mem_unmap_range(ctx, begin > stack_end ? begin : stack_end, end);
+    }
+    for (uint32_t i = 0; i < entry_count; i++) {
+        const struct mem_registry_entry *entry = &new_entries[i];
+        if (mem_is_mapped(ctx, entry->begin, entry->size, entry->perms)) {
+            continue;
+        }
+        if (entry->begin < stack_end && entry->begin + entry->size > stack_begin) {
+            // the host reused the memory for this context's stack
+            continue;
+        }
+        // the host can unmap memory without telling us, mapping it would crash the host when it's accessed
+        if (mem_host_region_is_current(entry->begin, entry->size)) {
+            mem_map_host_region(ctx, entry->begin, entry->size, entry->perms);
+        }
+    }
+    free(new_retirements);
+    free(new_entries);
+    ctx->mem_registry_version = count;
+    ctx->mem_retirements_version = retirements;
+}
+
+bool mem_map_region_containing(struct emulator_ctx *ctx, uint64_t address, uint32_t perms) {
     vm_address_t region_address = (vm_address_t)address;
     vm_size_t region_size;
     vm_region_basic_info_data_64_t info;
@@ -87,35 +225,25 @@ bool mem_map_region_containing(uc_engine *uc, uint64_t address, uint32_t perms)
         fprintf(stderr, "could not map memory: no region found for %p\n", (void*)address);
         abort();
     }
-    
-    uc_err uerr = uc_mem_map_ptr(uc, region_address, region_size, perms, (void*)region_address);
-    if (uerr != UC_ERR_OK) {
-        printf("uc_mem_map_ptr(%p, 0x%lx, %s): %s, trying to remap\n", (void*)region_address, region_size, mem_perm_str[perms], uc_strerror(uerr));
-        bool found = mem_remap_region(uc, region_address, region_size, perms, &uerr);
-        if (uerr != UC_ERR_OK || !found) {
-            printf("uc_mem_map_ptr(%p, 0x%lx, %s): %s\n", (void*)region_address, region_size, mem_perm_str[perms], uc_strerror(uerr));
-            mem_print_uc_regions(uc);
-            return false;
-        }
+    if (info.protection == VM_PROT_NONE) {
+        // guard page, accessing it through unicorn would crash the host
+        LOG_DEBUG(LOG_MEMORY, "not mapping inaccessible region %p-%p\n", (void*)region_address, (void*)(region_address + region_size));
+        return false;
     }
     
+    if (!mem_map_host_region(ctx, region_address, region_size, perms)) {
+        return false;
+    }
+    mem_registry_add(region_address, region_size, perms);
     return true;
 }
 
-hidden bool mem_is_mapped(uc_engine *uc, uint64_t address, size_t size, uint32_t perms) {
-    uc_mem_region *regions;
-    uint32_t num_regions;
-    uint64_t end = address + size - 1;
-    bool is_mapped = false;
-    uc_mem_regions(uc, &regions, &num_regions);
-    for(uint32_t i = 0; i < num_regions; i++) {
-        if (address >= regions[i].begin && address <= regions[i].end && end <= regions[i].end) {
-            is_mapped = (regions[i].perms & perms) ? true : false;
-            break;
-        }
+hidden bool mem_is_mapped(struct emulator_ctx *ctx, uint64_t address, size_t size, uint32_t perms) {
+    const struct mem_interval *region = mem_intervals_find(&ctx->mem_intervals, address);
+    if (region == NULL || address + size > region->end) {
+        return false;
     }
-    free(regions);
-    return is_mapped;
+    return (region->perms & perms) ? true : false;
 }
 
 hidden void print_mem_info(void *ptr) {
@@ -8,6 +8,58 @@
 
 #import "aah.h"
 #import <objc/runtime.h>
+#import <CoreFoundation/CoreFoundation.h>
+
+struct objc_shim {
+    bool meta;
+    const char *class_name; // NULL matches any class
+    const char *signature;
+    struct objc_shim *next;
+};
+
+// SEL -> struct objc_shim list, read-only after init_objc_shims
+static CFMutableDictionaryRef objc_shims_by_sel = NULL;
+
+static void add_objc_shim(const char *name, const char *signature, void *context) {
+    // "-[Class selector]" or "+[* selector]"
+    char key[512];
+    strlcpy(key, name, sizeof key);
+    char *space = strchr(key, ' ');
+    char *end = strrchr(key, ']');
+    if ((key[0] != '-' && key[0] != '+') || key[1] != '[' || space == NULL || end == NULL || end < space) {
+        LOG_WARN(LOG_CIF, "invalid objc shim name: %s\n", name);
+        return;
+    }
+    *space = *end = '\0';
+    struct objc_shim *shim = malloc(sizeof(struct objc_shim));
+    shim->meta = key[0] == '+';
+    shim->class_name = strcmp(&key[2], "*") ? strdup(&key[2]) : NULL;
+    shim->signature = signature;
+    SEL sel = sel_registerName(space + 1);
+    shim->next = (struct objc_shim *)CFDictionaryGetValue(objc_shims_by_sel, sel);
+    CFDictionarySetValue(objc_shims_by_sel, sel, shim);
+}
+
+hidden void init_objc_shims(const struct sigtable *table, const struct sigtable_library *shims) {
+    objc_shims_by_sel = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    if (shims) {
+        sigtable_enumerate(table, shims, add_objc_shim, NULL);
+    }
+}
+
+hidden const char * lookup_objc_shim_signature(bool meta, const char *class_name, SEL sel) {
+    const char *wildcard = NULL;
+    for (struct objc_shim *shim = (struct objc_shim *)CFDictionaryGetValue(objc_shims_by_sel, sel); shim; shim = shim->next) {
+        if (shim->meta != meta) {
+            continue;
+        } else if (shim->class_name == NULL) {
+            wildcard = shim->signature;
+        } else if (strcmp(shim->class_name, class_name) == 0) {
+            return shim->signature;
+        }
+    }
+    return wildcard;
+}
 
 static void cif_cache_add_methods(Class cls, bool only_emulated) {
     unsigned int methodCount;
@@ -109,7 +161,7 @@ hidden void load_objc_methods(struct method_list *methods, bool meta, const char
         char *method_name = NULL;
         asprintf(&method_name, "%c[%s %s]", meta ? '+' : '-', name, method->name);
         //printf("%s (%s) -> %p\n", method_name, method->types, method->implementation);
-        const char *shimMethodSignature = lookup_method_signature(CIF_LIB_OBJC_SHIMS, method_name);
+        const char *shimMethodSignature = lookup_objc_shim_signature(meta, name, sel_registerName(method->name));
         if (shimMethodSignature) {
             cif_cache_add(method->implementation, shimMethodSignature, method_name);
         } else {
@@ -129,21 +181,21 @@ static inline struct class_ro* get_class_ro(struct classref *class) {
 hidden void load_objc_classlist(const struct section_64 *classlist, intptr_t vmaddr_slide) {
     if (classlist) {
         uint64_t numClasses = classlist->size / 8;
-        printf("loading %d classes\n", (int)numClasses);
+        LOG_INFO(LOG_LOADER, "loading %d classes\n", (int)numClasses);
         struct classref **classes = (struct classref**)(classlist->addr + vmaddr_slide);
         for(uint64_t i = 0; i < numClasses; i++) {
             struct classref *class = classes[i];
             struct class_ro *data = get_class_ro(class);
             bool is_metaclass = data->flags & RO_META;
             
-            printf("loading class %p(%p): %s\n", class, data, data->name);
-            printf("flags: %08x\n", data->flags);
+            LOG_DEBUG(LOG_LOADER, "loading class %p(%p): %s\n", class, data, data->name);
+            LOG_DEBUG(LOG_LOADER, "flags: %08x\n", data->flags);
             load_objc_methods(data->baseMethodList, is_metaclass, data->name);
             // superclass methods
             struct classref *isa = (struct classref*)class->isa;
             if (isa && isa != class) {
                 struct class_ro *isa_ro = get_class_ro(isa);
-                printf("super class %p(%p): %s\n", isa, isa_ro, isa_ro->name);
+                LOG_DEBUG(LOG_LOADER, "super class %p(%p): %s\n", isa, isa_ro, isa_ro->name);
                 load_objc_methods(isa_ro->baseMethodList, isa_ro->flags & RO_META, isa_ro->name);
             }
         }
@@ -0,0 +1,95 @@
+//
+//  perf_map.c
+//  aah
+//
+//  Symbol map for host profilers (PERF_MAP=1) in /tmp/perf-<pid>.map, see
+//  perf_map_writer.h: the functions of emulated images, from their symbol
+//  tables and the names of emulated entry points in the cif cache, and the
+//  code caches of unicorn engines. Unicorn 1 doesn't say where it puts each
+//  translated block, so time spent in translated code is attributed to the
+//  code cache as a whole.
+//
+
+#include "aah.h"
+#include "perf_map_writer.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <os/lock.h>
+#include <unistd.h>
+
+static struct perf_map_writer perf_map;
+static bool perf_map_enabled = false;
+// start addresses of writable and executable regions already seen
+static CFMutableSetRef perf_map_code_caches = NULL;
+static os_unfair_lock perf_map_code_cache_lock = OS_UNFAIR_LOCK_INIT;
+
+// calls fn with the start and size of each writable and executable region
+static void scan_code_caches(void (*fn)(vm_address_t, vm_size_t)) {
+    vm_address_t address = 0;
+    vm_size_t size = 0;
+    for (;; address += size) {
+        vm_region_basic_info_data_64_t info;
+        mach_msg_type_number_t count = VM_REGION_BASIC_INFO_COUNT_64;
+        memory_object_name_t object;
+        if (vm_region_64(mach_task_self(), &address, &size, VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info, &count, &object) != KERN_SUCCESS) {
+            break;
+        }
+        if ((info.protection & (VM_PROT_WRITE | VM_PROT_EXECUTE)) == (VM_PROT_WRITE | VM_PROT_EXECUTE)) {
+            fn(address, size);
+        }
+    }
+}
+
+static void ignore_code_cache(vm_address_t address, vm_size_t size) {
+    CFSetAddValue(perf_map_code_caches, (const void *)address);
+}
+
+static void add_code_cache(vm_address_t address, vm_size_t size) {
+    if (!CFSetContainsValue(perf_map_code_caches, (const void *)address)) {
+        CFSetAddValue(perf_map_code_caches, (const void *)address);
+        perf_map_writer_add_region(&perf_map, address, size, "[unicorn code cache]");
+    }
+}
+
+hidden void init_perf_map(void) {
+    if (getenv("PERF_MAP") == NULL || strtol(getenv("PERF_MAP"), NULL, 10) == 0) {
+        return;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "couldn't open perf map %s: %s\n", path, strerror(errno));
+        return;
+    }
+    perf_map_writer_init(&perf_map, fp);
+    // regions that exist before any engine is opened aren't code caches
+    perf_map_code_caches = CFSetCreateMutable(kCFAllocatorDefault, 0, NULL);
+    scan_code_caches(ignore_code_cache);
+    perf_map_enabled = true;
+    LOG_INFO(LOG_EMULATOR, "Writing perf map to %s\n", path);
+}
+
+hidden void perf_map_add_code_caches(void) {
+    if (!perf_map_enabled) {
+        return;
+    }
+    os_unfair_lock_lock(&perf_map_code_cache_lock);
+    scan_code_caches(add_code_cache);
+    os_unfair_lock_unlock(&perf_map_code_cache_lock);
+}
+
+hidden void perf_map_add_image(const struct mach_header_64 *mh, intptr_t vmaddr_slide) {
+    if (!perf_map_enabled) {
+        return;
+    }
+    if (perf_map_writer_add_image(&perf_map, mh, vmaddr_slide) < 0) {
+        LOG_WARN(LOG_EMULATOR, "too many images for perf map\n");
+    }
+}
+
+hidden void perf_map_add_name(uint64_t address, const char *name) {
+    if (!perf_map_enabled || name == NULL) {
+        return;
+    }
+    perf_map_writer_add_name(&perf_map, address, name);
+}
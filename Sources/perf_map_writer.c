@@ -0,0 +1,145 @@
+//
+//  perf_map_writer.c
+//  aah
+//
+//  Lines are only appended, and flushed after each call, so the map is
+//  complete whenever the process is stopped. Overlapping entries are left
+//  to the profiler, which uses the last one.
+//
+
+#include "perf_map_writer.h"
+#include "macho_symbols.h"
+
+static int compare_symbols(const void *a, const void *b) {
+    uint64_t aa = ((const struct macho_symbol *)a)->address, ab = ((const struct macho_symbol *)b)->address;
+    return aa < ab ? -1 : aa > ab;
+}
+
+// index of the first start after address
+static uint32_t image_next_start(const struct perf_map_image *image, uint64_t address) {
+    uint32_t low = 0, high = image->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (image->starts[mid] <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// called with lock held
+static void write_entry(struct perf_map_writer *writer, uint64_t address, uint64_t size, const char *name) {
+    // C symbols have a leading underscore, C++ ones are left mangled for the profiler
+    if (name[0] == '_') {
+        name++;
+    }
+    fprintf(writer->file, "%llx %llx %s\n", (unsigned long long)address, (unsigned long long)size, name);
+}
+
+// the code section of text that contains address, NULL if there is none
+static const struct section_64 * code_section(const struct segment_command_64 *text, uint64_t address) {
+    const struct section_64 *sections = (const struct section_64 *)(text + 1);
+    for (uint32_t i = 0; i < text->nsects; i++) {
+        if ((sections[i].flags & S_ATTR_SOME_INSTRUCTIONS) && address >= sections[i].addr && address < sections[i].addr + sections[i].size) {
+            return &sections[i];
+        }
+    }
+    return NULL;
+}
+
+hidden void perf_map_writer_init(struct perf_map_writer *writer, FILE *file) {
+    writer->file = file;
+    pthread_mutex_init(&writer->lock, NULL);
+    writer->image_count = 0;
+}
+
+hidden int perf_map_writer_add_image(struct perf_map_writer *writer, const struct mach_header_64 *mh, int64_t slide) {
+    const struct segment_command_64 *text = macho_segment(mh, SEG_TEXT);
+    const struct segment_command_64 *linkedit = macho_segment(mh, SEG_LINKEDIT);
+    if (text == NULL) {
+        return 0;
+    }
+    uint32_t count = 0;
+    struct macho_symbol *symbols = NULL;
+    if (linkedit) {
+        // addresses are left unslid to find their sections
+        symbols = macho_defined_symbols(mh, (const uint8_t *)(linkedit->vmaddr + slide - linkedit->fileoff), 0, &count);
+    }
+    uint32_t function_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (code_section(text, symbols[i].address)) {
+            symbols[function_count++] = symbols[i];
+        }
+    }
+    qsort(symbols, function_count, sizeof(struct macho_symbol), compare_symbols);
+
+    pthread_mutex_lock(&writer->lock);
+    if (writer->image_count == PERF_MAP_MAX_IMAGES) {
+        pthread_mutex_unlock(&writer->lock);
+        free(symbols);
+        return -1;
+    }
+    struct perf_map_image *image = &writer->images[writer->image_count++];
+    image->text_begin = text->vmaddr + slide;
+    image->text_end = image->text_begin + text->vmsize;
+    image->starts = malloc((function_count ? function_count : 1) * sizeof(uint64_t));
+    image->count = 0;
+    for (uint32_t i = 0; i < function_count; i++) {
+        // aliases share the first name
+        if (i > 0 && symbols[i].address == symbols[i - 1].address) {
+            continue;
+        }
+        uint32_t next = i + 1;
+        while (next < function_count && symbols[next].address == symbols[i].address) {
+            next++;
+        }
+        const struct section_64 *section = code_section(text, symbols[i].address);
+        uint64_t end = section->addr + section->size;
+        if (next < function_count && symbols[next].address < end) {
+            end = symbols[next].address;
+        }
+        write_entry(writer, symbols[i].address + slide, end - symbols[i].address, symbols[i].name);
+        image->starts[image->count++] = symbols[i].address + slide;
+    }
+    fflush(writer->file);
+    int written = image->count;
+    pthread_mutex_unlock(&writer->lock);
+    free(symbols);
+    return written;
+}
+
+hidden bool perf_map_writer_add_name(struct perf_map_writer *writer, uint64_t address, const char *name) {
+    bool written = false;
+    pthread_mutex_lock(&writer->lock);
+    for (uint32_t i = 0; i < writer->image_count; i++) {
+        struct perf_map_image *image = &writer->images[i];
+        if (address < image->text_begin || address >= image->text_end) {
+            continue;
+        }
+        // stripped functions only, up to the next known one
+        uint32_t next = image_next_start(image, address);
+        if (next > 0 && image->starts[next - 1] == address) {
+            break;
+        }
+        uint64_t end = next < image->count ? image->starts[next] : image->text_end;
+        write_entry(writer, address, end - address, name);
+        fflush(writer->file);
+        image->starts = realloc(image->starts, (image->count + 1) * sizeof(uint64_t));
+        memmove(&image->starts[next + 1], &image->starts[next], (image->count - next) * sizeof(uint64_t));
+        image->starts[next] = address;
+        image->count++;
+        written = true;
+        break;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return written;
+}
+
+hidden void perf_map_writer_add_region(struct perf_map_writer *writer, uint64_t begin, uint64_t size, const char *name) {
+    pthread_mutex_lock(&writer->lock);
+    write_entry(writer, begin, size, name);
+    fflush(writer->file);
+    pthread_mutex_unlock(&writer->lock);
+}
@@ -0,0 +1,50 @@
+//
+//  perf_map_writer.h
+//  aah
+//
+//  Symbol maps in the perf-<pid>.map format read by perf and samply: one
+//  "start size name" line per function, in hex, appended as images and
+//  names are added. perf_map.c decides what goes in the map on macOS; this
+//  part only reads Mach-O images in memory, so it is tested on Linux.
+//
+
+#ifndef perf_map_writer_h
+#define perf_map_writer_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <mach-o/loader.h>
+
+#ifndef hidden
+#define hidden __attribute__ ((visibility ("hidden")))
+#endif
+
+#define PERF_MAP_MAX_IMAGES 256
+
+struct perf_map_image {
+    uint64_t text_begin, text_end;
+    uint32_t count;
+    uint64_t *starts; // sorted addresses of written functions
+};
+
+struct perf_map_writer {
+    FILE *file;
+    pthread_mutex_t lock;
+    uint32_t image_count;
+    struct perf_map_image images[PERF_MAP_MAX_IMAGES];
+};
+
+hidden void perf_map_writer_init(struct perf_map_writer *writer, FILE *file);
+// writes the functions in code sections of the image's __TEXT, sized up to
+// the next symbol, returns how many, or -1 if there are too many images
+// slide is added to the addresses in the image, which must be loaded
+hidden int perf_map_writer_add_image(struct perf_map_writer *writer, const struct mach_header_64 *mh, int64_t slide);
+// names a function of an added image that its symbol table doesn't have,
+// returns false if the address is outside added images or already named
+hidden bool perf_map_writer_add_name(struct perf_map_writer *writer, uint64_t address, const char *name);
+// names a range as a whole, like a code cache
+hidden void perf_map_writer_add_region(struct perf_map_writer *writer, uint64_t begin, uint64_t size, const char *name);
+
+#endif /* perf_map_writer_h */
@@ -0,0 +1,88 @@
+//
+//  registers.c
+//  aah
+//
+//  Batched register transfers: each function is a single call into unicorn.
+//
+
+#include "registers.h"
+
+#define REG_BATCH_MAX 64
+
+hidden void reg_read_list(uc_engine *uc, const int *regs, int count, void *values, size_t stride) {
+    void *ptrs[REG_BATCH_MAX];
+    for (int i = 0; i < count; i++) {
+        ptrs[i] = values + i * stride;
+    }
+    uc_reg_read_batch(uc, (int *)regs, ptrs, count);
+}
+
+hidden void reg_write_list(uc_engine *uc, const int *regs, int count, const void *values, size_t stride) {
+    void *ptrs[REG_BATCH_MAX];
+    for (int i = 0; i < count; i++) {
+        ptrs[i] = (void *)values + i * stride;
+    }
+    uc_reg_write_batch(uc, (int *)regs, ptrs, count);
+}
+
+hidden void reg_read_range(uc_engine *uc, int first_reg, int count, void *values, size_t stride) {
+    int regs[REG_BATCH_MAX];
+    for (int i = 0; i < count; i++) {
+        regs[i] = first_reg + i;
+    }
+    reg_read_list(uc, regs, count, values, stride);
+}
+
+hidden void reg_write_range(uc_engine *uc, int first_reg, int count, const void *values, size_t stride) {
+    int regs[REG_BATCH_MAX];
+    for (int i = 0; i < count; i++) {
+        regs[i] = first_reg + i;
+    }
+    reg_write_list(uc, regs, count, values, stride);
+}
+
+hidden void reg_read_arguments(uc_engine *uc, struct arm64_call_context *context, uint32_t x_mask, uint32_t v_mask, uint64_t *sp) {
+    int regs[N_X_ARG_REG + 1 + N_V_ARG_REG + 1];
+    void *ptrs[N_X_ARG_REG + 1 + N_V_ARG_REG + 1];
+    int count = 0;
+    for (int i = 0; i <= N_X_ARG_REG; i++) {
+        if (x_mask & (1 << i)) {
+            regs[count] = UC_ARM64_REG_X0 + i;
+            ptrs[count++] = &context->x[i];
+        }
+    }
+    for (int i = 0; i < N_V_ARG_REG; i++) {
+        if (v_mask & (1 << i)) {
+            regs[count] = UC_ARM64_REG_V0 + i;
+            ptrs[count++] = &context->v[i];
+        }
+    }
+    if (sp) {
+        regs[count] = UC_ARM64_REG_SP;
+        ptrs[count++] = sp;
+    }
+    uc_reg_read_batch(uc, regs, ptrs, count);
+}
+
+hidden void reg_write_arguments(uc_engine *uc, const struct arm64_call_context *context, uint32_t x_mask, uint32_t v_mask, const uint64_t *sp) {
+    int regs[N_X_ARG_REG + 1 + N_V_ARG_REG + 1];
+    void *ptrs[N_X_ARG_REG + 1 + N_V_ARG_REG + 1];
+    int count = 0;
+    for (int i = 0; i <= N_X_ARG_REG; i++) {
+        if (x_mask & (1 << i)) {
+            regs[count] = UC_ARM64_REG_X0 + i;
+            ptrs[count++] = (void *)&context->x[i];
+        }
+    }
+    for (int i = 0; i < N_V_ARG_REG; i++) {
+        if (v_mask & (1 << i)) {
+            regs[count] = UC_ARM64_REG_V0 + i;
+            ptrs[count++] = (void *)&context->v[i];
+        }
+    }
+    if (sp) {
+        regs[count] = UC_ARM64_REG_SP;
+        ptrs[count++] = (void *)sp;
+    }
+    uc_reg_write_batch(uc, regs, ptrs, count);
+}
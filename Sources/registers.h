@@ -0,0 +1,33 @@
+//
+//  registers.h
+//  aah
+//
+//  Batched register transfers between a unicorn engine and memory, each is
+//  a single call into unicorn. Doesn't depend on macOS.
+//
+
+#ifndef registers_h
+#define registers_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unicorn/unicorn.h>
+#include "ffi_arm64.h"
+
+#ifndef hidden
+#define hidden __attribute__ ((visibility ("hidden")))
+#endif
+
+// values are read from or written to values + i * stride
+hidden void reg_read_list(uc_engine *uc, const int *regs, int count, void *values, size_t stride);
+hidden void reg_write_list(uc_engine *uc, const int *regs, int count, const void *values, size_t stride);
+hidden void reg_read_range(uc_engine *uc, int first_reg, int count, void *values, size_t stride);
+hidden void reg_write_range(uc_engine *uc, int first_reg, int count, const void *values, size_t stride);
+// AAPCS64 argument registers x0-x8 and v0-v7, and sp
+// only registers set in the masks are transferred, and sp if not NULL
+#define REG_ALL_X_ARGUMENTS 0x1ff
+#define REG_ALL_V_ARGUMENTS 0xff
+hidden void reg_read_arguments(uc_engine *uc, struct arm64_call_context *context, uint32_t x_mask, uint32_t v_mask, uint64_t *sp);
+hidden void reg_write_arguments(uc_engine *uc, const struct arm64_call_context *context, uint32_t x_mask, uint32_t v_mask, const uint64_t *sp);
+
+#endif /* registers_h */
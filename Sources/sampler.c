@@ -0,0 +1,266 @@
+//
+//  sampler.c
+//  aah
+//
+//  Sampling profiler for emulated code (SAMPLE_FILE). A timer thread stops
+//  the engines that are emulating, and run_emulator records the guest pc
+//  and frame pointer chain before resuming. Identical stacks are counted
+//  together, and written as folded stacks for flame graph tools at exit.
+//
+//  Guest frames are named from the symbol tables of emulated images, which
+//  include functions that dladdr can't see, and from the names of emulated
+//  entry points, like Objective-C methods, for stripped code.
+//
+
+#include "aah.h"
+#include "macho_symbols.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <os/lock.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define SAMPLE_MAX_DEPTH 64
+
+struct sample_stack {
+    uint64_t count;
+    uint32_t depth;
+    uint64_t pcs[]; // leaf first
+};
+
+static const char *sample_path = NULL;
+static useconds_t sample_interval = 1000;
+// struct sample_stack, compared by pcs
+static CFMutableSetRef sample_stacks = NULL;
+static os_unfair_lock sample_lock = OS_UNFAIR_LOCK_INIT;
+static uint64_t sample_count = 0;
+// address -> name of emulated entry points, under sample_lock
+static CFMutableDictionaryRef sample_entry_names = NULL;
+
+// defined symbols of an emulated image, or entry point names, sorted by address
+struct sample_symbols {
+    uint32_t count;
+    struct macho_symbol *symbols;
+};
+
+static Boolean sample_stack_equal(const void *a, const void *b) {
+    const struct sample_stack *sa = a, *sb = b;
+    return sa->depth == sb->depth && memcmp(sa->pcs, sb->pcs, sa->depth * sizeof(uint64_t)) == 0;
+}
+
+static CFHashCode sample_stack_hash(const void *value) {
+    const struct sample_stack *stack = value;
+    uint64_t hash = stack->depth;
+    for (uint32_t i = 0; i < stack->depth; i++) {
+        hash = (hash ^ stack->pcs[i]) * 0x100000001b3ULL;
+    }
+    return (CFHashCode)hash;
+}
+
+static void * sample_timer_thread(void *arg) {
+    for (;;) {
+        usleep(sample_interval);
+        emulator_ctx_request_samples();
+    }
+    return NULL;
+}
+
+// MARK: output
+
+static int compare_symbols(const void *a, const void *b) {
+    uint64_t aa = ((const struct macho_symbol *)a)->address, ab = ((const struct macho_symbol *)b)->address;
+    return aa < ab ? -1 : aa > ab;
+}
+
+// last symbol at or before address, NULL if there is none
+static const struct macho_symbol * symbol_before(const struct sample_symbols *symbols, uint64_t address) {
+    uint32_t low = 0, high = symbols->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (symbols->symbols[mid].address <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low ? &symbols->symbols[low - 1] : NULL;
+}
+
+static struct sample_symbols * load_image_symbols(const struct mach_header_64 *mh) {
+    struct sample_symbols *symbols = calloc(1, sizeof(struct sample_symbols));
+    const struct segment_command_64 *text = macho_segment(mh, SEG_TEXT);
+    const struct segment_command_64 *linkedit = macho_segment(mh, SEG_LINKEDIT);
+    if (text && linkedit) {
+        int64_t slide = (uint64_t)mh - text->vmaddr;
+        symbols->symbols = macho_defined_symbols(mh, (const uint8_t *)(linkedit->vmaddr + slide - linkedit->fileoff), slide, &symbols->count);
+        qsort(symbols->symbols, symbols->count, sizeof(struct macho_symbol), compare_symbols);
+    }
+    return symbols;
+}
+
+static void add_entry_name(const void *key, const void *value, void *context) {
+    struct sample_symbols *entries = context;
+    entries->symbols[entries->count++] = (struct macho_symbol){.address = (uint64_t)key, .name = value};
+}
+
+struct sample_names {
+    CFMutableDictionaryRef frames; // pc -> name
+    CFMutableDictionaryRef images; // mach header -> struct sample_symbols
+    struct sample_symbols entries;
+};
+
+// the closest function or entry point before pc in an emulated image
+static const char * guest_function_name(struct sample_names *names, const Dl_info *info, uint64_t pc) {
+    const struct mach_header_64 *mh = info->dli_fbase;
+    if (mh == NULL || !should_emulate_image(mh)) {
+        return NULL;
+    }
+    struct sample_symbols *symbols = (struct sample_symbols *)CFDictionaryGetValue(names->images, mh);
+    if (symbols == NULL) {
+        symbols = load_image_symbols(mh);
+        CFDictionarySetValue(names->images, mh, symbols);
+    }
+    const struct macho_symbol *symbol = symbol_before(symbols, pc);
+    const struct macho_symbol *entry = symbol_before(&names->entries, pc);
+    if (entry && entry->address >= (uint64_t)mh && (symbol == NULL || entry->address > symbol->address)) {
+        symbol = entry;
+    }
+    return symbol ? symbol->name : NULL;
+}
+
+static void write_frame(FILE *fp, uint64_t pc, struct sample_names *names) {
+    const char *name = CFDictionaryGetValue(names->frames, (const void *)pc);
+    if (name == NULL) {
+        Dl_info info = {NULL};
+        char *buf = NULL;
+        bool found = dladdr((void*)pc, &info);
+        const char *guest_name = found ? guest_function_name(names, &info, pc) : NULL;
+        if (guest_name) {
+            // C symbols have a leading underscore
+            asprintf(&buf, "%s", guest_name[0] == '_' ? guest_name + 1 : guest_name);
+        } else if (found && info.dli_sname) {
+            asprintf(&buf, "%s", info.dli_sname);
+        } else if (info.dli_fname) {
+            const char *image = strrchr(info.dli_fname, '/');
+            asprintf(&buf, "%s+0x%llx", image ? image + 1 : info.dli_fname, pc - (uint64_t)info.dli_fbase);
+        } else {
+            asprintf(&buf, "0x%llx", pc);
+        }
+        // ; and spaces separate frames and counts
+        for (char *c = buf; *c; c++) {
+            if (*c == ';' || *c == ' ') {
+                *c = '_';
+            }
+        }
+        name = buf;
+        CFDictionarySetValue(names->frames, (const void *)pc, name);
+    }
+    fputs(name, fp);
+}
+
+static void write_sample_stack(const void *value, void *context) {
+    const struct sample_stack *stack = value;
+    FILE *fp = ((void **)context)[0];
+    struct sample_names *names = ((void **)context)[1];
+    // root first
+    for (uint32_t i = stack->depth; i > 0; i--) {
+        write_frame(fp, stack->pcs[i - 1], names);
+        fputc(i > 1 ? ';' : ' ', fp);
+    }
+    fprintf(fp, "%llu\n", stack->count);
+}
+
+static void write_samples(void) {
+    FILE *fp = fopen(sample_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "couldn't open sample file %s: %s\n", sample_path, strerror(errno));
+        return;
+    }
+    // names and symbol tables are leaked
+    struct sample_names names = {
+        .frames = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL),
+        .images = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL),
+    };
+    void *context[2] = {fp, &names};
+    os_unfair_lock_lock(&sample_lock);
+    names.entries.symbols = malloc(CFDictionaryGetCount(sample_entry_names) * sizeof(struct macho_symbol));
+    CFDictionaryApplyFunction(sample_entry_names, add_entry_name, &names.entries);
+    qsort(names.entries.symbols, names.entries.count, sizeof(struct macho_symbol), compare_symbols);
+    CFSetApplyFunction(sample_stacks, write_sample_stack, context);
+    uint64_t count = sample_count;
+    os_unfair_lock_unlock(&sample_lock);
+    fclose(fp);
+    CFRelease(names.frames);
+    CFRelease(names.images);
+    LOG_INFO(LOG_EMULATOR, "wrote %llu samples to %s\n", count, sample_path);
+}
+
+// MARK: sampling
+
+hidden void init_sampler(void) {
+    sample_path = getenv("SAMPLE_FILE");
+    if (sample_path == NULL || *sample_path == '\0') {
+        return;
+    }
+    if (getenv("SAMPLE_RATE")) {
+        long rate = strtol(getenv("SAMPLE_RATE"), NULL, 10);
+        sample_interval = rate > 0 && rate <= 1000000 ? (useconds_t)(1000000 / rate) : sample_interval;
+    }
+    CFSetCallBacks callbacks = {.equal = sample_stack_equal, .hash = sample_stack_hash};
+    sample_stacks = CFSetCreateMutable(kCFAllocatorDefault, 0, &callbacks);
+    sample_entry_names = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    atexit(write_samples);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, sample_timer_thread, NULL);
+    pthread_detach(thread);
+    LOG_INFO(LOG_EMULATOR, "Sampling emulated code every %u us to %s\n", sample_interval, sample_path);
+}
+
+hidden void sampler_record(struct emulator_ctx *ctx) {
+    uint64_t buffer[(sizeof(struct sample_stack) + SAMPLE_MAX_DEPTH * sizeof(uint64_t)) / sizeof(uint64_t)];
+    struct sample_stack *sample = (struct sample_stack *)buffer;
+    uint64_t regs[2];
+    static const int reg_ids[2] = {UC_ARM64_REG_PC, UC_ARM64_REG_FP};
+    reg_read_list(ctx->uc, reg_ids, 2, regs, sizeof(uint64_t));
+    sample->pcs[0] = regs[0];
+    sample->depth = 1;
+
+    // frame records on the emulated stack: previous fp, then lr
+    uint64_t stack_begin = (uint64_t)ctx->stack, stack_end = stack_begin + ctx->stack_size;
+    for (uint64_t fp = regs[1]; sample->depth < SAMPLE_MAX_DEPTH && fp >= stack_begin && fp + 16 <= stack_end && fp % 8 == 0;) {
+        const uint64_t *record = (const uint64_t *)fp;
+        if (record[1] == 0 || record[1] == ctx->return_ptr) {
+            break;
+        }
+        // return addresses point after the call
+        sample->pcs[sample->depth++] = record[1] - 4;
+        if (record[0] <= fp) {
+            break;
+        }
+        fp = record[0];
+    }
+
+    os_unfair_lock_lock(&sample_lock);
+    struct sample_stack *stack = (struct sample_stack *)CFSetGetValue(sample_stacks, sample);
+    if (stack == NULL) {
+        size_t size = sizeof(struct sample_stack) + sample->depth * sizeof(uint64_t);
+        stack = malloc(size);
+        memcpy(stack, sample, size);
+        stack->count = 0;
+        CFSetAddValue(sample_stacks, stack);
+    }
+    stack->count++;
+    sample_count++;
+    os_unfair_lock_unlock(&sample_lock);
+}
+
+hidden void sampler_add_name(uint64_t address, const char *name) {
+    if (sample_path == NULL || name == NULL || !should_emulate_at(address)) {
+        return;
+    }
+    os_unfair_lock_lock(&sample_lock);
+    if (!CFDictionaryContainsKey(sample_entry_names, (const void *)address)) {
+        CFDictionarySetValue(sample_entry_names, (const void *)address, strdup(name));
+    }
+    os_unfair_lock_unlock(&sample_lock);
+}
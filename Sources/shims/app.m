@@ -11,7 +11,8 @@
 #import <Foundation/Foundation.h>
 
 hidden void didInitCtx(struct emulator_ctx *ctx) {
-    // this is called on each thread after the context is initialized, before it runs
+    // this is called once per context, after it's initialized and before it first runs
+    // contexts are pooled and reused by other threads, so don't keep per-thread state here
     // add hooks here
 }
 
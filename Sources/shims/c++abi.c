@@ -11,10 +11,9 @@
 extern int __cxa_atexit(void *f, void *p, void *d);
 
 SHIMDEF(__cxa_atexit) {
-    void *f, *p, *d;
-    uc_reg_read(uc, UC_ARM64_REG_X0, &f);
-    uc_reg_read(uc, UC_ARM64_REG_X1, &p);
-    uc_reg_read(uc, UC_ARM64_REG_X2, &d);
+    void *f = (void*)ctx->arm64_call_context->x[0];
+    void *p = (void*)ctx->arm64_call_context->x[1];
+    void *d = (void*)ctx->arm64_call_context->x[2];
     cif_cache_add(f, "v^v", "(registered with __cxa_atexit)");
     __cxa_atexit(f, p, d);
     return SHIM_RETURN;
@@ -34,7 +34,7 @@ SHIMDEF(nilTerminatedListOfObjects) {
     memset(argEncoding, '@', 3 + totalArgs);
     argEncoding[2] = ':';
     argEncoding[3 + totalArgs] = '\0';
-    printf("calling with arg encoding %s\n", argEncoding);
+    LOG_DEBUG(LOG_CALLS, "calling with arg encoding %s\n", argEncoding);
     // construct call
     ffi_cif cif_native;
     ffi_cif_arm64 cif_arm64;
@@ -43,6 +43,7 @@ SHIMDEF(nilTerminatedListOfObjects) {
     ctx->cif_arm64 = &cif_arm64;
     ctx->before = ctx->after = NULL;
     call_native_with_context(uc, ctx);
+    ffi_dispose_cif_arm64(&cif_arm64);
     free(cif_native.arg_types); // cif_arm64.arg_types is the same*/
     return SHIM_RETURN;
 }
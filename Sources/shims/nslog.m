@@ -53,6 +53,7 @@ uint64_t generic_printf_shim(uc_engine *uc, struct native_call_context *ctx, con
     if (newFormat) {
         [newFormat release];
     }
+    ffi_dispose_cif_arm64(&cif_arm64);
     free(cif_native.arg_types); // cif_arm64.arg_types is the same*/
     return SHIM_RETURN;
 }
@@ -10,6 +10,7 @@
 #import <objc/runtime.h>
 #import <objc/message.h>
 #import <dlfcn.h>
+#import <stdatomic.h>
 #import <Foundation/Foundation.h>
 
 const char * StringFromNSMethodSignature(NSMethodSignature *methodSignature) {
@@ -20,28 +21,39 @@ const char * StringFromNSMethodSignature(NSMethodSignature *methodSignature) {
     return strdup(sig.UTF8String);
 }
 
-static uint64_t shim_objc_msgSendCommon(uc_engine *uc, struct native_call_context *ctx, int is_super) {
-    id receiver;
-    Class cls;
-    if (is_super) {
-        struct objc_super *super = (struct objc_super*)ctx->arm64_call_context->x[0];
-        receiver = super->receiver;
-        cls = super->super_class;
-        if (is_super == 2) {
-            cls = class_getSuperclass(cls);
-        }
-        //printf("objc_msgSendSuper%s with class %s\n", is_super == 2 ? "2" : "", class_getName(cls));
-    } else {
-        receiver = (id)ctx->arm64_call_context->x[0];
-        cls = object_getClass(receiver);
+static _Atomic uint32_t objc_dispatch_generation = 0;
+
+hidden void objc_dispatch_cache_invalidate() {
+    atomic_fetch_add_explicit(&objc_dispatch_generation, 1, memory_order_release);
+}
+
+// the objc runtime flushes its method caches after these, and so do we
+WRAP_NATIVE_TO_EMULATED(objc_dispatch_cache_invalidate) {
+    objc_dispatch_cache_invalidate();
+}
+
+static inline struct objc_dispatch_cache_entry * objc_dispatch_cache_slot(struct emulator_ctx *emulator, Class cls, SEL op) {
+    uint64_t h = (((uintptr_t)cls >> 3) ^ ((uintptr_t)op >> 2)) * 0x9E3779B97F4A7C15ULL;
+    return &emulator->objc_dispatch_cache[(h >> 32) & (OBJC_DISPATCH_CACHE_SIZE - 1)];
+}
+
+static struct objc_dispatch_cache_entry * objc_dispatch_cache_get(struct emulator_ctx *emulator, Class cls, SEL op) {
+    // replaced cif cache entries also invalidate, both generations only go up
+    uint32_t generation = atomic_load_explicit(&objc_dispatch_generation, memory_order_acquire) + cif_cache_get_generation();
+    if (emulator->objc_dispatch_cache_generation != generation) {
+        memset(emulator->objc_dispatch_cache, 0, sizeof(emulator->objc_dispatch_cache));
+        emulator->objc_dispatch_cache_generation = generation;
     }
-    if (receiver == nil) {
-        uint64_t ret = 0;
-        uc_reg_write(uc, UC_ARM64_REG_X0, &ret);
-        printf("objc_msgSend* nil\n");
-        return SHIM_RETURN;
+    struct objc_dispatch_cache_entry *cached = objc_dispatch_cache_slot(emulator, cls, op);
+    if (cached->cls == (__bridge void*)cls && cached->sel == op) {
+        emulator->objc_dispatch_cache_hits++;
+        return cached;
     }
-    SEL op = (SEL)ctx->arm64_call_context->x[1];
+    emulator->objc_dispatch_cache_misses++;
+    return NULL;
+}
+
+static struct objc_dispatch_cache_entry * objc_dispatch_resolve(struct emulator_ctx *emulator, id receiver, Class cls, SEL op) {
     IMP impl = class_getMethodImplementation(cls, op);
     if (impl == _objc_msgForward || impl == _objc_msgForward_stret) {
         // message forwarding is handled further down
@@ -49,40 +61,26 @@ static uint64_t shim_objc_msgSendCommon(uc_engine *uc, struct native_call_contex
     BOOL meta = class_isMetaClass(cls);
     char method_name[256];
     snprintf(method_name, sizeof(method_name), "%c[%s %s]", (meta ? '+' : '-'), class_getName(cls), sel_getName(op));
-    const char *shimMethodSignature = lookup_method_signature(CIF_LIB_OBJC_SHIMS, method_name);
-    ctx->pc = (uint64_t)impl;
-    if (should_emulate_at((uint64_t)impl)) {
-        // calling emulated method
-        if (is_super) {
-            uc_reg_write(uc, UC_ARM64_REG_X0, &receiver);
-            ctx->arm64_call_context->x[0] = (uint64_t)receiver;
-        }
+    const char *shimMethodSignature = lookup_objc_shim_signature(meta, class_getName(cls), op);
+    bool emulated = should_emulate_at((uint64_t)impl);
+    const struct entry_point *entry = NULL;
+    if (emulated) {
         if (shimMethodSignature) {
-            // should be a wrapper or a shim
-            cif_cache_add(impl, shimMethodSignature, "(objc shim)");
-            ffi_cif *cif_native = cif_cache_get_native(impl);
-            ffi_cif_arm64 *cif_arm64 = cif_cache_get_arm64(impl);
-            if (cif_native == CIF_MARKER_SHIM && cif_arm64 != NULL) {
-                // shim
-                shim_ptr shim = (shim_ptr)cif_arm64;
-                // shim should return pc to run the method
-                printf("calling shim for emulated method %s at %p\n", method_name, impl);
-                return shim(uc, ctx);
-            } else {
+            // should be a wrapper or a shim, added on the first miss only
+            entry = cif_cache_get(impl);
+            if (entry == NULL || entry->kind != ENTRY_POINT_SHIM) {
+                cif_cache_add(impl, shimMethodSignature, "(objc shim)");
+                entry = cif_cache_get(impl);
+            }
+            if (entry == NULL || entry->kind != ENTRY_POINT_SHIM || entry->shim == NULL) {
                 // wrapper
                 fprintf(stderr, "unsupported signature for emulated method %s: %s\n", method_name, shimMethodSignature);
                 abort();
             }
-        } else {
-            printf("calling emulated method %s at %p\n", method_name, impl);
         }
-        return (uint64_t)impl;
     } else {
-        // calling native method
-        printf("calling native method %s at %p\n", method_name, impl);
-        ffi_cif *cif_native = cif_cache_get_native(impl);
-        ffi_cif_arm64 *cif_arm64 = cif_cache_get_arm64(impl);
-        if (cif_native == NULL && cif_arm64 == NULL) {
+        entry = cif_cache_get(impl);
+        if (entry == NULL) {
             // check if there's a shim for this method
             // TODO: check if it's a wrapper
             const char *methodSignature = shimMethodSignature;
@@ -92,50 +90,81 @@ static uint64_t shim_objc_msgSendCommon(uc_engine *uc, struct native_call_contex
                     // message forwarding
                     NSMethodSignature *ms = [receiver methodSignatureForSelector:op];
                     if (ms == nil) {
-                        printf("could not find cif for forwarding %s\n", method_name);
+                        LOG_WARN(LOG_CIF, "could not find cif for forwarding %s\n", method_name);
                     } else {
                         methodSignature = StringFromNSMethodSignature(ms);
-                        printf("forwarding signature for %s: %s\n", method_name, methodSignature);
+                        LOG_DEBUG(LOG_CIF, "forwarding signature for %s: %s\n", method_name, methodSignature);
                     }
                 } else {
-                    printf("caching cif for %s with type encoding %s\n", method_name, methodSignature);
+                    LOG_DEBUG(LOG_CIF, "caching cif for %s with type encoding %s\n", method_name, methodSignature);
                 }
             } else {
-                printf("caching shim for %s\n", method_name);
+                LOG_DEBUG(LOG_CIF, "caching shim for %s\n", method_name);
             }
             cif_cache_add(impl, methodSignature, strdup(method_name));
-            cif_native = cif_cache_get_native(impl);
-            cif_arm64 = cif_cache_get_arm64(impl);
+            entry = cif_cache_get(impl);
         }
-        
-        if (is_super) {
-            uc_reg_write(uc, UC_ARM64_REG_X0, &receiver);
-            ctx->arm64_call_context->x[0] = (uint64_t)receiver;
-        }
-        if (CIF_IS_CIF(cif_native) && cif_arm64) {
-            // call
-            ctx->cif_native = cif_native;
-            ctx->cif_arm64 = cif_arm64;
-            ctx->before = ctx->after = NULL;
-            call_native_with_context(uc, ctx);
-            return SHIM_RETURN;
-        } else if (cif_native == CIF_MARKER_SHIM && cif_arm64 != NULL) {
-            // shim
-            shim_ptr shim = (shim_ptr)cif_arm64;
-            return shim(uc, ctx);
-        } else if (cif_native == CIF_MARKER_WRAPPER && cif_arm64 != NULL) {
-            // wrapper
-            struct call_wrapper *wrapper = (struct call_wrapper*)cif_arm64;
-            ctx->cif_native = wrapper->cif_native;
-            ctx->cif_arm64 = wrapper->cif_arm64;
-            ctx->before = wrapper->emulated_to_native;
-            ctx->after = wrapper->native_to_emulated;
-            call_native_with_context(uc, ctx);
-            return SHIM_RETURN;
-        } else {
+        if (entry == NULL || (entry->kind == ENTRY_POINT_SHIM && entry->shim == NULL)) {
             abort();
         }
     }
+    
+    struct objc_dispatch_cache_entry *cached = objc_dispatch_cache_slot(emulator, cls, op);
+    cached->cls = (__bridge void*)cls;
+    cached->sel = op;
+    cached->imp = impl;
+    cached->emulated = emulated;
+    cached->entry = entry;
+    return cached;
+}
+
+static uint64_t shim_objc_msgSendCommon(uc_engine *uc, struct native_call_context *ctx, int is_super) {
+    id receiver;
+    Class cls;
+    if (is_super) {
+        struct objc_super *super = (struct objc_super*)ctx->arm64_call_context->x[0];
+        receiver = super->receiver;
+        cls = super->super_class;
+        if (is_super == 2) {
+            cls = class_getSuperclass(cls);
+        }
+        //printf("objc_msgSendSuper%s with class %s\n", is_super == 2 ? "2" : "", class_getName(cls));
+    } else {
+        receiver = (id)ctx->arm64_call_context->x[0];
+        cls = object_getClass(receiver);
+    }
+    if (receiver == nil) {
+        uint64_t ret = 0;
+        uc_reg_write(uc, UC_ARM64_REG_X0, &ret);
+        LOG_TRACE(LOG_CALLS, "objc_msgSend* nil\n");
+        return SHIM_RETURN;
+    }
+    SEL op = (SEL)ctx->arm64_call_context->x[1];
+    struct emulator_ctx *emulator = get_emulator_ctx();
+    struct objc_dispatch_cache_entry *dispatch = objc_dispatch_cache_get(emulator, cls, op);
+    if (dispatch == NULL) {
+        dispatch = objc_dispatch_resolve(emulator, receiver, cls, op);
+    }
+    char meta = class_isMetaClass(cls) ? '+' : '-';
+    ctx->pc = (uint64_t)dispatch->imp;
+    if (is_super) {
+        uc_reg_write(uc, UC_ARM64_REG_X0, &receiver);
+        ctx->arm64_call_context->x[0] = (uint64_t)receiver;
+    }
+    if (dispatch->emulated) {
+        // calling emulated method
+        if (dispatch->entry) {
+            // shim should return pc to run the method
+            LOG_DEBUG(LOG_CALLS, "calling shim for emulated method %c[%s %s] at %p\n", meta, class_getName(cls), sel_getName(op), dispatch->imp);
+            return dispatch->entry->shim(uc, ctx);
+        }
+        LOG_DEBUG(LOG_CALLS, "calling emulated method %c[%s %s] at %p\n", meta, class_getName(cls), sel_getName(op), dispatch->imp);
+        return (uint64_t)dispatch->imp;
+    } else {
+        // calling native method
+        LOG_DEBUG(LOG_CALLS, "calling native method %c[%s %s] at %p\n", meta, class_getName(cls), sel_getName(op), dispatch->imp);
+        return call_entry_point(uc, dispatch->entry, ctx);
+    }
 }
 
 SHIMDEF(objc_msgSend) {
@@ -36,30 +36,19 @@ struct arm64_jmpbuf {
     uint64_t magic;
 };
 
+// in the same order as struct arm64_jmpbuf
+static const int jmpbuf_regs[] = {
+    UC_ARM64_REG_X19, UC_ARM64_REG_X20, UC_ARM64_REG_X21, UC_ARM64_REG_X22, UC_ARM64_REG_X23,
+    UC_ARM64_REG_X24, UC_ARM64_REG_X25, UC_ARM64_REG_X26, UC_ARM64_REG_X27, UC_ARM64_REG_X28,
+    UC_ARM64_REG_FP, UC_ARM64_REG_LR, UC_ARM64_REG_SP,
+    UC_ARM64_REG_D8, UC_ARM64_REG_D9, UC_ARM64_REG_D10, UC_ARM64_REG_D11,
+    UC_ARM64_REG_D12, UC_ARM64_REG_D13, UC_ARM64_REG_D14, UC_ARM64_REG_D15
+};
+
 SHIMDEF(setjmp) {
     // save context
     struct arm64_jmpbuf *jmpbuf = (void*)ctx->arm64_call_context->x[0];
-    uc_reg_read(uc, UC_ARM64_REG_X19, &jmpbuf->x19);
-    uc_reg_read(uc, UC_ARM64_REG_X20, &jmpbuf->x20);
-    uc_reg_read(uc, UC_ARM64_REG_X21, &jmpbuf->x21);
-    uc_reg_read(uc, UC_ARM64_REG_X22, &jmpbuf->x22);
-    uc_reg_read(uc, UC_ARM64_REG_X23, &jmpbuf->x23);
-    uc_reg_read(uc, UC_ARM64_REG_X24, &jmpbuf->x24);
-    uc_reg_read(uc, UC_ARM64_REG_X25, &jmpbuf->x25);
-    uc_reg_read(uc, UC_ARM64_REG_X26, &jmpbuf->x26);
-    uc_reg_read(uc, UC_ARM64_REG_X27, &jmpbuf->x27);
-    uc_reg_read(uc, UC_ARM64_REG_X28, &jmpbuf->x28);
-    uc_reg_read(uc, UC_ARM64_REG_FP, &jmpbuf->fp);
-    uc_reg_read(uc, UC_ARM64_REG_LR, &jmpbuf->lr);
-    uc_reg_read(uc, UC_ARM64_REG_SP, &jmpbuf->sp);
-    uc_reg_read(uc, UC_ARM64_REG_D8, &jmpbuf->d8);
-    uc_reg_read(uc, UC_ARM64_REG_D9, &jmpbuf->d9);
-    uc_reg_read(uc, UC_ARM64_REG_D10, &jmpbuf->d10);
-    uc_reg_read(uc, UC_ARM64_REG_D11, &jmpbuf->d11);
-    uc_reg_read(uc, UC_ARM64_REG_D12, &jmpbuf->d12);
-    uc_reg_read(uc, UC_ARM64_REG_D13, &jmpbuf->d13);
-    uc_reg_read(uc, UC_ARM64_REG_D14, &jmpbuf->d14);
-    uc_reg_read(uc, UC_ARM64_REG_D15, &jmpbuf->d15);
+    reg_read_list(uc, jmpbuf_regs, sizeof(jmpbuf_regs) / sizeof(int), &jmpbuf->x19, sizeof(uint64_t));
     
     // return 0
     ctx->arm64_call_context->x[0] = 0;
@@ -68,28 +57,9 @@ SHIMDEF(setjmp) {
 
 SHIMDEF(longjmp) {
     // load context
+    // lr is restored too, but the shim returns to it directly
     struct arm64_jmpbuf *jmpbuf = (void*)ctx->arm64_call_context->x[0];
-    uc_reg_write(uc, UC_ARM64_REG_X19, &jmpbuf->x19);
-    uc_reg_write(uc, UC_ARM64_REG_X20, &jmpbuf->x20);
-    uc_reg_write(uc, UC_ARM64_REG_X21, &jmpbuf->x21);
-    uc_reg_write(uc, UC_ARM64_REG_X22, &jmpbuf->x22);
-    uc_reg_write(uc, UC_ARM64_REG_X23, &jmpbuf->x23);
-    uc_reg_write(uc, UC_ARM64_REG_X24, &jmpbuf->x24);
-    uc_reg_write(uc, UC_ARM64_REG_X25, &jmpbuf->x25);
-    uc_reg_write(uc, UC_ARM64_REG_X26, &jmpbuf->x26);
-    uc_reg_write(uc, UC_ARM64_REG_X27, &jmpbuf->x27);
-    uc_reg_write(uc, UC_ARM64_REG_X28, &jmpbuf->x28);
-    uc_reg_write(uc, UC_ARM64_REG_FP, &jmpbuf->fp);
-    // lr doesn't need to be restored, jumping to it after shim
-    uc_reg_write(uc, UC_ARM64_REG_SP, &jmpbuf->sp);
-    uc_reg_write(uc, UC_ARM64_REG_D8, &jmpbuf->d8);
-    uc_reg_write(uc, UC_ARM64_REG_D9, &jmpbuf->d9);
-    uc_reg_write(uc, UC_ARM64_REG_D10, &jmpbuf->d10);
-    uc_reg_write(uc, UC_ARM64_REG_D11, &jmpbuf->d11);
-    uc_reg_write(uc, UC_ARM64_REG_D12, &jmpbuf->d12);
-    uc_reg_write(uc, UC_ARM64_REG_D13, &jmpbuf->d13);
-    uc_reg_write(uc, UC_ARM64_REG_D14, &jmpbuf->d14);
-    uc_reg_write(uc, UC_ARM64_REG_D15, &jmpbuf->d15);
+    reg_write_list(uc, jmpbuf_regs, sizeof(jmpbuf_regs) / sizeof(int), &jmpbuf->x19, sizeof(uint64_t));
     
     // return val
     uint64_t val = ctx->arm64_call_context->x[1];
@@ -11,7 +11,7 @@
 
 WRAP_EMULATED_TO_NATIVE(sort) {
     void *fptr = *(void**)avalues[3];
-    printf("adding qsort comparator at %p", fptr);
+    LOG_DEBUG(LOG_CALLS, "adding qsort comparator at %p\n", fptr);
     cif_cache_add(fptr, "q^v^v", "(sort comparator)");
 }
 
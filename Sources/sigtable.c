@@ -0,0 +1,93 @@
+//
+//  sigtable.c
+//  aah
+//
+//  Reads the table in place, lookups don't allocate.
+//
+
+#include "sigtable.h"
+#include <stdbool.h>
+#include <string.h>
+
+static inline const char * sigtable_string(const struct sigtable *table, uint32_t offset) {
+    return (const char *)table + table->strings + offset;
+}
+
+static bool sigtable_hash_valid(const struct sigtable *table, const struct sigtable_hash *hash) {
+    return hash->bucket_count > 0 && hash->slot_count > 0 &&
+        hash->buckets % 4 == 0 && hash->slots % 4 == 0 &&
+        hash->buckets + (uint64_t)hash->bucket_count * sizeof(uint32_t) <= table->size &&
+        hash->slots + (uint64_t)hash->slot_count * sizeof(struct sigtable_slot) <= table->size;
+}
+
+hidden const struct sigtable * sigtable_open(const void *bytes, size_t size) {
+    const struct sigtable *table = bytes;
+    if (bytes == NULL || ((uintptr_t)bytes & 3) || size < sizeof(struct sigtable) ||
+        table->magic != SIGTABLE_MAGIC || table->version != SIGTABLE_VERSION || table->size > size) {
+        return NULL;
+    }
+    if (table->libraries % 4 || table->libraries + (uint64_t)table->library_count * sizeof(struct sigtable_library) > table->size ||
+        table->strings_size == 0 || table->strings + (uint64_t)table->strings_size > table->size ||
+        sigtable_string(table, table->strings_size - 1)[0] != '\0' ||
+        !sigtable_hash_valid(table, &table->library_hash)) {
+        return NULL;
+    }
+    const struct sigtable_slot *library_slots = (const void *)table + table->library_hash.slots;
+    for (uint32_t i = 0; i < table->library_hash.slot_count; i++) {
+        if (library_slots[i].key >= table->strings_size) {
+            return NULL;
+        }
+    }
+    const struct sigtable_library *libraries = (const void *)table + table->libraries;
+    for (uint32_t i = 0; i < table->library_count; i++) {
+        if (libraries[i].name >= table->strings_size || !sigtable_hash_valid(table, &libraries[i].symbols)) {
+            return NULL;
+        }
+        const struct sigtable_slot *slots = (const void *)table + libraries[i].symbols.slots;
+        for (uint32_t j = 0; j < libraries[i].symbols.slot_count; j++) {
+            if (slots[j].key >= table->strings_size || slots[j].value >= table->strings_size) {
+                return NULL;
+            }
+        }
+    }
+    return table;
+}
+
+static const struct sigtable_slot * sigtable_hash_find(const struct sigtable *table, const struct sigtable_hash *hash, const char *key) {
+    const uint32_t *buckets = (const void *)table + hash->buckets;
+    const struct sigtable_slot *slots = (const void *)table + hash->slots;
+    uint64_t h = sigtable_hash_string(key);
+    uint32_t seed = buckets[sigtable_hash_mix(h, 0) % hash->bucket_count];
+    const struct sigtable_slot *slot = &slots[sigtable_hash_mix(h, seed) % hash->slot_count];
+    if (slot->key == 0 || strcmp(sigtable_string(table, slot->key), key)) {
+        return NULL;
+    }
+    return slot;
+}
+
+hidden const struct sigtable_library * sigtable_find_library(const struct sigtable *table, const char *name) {
+    const struct sigtable_slot *slot = sigtable_hash_find(table, &table->library_hash, name);
+    if (slot == NULL || slot->value >= table->library_count) {
+        return NULL;
+    }
+    const struct sigtable_library *libraries = (const void *)table + table->libraries;
+    return &libraries[slot->value];
+}
+
+hidden const char * sigtable_library_name(const struct sigtable *table, const struct sigtable_library *library) {
+    return sigtable_string(table, library->name);
+}
+
+hidden const char * sigtable_lookup(const struct sigtable *table, const struct sigtable_library *library, const char *symbol) {
+    const struct sigtable_slot *slot = sigtable_hash_find(table, &library->symbols, symbol);
+    return slot ? sigtable_string(table, slot->value) : NULL;
+}
+
+hidden void sigtable_enumerate(const struct sigtable *table, const struct sigtable_library *library, void (*callback)(const char *symbol, const char *signature, void *context), void *context) {
+    const struct sigtable_slot *slots = (const void *)table + library->symbols.slots;
+    for (uint32_t i = 0; i < library->symbols.slot_count; i++) {
+        if (slots[i].key) {
+            callback(sigtable_string(table, slots[i].key), sigtable_string(table, slots[i].value), context);
+        }
+    }
+}
@@ -0,0 +1,91 @@
+//
+//  sigtable.h
+//  aah
+//
+//  Binary method signature table, compiled from SymbolTable.plist at build
+//  time by SymbolTable/compile_symbol_table.c, and read in place from the
+//  __aah_meth_sigs section.
+//
+//  Offsets to arrays are in bytes from the start of the table, string
+//  offsets are from the start of the string pool, which begins with an
+//  empty string so that 0 can mark empty slots. Every string is stored once.
+//
+//  Libraries and the symbols of each library are perfect hashes (hash and
+//  displace): the key's bucket holds the seed that hashes it to its slot,
+//  and the slot's key is compared to reject keys that aren't in the table.
+//  Library aliases are resolved at build time and share their target's
+//  symbols.
+//
+
+#ifndef sigtable_h
+#define sigtable_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef hidden
+#define hidden __attribute__ ((visibility ("hidden")))
+#endif
+
+#define SIGTABLE_MAGIC 0x53484141 // "AAHS"
+#define SIGTABLE_VERSION 2
+
+struct sigtable_hash {
+    uint32_t bucket_count;
+    uint32_t slot_count;
+    uint32_t buckets; // uint32_t seed[bucket_count]
+    uint32_t slots; // struct sigtable_slot[slot_count]
+};
+
+struct sigtable_slot {
+    uint32_t key; // 0 for empty slots
+    uint32_t value;
+};
+
+struct sigtable_library {
+    uint32_t name;
+    struct sigtable_hash symbols; // value is the signature
+};
+
+struct sigtable {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t library_count;
+    uint32_t libraries; // struct sigtable_library[library_count]
+    struct sigtable_hash library_hash; // value is the library index
+    uint32_t strings;
+    uint32_t strings_size;
+};
+
+// shared by the compiler and the reader: keys are hashed in one pass, and
+// their bucket (seed 0) and slot (the bucket's seed) are mixed from that
+static inline uint64_t sigtable_hash_string(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *s; s++) {
+        h ^= (uint8_t)*s;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline uint32_t sigtable_hash_mix(uint64_t h, uint32_t seed) {
+    h ^= seed * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (uint32_t)h;
+}
+
+// returns NULL if bytes don't hold a valid table
+hidden const struct sigtable * sigtable_open(const void *bytes, size_t size);
+// returns NULL if the library is not in the table
+hidden const struct sigtable_library * sigtable_find_library(const struct sigtable *table, const char *name);
+hidden const char * sigtable_library_name(const struct sigtable *table, const struct sigtable_library *library);
+// returns NULL if the symbol is not in the library
+hidden const char * sigtable_lookup(const struct sigtable *table, const struct sigtable_library *library, const char *symbol);
+hidden void sigtable_enumerate(const struct sigtable *table, const struct sigtable_library *library, void (*callback)(const char *symbol, const char *signature, void *context), void *context);
+
+#endif /* sigtable_h */
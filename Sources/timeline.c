@@ -0,0 +1,179 @@
+//
+//  timeline.c
+//  aah
+//
+//  Timeline of transitions (TIMELINE_FILE): begin and end events for
+//  emulation slices and calls into emulated code, and complete events for
+//  calls from emulated to native code, which can be unwound by a C++
+//  exception before they return to record an end. Written at exit as
+//  Chrome trace event JSON that can be loaded in Perfetto or
+//  chrome://tracing. Each thread appends to its own
+//  buffer, so recording only takes a timestamp and a store.
+//
+
+#include "aah.h"
+#include <mach/mach_time.h>
+#include <os/lock.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define TIMELINE_CHUNK_EVENTS 4096
+#define TIMELINE_MAX_CHUNKS 256 // per thread, later events are dropped
+
+struct timeline_event {
+    uint64_t time;
+    const char *category;
+    const char *name;
+    uint64_t duration; // 'X' only
+    char phase; // 'B', 'E' or 'X'
+};
+
+struct timeline_chunk {
+    struct timeline_chunk *next; // published with release
+    uint32_t count; // published with release
+    struct timeline_event events[TIMELINE_CHUNK_EVENTS];
+};
+
+// only written by its thread, read at exit
+struct timeline_buffer {
+    struct timeline_buffer *next;
+    pthread_t owner;
+    uint64_t thread_id;
+    char thread_name[64];
+    uint32_t chunks;
+    uint64_t dropped;
+    struct timeline_chunk *first, *last;
+};
+
+hidden bool timeline_enabled = false;
+static const char *timeline_path = NULL;
+static mach_timebase_info_data_t timeline_timebase;
+static uint64_t timeline_start;
+// buffers of all threads, kept when their contexts are freed or reused
+static struct timeline_buffer *timeline_buffers = NULL;
+static os_unfair_lock timeline_lock = OS_UNFAIR_LOCK_INIT;
+
+static struct timeline_buffer * timeline_buffer_new(void) {
+    struct timeline_buffer *buffer = calloc(1, sizeof(struct timeline_buffer));
+    buffer->owner = pthread_self();
+    pthread_threadid_np(NULL, &buffer->thread_id);
+    pthread_getname_np(buffer->owner, buffer->thread_name, sizeof(buffer->thread_name));
+    buffer->first = buffer->last = calloc(1, sizeof(struct timeline_chunk));
+    buffer->chunks = 1;
+    os_unfair_lock_lock(&timeline_lock);
+    buffer->next = timeline_buffers;
+    timeline_buffers = buffer;
+    os_unfair_lock_unlock(&timeline_lock);
+    return buffer;
+}
+
+static void timeline_append(struct emulator_ctx *ctx, char phase, const char *category, const char *name, uint64_t time, uint64_t duration) {
+    struct timeline_buffer *buffer = ctx->timeline;
+    if (buffer == NULL || !pthread_equal(buffer->owner, pthread_self())) {
+        // first event, or a pooled context reused by another thread
+        buffer = ctx->timeline = timeline_buffer_new();
+    }
+    struct timeline_chunk *chunk = buffer->last;
+    if (chunk->count == TIMELINE_CHUNK_EVENTS) {
+        if (buffer->chunks == TIMELINE_MAX_CHUNKS) {
+            buffer->dropped++;
+            return;
+        }
+        struct timeline_chunk *next = calloc(1, sizeof(struct timeline_chunk));
+        __atomic_store_n(&chunk->next, next, __ATOMIC_RELEASE);
+        buffer->last = chunk = next;
+        buffer->chunks++;
+    }
+    chunk->events[chunk->count] = (struct timeline_event){
+        .time = time,
+        .category = category,
+        .name = name ? name : "(unknown)",
+        .duration = duration,
+        .phase = phase
+    };
+    __atomic_store_n(&chunk->count, chunk->count + 1, __ATOMIC_RELEASE);
+}
+
+hidden void timeline_record(struct emulator_ctx *ctx, char phase, const char *category, const char *name) {
+    timeline_append(ctx, phase, category, name, mach_absolute_time(), 0);
+}
+
+hidden void timeline_record_complete(struct emulator_ctx *ctx, const char *category, const char *name, uint64_t start) {
+    timeline_append(ctx, 'X', category, name, start, mach_absolute_time() - start);
+}
+
+// MARK: output
+
+static void write_json_string(FILE *fp, const char *string) {
+    fputc('"', fp);
+    for (const unsigned char *c = (const unsigned char *)string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(fp, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(fp, "\\u%04x", *c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void write_buffer(FILE *fp, const struct timeline_buffer *buffer, pid_t pid, bool *first) {
+    if (buffer->thread_name[0]) {
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%llu,\"args\":{\"name\":", *first ? "" : ",", pid, buffer->thread_id);
+        write_json_string(fp, buffer->thread_name);
+        fprintf(fp, "}}");
+        *first = false;
+    }
+    for (const struct timeline_chunk *chunk = buffer->first; chunk; chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE)) {
+        uint32_t count = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE);
+        for (uint32_t i = 0; i < count; i++) {
+            const struct timeline_event *event = &chunk->events[i];
+            uint64_t ns = (event->time - timeline_start) * timeline_timebase.numer / timeline_timebase.denom;
+            fprintf(fp, "%s\n{\"name\":", *first ? "" : ",");
+            write_json_string(fp, event->name);
+            fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,", event->category, event->phase, ns / 1000, ns % 1000);
+            if (event->phase == 'X') {
+                uint64_t duration_ns = event->duration * timeline_timebase.numer / timeline_timebase.denom;
+                fprintf(fp, "\"dur\":%llu.%03llu,", duration_ns / 1000, duration_ns % 1000);
+            }
+            fprintf(fp, "\"pid\":%d,\"tid\":%llu}", pid, buffer->thread_id);
+            *first = false;
+        }
+    }
+}
+
+static void write_timeline(void) {
+    FILE *fp = fopen(timeline_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "couldn't open timeline file %s: %s\n", timeline_path, strerror(errno));
+        return;
+    }
+    pid_t pid = getpid();
+    bool first = true;
+    uint64_t dropped = 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    os_unfair_lock_lock(&timeline_lock);
+    for (const struct timeline_buffer *buffer = timeline_buffers; buffer; buffer = buffer->next) {
+        write_buffer(fp, buffer, pid, &first);
+        dropped += buffer->dropped;
+    }
+    os_unfair_lock_unlock(&timeline_lock);
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    if (dropped) {
+        LOG_WARN(LOG_EMULATOR, "timeline buffers were full, %llu events were dropped\n", dropped);
+    }
+    LOG_INFO(LOG_EMULATOR, "wrote timeline to %s\n", timeline_path);
+}
+
+hidden void init_timeline(void) {
+    timeline_path = getenv("TIMELINE_FILE");
+    if (timeline_path == NULL || *timeline_path == '\0') {
+        return;
+    }
+    mach_timebase_info(&timeline_timebase);
+    timeline_start = mach_absolute_time();
+    timeline_enabled = true;
+    atexit(write_timeline);
+}
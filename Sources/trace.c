@@ -0,0 +1,244 @@
+//
+//  trace.c
+//  aah
+//
+//  Block tracer: each emulator thread writes records into its own ring,
+//  a background thread writes them to the trace file. It sleeps until a
+//  ring is a quarter full, or for at most TRACE_IDLE_TIMEOUT, so blocks of
+//  quiet threads still reach the file. Nothing is formatted or disassembled
+//  while tracing, see Tools/print_trace.c.
+//
+
+#include "aah.h"
+#include "trace.h"
+#include <pthread.h>
+#include <unistd.h>
+
+#define TRACE_RING_RECORDS (1 << 16)
+#define TRACE_WAKE_RECORDS (TRACE_RING_RECORDS / 4) // records in a ring that wake the flusher
+#define TRACE_IDLE_TIMEOUT 100 // milliseconds between flushes without a wake up
+
+// single producer (the emulator thread), single consumer (the flusher)
+struct trace_ring {
+    struct trace_ring *next;
+    uint8_t *records;
+    uint64_t thread;
+    uint64_t head; // written by the producer
+    uint64_t tail; // written by the consumer
+    uint64_t dropped, dropped_written;
+    bool retired; // context freed, unlinked and freed by the consumer once drained
+};
+
+static FILE *trace_file = NULL;
+static uint32_t trace_record_size = sizeof(struct trace_record);
+static bool trace_regs = false;
+static struct trace_ring *trace_rings = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+// set by producers to wake the flusher, under trace_wake_lock
+static bool trace_wake_requested = false;
+static pthread_mutex_t trace_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_wake = PTHREAD_COND_INITIALIZER;
+
+static const int trace_reg_ids[TRACE_REG_COUNT] = {
+    UC_ARM64_REG_X0, UC_ARM64_REG_X1, UC_ARM64_REG_X2, UC_ARM64_REG_X3, UC_ARM64_REG_X4,
+    UC_ARM64_REG_X5, UC_ARM64_REG_X6, UC_ARM64_REG_X7, UC_ARM64_REG_X8,
+    UC_ARM64_REG_SP, UC_ARM64_REG_LR
+};
+
+static void trace_write_record(uint64_t address, uint64_t thread, uint32_t size, uint32_t kind) {
+    struct trace_record *record = alloca(trace_record_size);
+    memset(record, 0, trace_record_size);
+    record->address = address;
+    record->thread = thread;
+    record->size = size;
+    record->kind = kind;
+    fwrite(record, trace_record_size, 1, trace_file);
+}
+
+// returns false if there was nothing to write
+static bool trace_drain(struct trace_ring *ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    bool written = tail < head;
+    while (tail < head) {
+        uint64_t index = tail & (TRACE_RING_RECORDS - 1);
+        uint64_t count = head - tail;
+        if (count > TRACE_RING_RECORDS - index) {
+            count = TRACE_RING_RECORDS - index;
+        }
+        fwrite(ring->records + index * trace_record_size, trace_record_size, count, trace_file);
+        tail += count;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->dropped_written) {
+        trace_write_record(dropped - ring->dropped_written, ring->thread, 0, TRACE_DROPPED);
+        ring->dropped_written = dropped;
+        written = true;
+    }
+    return written;
+}
+
+// called with trace_lock held, returns false if there was nothing to write
+static bool trace_drain_all(void) {
+    bool written = false;
+    for (struct trace_ring **next = &trace_rings; *next;) {
+        struct trace_ring *ring = *next;
+        bool retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+        written |= trace_drain(ring);
+        if (retired) {
+            *next = ring->next;
+            free(ring->records);
+            free(ring);
+        } else {
+            next = &ring->next;
+        }
+    }
+    return written;
+}
+
+static void trace_flush(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_drain_all()) {
+        fflush(trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void * trace_flush_thread(void *arg) {
+    for (;;) {
+        trace_flush();
+        pthread_mutex_lock(&trace_wake_lock);
+        if (!trace_wake_requested) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += TRACE_IDLE_TIMEOUT * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&trace_wake, &trace_wake_lock, &deadline);
+        }
+        trace_wake_requested = false;
+        pthread_mutex_unlock(&trace_wake_lock);
+    }
+    return NULL;
+}
+
+static void trace_wake_flusher(void) {
+    pthread_mutex_lock(&trace_wake_lock);
+    trace_wake_requested = true;
+    pthread_cond_signal(&trace_wake);
+    pthread_mutex_unlock(&trace_wake_lock);
+}
+
+static void init_trace(void) {
+    const char *path = getenv("TRACE_FILE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        fprintf(stderr, "couldn't open trace file %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (getenv("TRACE_REGS") && strtol(getenv("TRACE_REGS"), NULL, 10)) {
+        trace_regs = true;
+        trace_record_size += TRACE_REG_COUNT * sizeof(uint64_t);
+    }
+    struct trace_header header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .record_size = trace_record_size,
+        .flags = trace_regs ? TRACE_FLAG_REGS : 0
+    };
+    fwrite(&header, sizeof(header), 1, trace_file);
+    LOG_INFO(LOG_EMULATOR, "Tracing to %s\n", path);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, trace_flush_thread, NULL);
+    pthread_detach(thread);
+    atexit(trace_flush);
+}
+
+static void cb_trace_block(uc_engine *uc, uint64_t address, uint32_t size, struct trace_ring *ring) {
+    uint64_t head = ring->head;
+    uint64_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (used == TRACE_RING_RECORDS) {
+        // never wait for the flusher
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct trace_record *record = (struct trace_record *)(ring->records + (head & (TRACE_RING_RECORDS - 1)) * trace_record_size);
+    record->address = address;
+    record->thread = ring->thread;
+    record->size = size;
+    record->kind = TRACE_BLOCK;
+    if (trace_regs) {
+        reg_read_list(uc, trace_reg_ids, TRACE_REG_COUNT, record->regs, sizeof(uint64_t));
+    }
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    if (used + 1 == TRACE_WAKE_RECORDS) {
+        // once each time the ring fills up past it
+        trace_wake_flusher();
+    }
+}
+
+hidden void trace_attach(struct emulator_ctx *ctx) {
+    pthread_once(&trace_once, init_trace);
+    if (trace_file == NULL) {
+        return;
+    }
+    if (ctx->trace_ring == NULL) {
+        struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+        ring->records = malloc(TRACE_RING_RECORDS * trace_record_size);
+        uc_err err = uc_hook_add(ctx->uc, &ctx->trace_hook, UC_HOOK_BLOCK, (void*)cb_trace_block, ring, 1, 0);
+        if (err != UC_ERR_OK) {
+            fprintf(stderr, "uc_hook_add: %u %s\n", err, uc_strerror(err));
+            abort();
+        }
+        pthread_mutex_lock(&trace_lock);
+        ring->next = trace_rings;
+        trace_rings = ring;
+        pthread_mutex_unlock(&trace_lock);
+        ctx->trace_ring = ring;
+    }
+    // pooled contexts move between threads
+    pthread_threadid_np(NULL, &ctx->trace_ring->thread);
+}
+
+// blocks already in the rings ran before the image was added or removed,
+// so they're written first, blocks from the added image can't run yet
+hidden void trace_add_image(const struct mach_header_64 *mh, const char *path) {
+    pthread_once(&trace_once, init_trace);
+    if (trace_file == NULL || path == NULL) {
+        return;
+    }
+    uint32_t length = (uint32_t)strlen(path);
+    uint32_t padded = (length + trace_record_size - 1) / trace_record_size * trace_record_size;
+    char *path_records = calloc(1, padded);
+    memcpy(path_records, path, length);
+    pthread_mutex_lock(&trace_lock);
+    trace_drain_all();
+    trace_write_record((uint64_t)mh, 0, length, TRACE_IMAGE);
+    fwrite(path_records, padded, 1, trace_file);
+    pthread_mutex_unlock(&trace_lock);
+    free(path_records);
+}
+
+hidden void trace_remove_image(const struct mach_header_64 *mh) {
+    if (trace_file == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    trace_drain_all();
+    trace_write_record((uint64_t)mh, 0, 0, TRACE_IMAGE_REMOVED);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+hidden void trace_detach(struct emulator_ctx *ctx) {
+    if (ctx->trace_ring) {
+        __atomic_store_n(&ctx->trace_ring->retired, true, __ATOMIC_RELEASE);
+        ctx->trace_ring = NULL;
+    }
+}
@@ -0,0 +1,50 @@
+//
+//  trace.h
+//  aah
+//
+//  Execution trace file, written by trace.c when TRACE_FILE is set, and
+//  read by Tools/print_trace.c.
+//
+//  A header followed by fixed-size records of header.record_size bytes.
+//  Blocks are recorded when unicorn enters them, the offline tool
+//  disassembles them from the image files. Each emulated image is recorded
+//  when dyld adds it, with its path in the records that follow it, padded
+//  with zeros, and again when dyld removes it. Blocks are written before
+//  the image records that follow them in time.
+//
+
+#ifndef trace_h
+#define trace_h
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x54484141 // "AAHT"
+#define TRACE_VERSION 2
+
+// records have a register snapshot: x0-x8, sp, lr
+#define TRACE_FLAG_REGS (1 << 0)
+#define TRACE_REG_COUNT 11
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t flags;
+};
+
+enum trace_record_kind {
+    TRACE_BLOCK = 1,    // address is the pc, size is the size of the block
+    TRACE_IMAGE = 2,    // address is the mach header, size is the length of the path
+    TRACE_DROPPED = 3,  // address is the number of blocks dropped because the ring was full
+    TRACE_IMAGE_REMOVED = 4, // address is the mach header
+};
+
+struct trace_record {
+    uint64_t address;
+    uint64_t thread; // pthread_threadid_np
+    uint32_t size;
+    uint32_t kind;
+    uint64_t regs[]; // TRACE_REG_COUNT with TRACE_FLAG_REGS
+};
+
+#endif /* trace_h */
@@ -0,0 +1,242 @@
+//
+//  compile_symbol_table.c
+//  aah
+//
+//  Compiles SymbolTable.plist into the binary table described in
+//  Sources/sigtable.h, which is linked into the __aah_meth_sigs section.
+//
+//  usage: compile_symbol_table SymbolTable.plist SymbolTable.bin
+//
+//  The input format is described in symbol_plist.h.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../Sources/sigtable.h"
+#include "symbol_plist.h"
+
+#define MAX_SEED (1 << 24)
+
+// MARK: output
+
+struct buffer {
+    uint8_t *bytes;
+    size_t size, capacity;
+};
+
+static uint32_t buffer_append(struct buffer *buf, const void *bytes, size_t size) {
+    // everything but strings is made of uint32_t
+    size_t offset = buf->size;
+    if (buf->size + size > buf->capacity) {
+        buf->capacity = 2 * (buf->size + size);
+        buf->bytes = xrealloc(buf->bytes, buf->capacity);
+    }
+    if (bytes) {
+        memcpy(buf->bytes + offset, bytes, size);
+    } else {
+        memset(buf->bytes + offset, 0, size);
+    }
+    buf->size += size;
+    if (buf->size > UINT32_MAX) {
+        fail("table too big%s", "");
+    }
+    return (uint32_t)offset;
+}
+
+static struct buffer strings;
+
+// open addressing set of offsets in the string pool
+static uint32_t *interned = NULL;
+static uint32_t interned_mask = 0, interned_count = 0;
+
+static uint32_t intern(const char *s) {
+    if (*s == '\0') {
+        return 0;
+    }
+    if (4 * (interned_count + 1) > 3 * (interned_mask + 1)) {
+        uint32_t *old = interned;
+        uint32_t old_mask = interned_mask;
+        interned_mask = interned ? 2 * interned_mask + 1 : 1023;
+        interned = calloc(interned_mask + 1, sizeof(uint32_t));
+        for (uint32_t i = 0; old && i <= old_mask; i++) {
+            if (old[i]) {
+                uint32_t j = sigtable_hash_mix(sigtable_hash_string((char *)strings.bytes + old[i]), 0);
+                while (interned[j & interned_mask]) j++;
+                interned[j & interned_mask] = old[i];
+            }
+        }
+        free(old);
+    }
+    for (uint32_t i = sigtable_hash_mix(sigtable_hash_string(s), 0);; i++) {
+        uint32_t *slot = &interned[i & interned_mask];
+        if (*slot == 0) {
+            *slot = buffer_append(&strings, s, strlen(s) + 1);
+            interned_count++;
+            return *slot;
+        } else if (strcmp((char *)strings.bytes + *slot, s) == 0) {
+            return *slot;
+        }
+    }
+}
+
+struct hash_key {
+    const char *key;
+    uint64_t hash;
+    uint32_t value;
+    uint32_t bucket;
+};
+
+static const uint32_t *bucket_sizes;
+
+static int compare_buckets(const void *a, const void *b) {
+    // biggest buckets are placed first
+    uint32_t size_a = bucket_sizes[*(const uint32_t *)a], size_b = bucket_sizes[*(const uint32_t *)b];
+    if (size_a != size_b) {
+        return size_a < size_b ? 1 : -1;
+    }
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+static int compare_keys_by_bucket(const void *a, const void *b) {
+    const struct hash_key *key_a = a, *key_b = b;
+    if (key_a->bucket != key_b->bucket) {
+        return key_a->bucket < key_b->bucket ? -1 : 1;
+    }
+    return 0;
+}
+
+// builds a perfect hash of keys into table, returns its description
+static struct sigtable_hash build_hash(struct buffer *table, struct hash_key *keys, uint32_t count) {
+    struct sigtable_hash hash;
+    hash.bucket_count = count / 4 + 1;
+    hash.slot_count = count + count / 8 + 1;
+    uint32_t *seeds = calloc(hash.bucket_count, sizeof(uint32_t));
+    uint32_t *sizes = calloc(hash.bucket_count, sizeof(uint32_t));
+    uint32_t *starts = calloc(hash.bucket_count, sizeof(uint32_t));
+    uint32_t *order = calloc(hash.bucket_count, sizeof(uint32_t));
+    struct sigtable_slot *slots = calloc(hash.slot_count, sizeof(struct sigtable_slot));
+    uint32_t *bucket_slots = calloc(count + 1, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < count; i++) {
+        keys[i].hash = sigtable_hash_string(keys[i].key);
+        keys[i].bucket = sigtable_hash_mix(keys[i].hash, 0) % hash.bucket_count;
+        sizes[keys[i].bucket]++;
+    }
+    qsort(keys, count, sizeof(struct hash_key), compare_keys_by_bucket);
+    for (uint32_t i = 0, start = 0; i < hash.bucket_count; i++) {
+        starts[i] = start;
+        start += sizes[i];
+        order[i] = i;
+    }
+    bucket_sizes = sizes;
+    qsort(order, hash.bucket_count, sizeof(uint32_t), compare_buckets);
+
+    for (uint32_t i = 0; i < hash.bucket_count && sizes[order[i]]; i++) {
+        uint32_t bucket = order[i];
+        struct hash_key *bucket_keys = &keys[starts[bucket]];
+        uint32_t seed;
+        for (seed = 1; seed < MAX_SEED; seed++) {
+            uint32_t placed = 0;
+            for (; placed < sizes[bucket]; placed++) {
+                uint32_t slot = sigtable_hash_mix(bucket_keys[placed].hash, seed) % hash.slot_count;
+                bool taken = slots[slot].key != 0;
+                for (uint32_t j = 0; j < placed && !taken; j++) {
+                    taken = bucket_slots[j] == slot;
+                }
+                if (taken) break;
+                bucket_slots[placed] = slot;
+            }
+            if (placed == sizes[bucket]) break;
+        }
+        if (seed == MAX_SEED) {
+            fail("could not build perfect hash for %s", bucket_keys[0].key);
+        }
+        seeds[bucket] = seed;
+        for (uint32_t j = 0; j < sizes[bucket]; j++) {
+            slots[bucket_slots[j]].key = intern(bucket_keys[j].key);
+            slots[bucket_slots[j]].value = bucket_keys[j].value;
+        }
+    }
+
+    hash.buckets = buffer_append(table, seeds, hash.bucket_count * sizeof(uint32_t));
+    hash.slots = buffer_append(table, slots, hash.slot_count * sizeof(struct sigtable_slot));
+    free(seeds);
+    free(sizes);
+    free(starts);
+    free(order);
+    free(slots);
+    free(bucket_slots);
+    return hash;
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s SymbolTable.plist SymbolTable.bin\n", argv[0]);
+        return 1;
+    }
+
+    size_t input_size;
+    char *input = read_file(argv[1], &input_size);
+    struct symbol_plist plist;
+    parse_symbol_plist(&plist, input, input_size);
+    uint32_t library_count = plist.library_count;
+
+    // header and library records are filled in at the end
+    struct buffer table = {0};
+    buffer_append(&table, NULL, sizeof(struct sigtable));
+    uint32_t libraries_offset = buffer_append(&table, NULL, library_count * sizeof(struct sigtable_library));
+    buffer_append(&strings, "", 1);
+
+    // by library index, aliases use the hash of their target
+    struct sigtable_hash *hashes = calloc(library_count + 1, sizeof(struct sigtable_hash));
+    uint32_t symbol_count = 0;
+    for (uint32_t i = 0; i < library_count; i++) {
+        const struct plist_library *library = &plist.libraries[i];
+        if (library->alias) {
+            continue;
+        }
+        struct hash_key *keys = calloc(library->symbol_count + 1, sizeof(struct hash_key));
+        for (uint32_t j = 0; j < library->symbol_count; j++) {
+            keys[j].key = library->symbols[j].name;
+            keys[j].value = intern(library->symbols[j].signature);
+        }
+        hashes[i] = build_hash(&table, keys, library->symbol_count);
+        symbol_count += library->symbol_count;
+        free(keys);
+    }
+
+    struct hash_key *library_keys = calloc(library_count + 1, sizeof(struct hash_key));
+    struct sigtable_library *records = calloc(library_count + 1, sizeof(struct sigtable_library));
+    for (uint32_t i = 0; i < library_count; i++) {
+        library_keys[i].key = plist.libraries[i].name;
+        library_keys[i].value = i;
+        records[i].name = intern(plist.libraries[i].name);
+        records[i].symbols = hashes[resolve_plist_alias(&plist, &plist.libraries[i]) - plist.libraries];
+    }
+    struct sigtable header = {
+        .magic = SIGTABLE_MAGIC,
+        .version = SIGTABLE_VERSION,
+        .library_count = library_count,
+        .libraries = libraries_offset,
+    };
+    header.library_hash = build_hash(&table, library_keys, library_count);
+    memcpy(table.bytes + libraries_offset, records, library_count * sizeof(struct sigtable_library));
+    header.strings = buffer_append(&table, strings.bytes, strings.size);
+    header.strings_size = (uint32_t)strings.size;
+    header.size = (uint32_t)table.size;
+    memcpy(table.bytes, &header, sizeof(header));
+
+    if (sigtable_open(table.bytes, table.size) == NULL) {
+        fail("generated table is invalid%s", "");
+    }
+
+    // write output
+    FILE *fp = fopen(argv[2], "wb");
+    if (fp == NULL || fwrite(table.bytes, 1, table.size, fp) != table.size || fclose(fp)) {
+        fail("could not write %s", argv[2]);
+    }
+    printf("%u libraries, %u symbols, %u bytes of strings, %zu bytes total\n", library_count, symbol_count, header.strings_size, table.size);
+    return 0;
+}
@@ -0,0 +1,208 @@
+//
+//  symbol_plist.c
+//  aah
+//
+
+#include "symbol_plist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+void fail(const char *fmt, const char *arg) {
+    fprintf(stderr, "symbol table: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+void * xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL && size) {
+        fail("out of memory%s", "");
+    }
+    return ptr;
+}
+
+char * read_file(const char *path, size_t *size) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fail("could not open %s", path);
+    }
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *data = xrealloc(NULL, *size + 1);
+    if (fread(data, 1, *size, fp) != *size) {
+        fail("could not read %s", path);
+    }
+    fclose(fp);
+    data[*size] = '\0';
+    return data;
+}
+
+// MARK: parser
+
+struct parser {
+    const char *p, *end;
+    int line;
+};
+
+static void skip_space(struct parser *ps) {
+    while (ps->p < ps->end) {
+        if (*ps->p == '\n') {
+            ps->line++;
+            ps->p++;
+        } else if (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\r') {
+            ps->p++;
+        } else if (ps->p + 1 < ps->end && ps->p[0] == '/' && ps->p[1] == '/') {
+            while (ps->p < ps->end && *ps->p != '\n') ps->p++;
+        } else if (ps->p + 1 < ps->end && ps->p[0] == '/' && ps->p[1] == '*') {
+            for (ps->p += 2; ps->p + 1 < ps->end && !(ps->p[0] == '*' && ps->p[1] == '/'); ps->p++) {
+                if (*ps->p == '\n') ps->line++;
+            }
+            ps->p += 2;
+        } else {
+            break;
+        }
+    }
+}
+
+static void parse_error(struct parser *ps, const char *expected) {
+    char message[128];
+    snprintf(message, sizeof message, "line %d: expected %%s", ps->line);
+    fail(message, expected);
+}
+
+static bool parse_char(struct parser *ps, char c) {
+    skip_space(ps);
+    if (ps->p < ps->end && *ps->p == c) {
+        ps->p++;
+        return true;
+    }
+    return false;
+}
+
+static bool is_unquoted_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("_$+/:.-", c);
+}
+
+static char * parse_string(struct parser *ps) {
+    skip_space(ps);
+    if (ps->p >= ps->end) {
+        parse_error(ps, "string");
+    }
+    size_t size = 0;
+    char *s = xrealloc(NULL, ps->end - ps->p + 1);
+    if (*ps->p == '"') {
+        for (ps->p++; ps->p < ps->end && *ps->p != '"'; ps->p++) {
+            if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+                ps->p++;
+                switch (*ps->p) {
+                    case 'n': s[size++] = '\n'; break;
+                    case 't': s[size++] = '\t'; break;
+                    default: s[size++] = *ps->p; break;
+                }
+            } else {
+                if (*ps->p == '\n') ps->line++;
+                s[size++] = *ps->p;
+            }
+        }
+        if (!parse_char(ps, '"')) {
+            parse_error(ps, "closing quote");
+        }
+    } else {
+        while (ps->p < ps->end && is_unquoted_char(*ps->p)) {
+            s[size++] = *ps->p++;
+        }
+        if (size == 0) {
+            parse_error(ps, "string");
+        }
+    }
+    s[size] = '\0';
+    return xrealloc(s, size + 1);
+}
+
+// MARK: libraries
+
+static void add_symbol(struct plist_library *library, char *name, char *signature) {
+    for (uint32_t i = 0; i < library->symbol_count; i++) {
+        if (strcmp(library->symbols[i].name, name) == 0) {
+            // same as CFPropertyList: the last one wins
+            free(library->symbols[i].signature);
+            library->symbols[i].signature = signature;
+            free(name);
+            return;
+        }
+    }
+    library->symbols = xrealloc(library->symbols, (library->symbol_count + 1) * sizeof(struct plist_symbol));
+    library->symbols[library->symbol_count].name = name;
+    library->symbols[library->symbol_count].signature = signature;
+    library->symbol_count++;
+}
+
+struct plist_library * find_plist_library(const struct symbol_plist *plist, const char *name) {
+    for (uint32_t i = 0; i < plist->library_count; i++) {
+        if (strcmp(plist->libraries[i].name, name) == 0) {
+            return &plist->libraries[i];
+        }
+    }
+    return NULL;
+}
+
+void parse_symbol_plist(struct symbol_plist *plist, const char *input, size_t size) {
+    struct parser parser = {.p = input, .end = input + size, .line = 1}, *ps = &parser;
+    plist->libraries = NULL;
+    plist->library_count = 0;
+    if (!parse_char(ps, '{')) {
+        parse_error(ps, "{");
+    }
+    while (!parse_char(ps, '}')) {
+        char *name = parse_string(ps);
+        if (find_plist_library(plist, name)) {
+            fail("duplicate library %s", name);
+        }
+        plist->libraries = xrealloc(plist->libraries, (plist->library_count + 1) * sizeof(struct plist_library));
+        struct plist_library *library = &plist->libraries[plist->library_count++];
+        memset(library, 0, sizeof(struct plist_library));
+        library->name = name;
+        if (!parse_char(ps, '=')) {
+            parse_error(ps, "=");
+        }
+        if (parse_char(ps, '{')) {
+            while (!parse_char(ps, '}')) {
+                char *symbol = parse_string(ps);
+                if (!parse_char(ps, '=')) {
+                    parse_error(ps, "=");
+                }
+                char *signature = parse_string(ps);
+                if (!parse_char(ps, ';')) {
+                    parse_error(ps, ";");
+                }
+                add_symbol(library, symbol, signature);
+            }
+        } else {
+            library->alias = parse_string(ps);
+        }
+        if (!parse_char(ps, ';')) {
+            parse_error(ps, ";");
+        }
+    }
+    skip_space(ps);
+    if (ps->p != ps->end) {
+        parse_error(ps, "end of file");
+    }
+}
+
+struct plist_library * resolve_plist_alias(const struct symbol_plist *plist, struct plist_library *library) {
+    for (uint32_t depth = 0; library->alias; depth++) {
+        struct plist_library *target = find_plist_library(plist, library->alias);
+        if (target == NULL) {
+            fail("alias to missing library %s", library->alias);
+        } else if (depth > plist->library_count) {
+            fail("alias loop in %s", library->name);
+        }
+        library = target;
+    }
+    return library;
+}
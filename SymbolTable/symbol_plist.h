@@ -0,0 +1,48 @@
+//
+//  symbol_plist.h
+//  aah
+//
+//  Parser for SymbolTable.plist, shared by compile_symbol_table and the
+//  Linux benchmark of the compiled table (Tests/sigtable_bench.c).
+//
+//  The input is an OpenStep plist: a dictionary of libraries, each a
+//  dictionary of symbol = signature, or a string naming another library
+//  to use instead. // and /* */ comments are allowed.
+//
+
+#ifndef symbol_plist_h
+#define symbol_plist_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct plist_symbol {
+    char *name;
+    char *signature;
+};
+
+struct plist_library {
+    char *name;
+    char *alias; // library name, or NULL
+    struct plist_symbol *symbols;
+    uint32_t symbol_count;
+};
+
+struct symbol_plist {
+    struct plist_library *libraries;
+    uint32_t library_count;
+};
+
+// print "symbol table: " and the message, and exit
+void fail(const char *fmt, const char *arg);
+void * xrealloc(void *ptr, size_t size);
+// the contents of a file followed by a NUL, fails if it can't be read
+char * read_file(const char *path, size_t *size);
+
+// fails with the line number on syntax errors and duplicate libraries
+void parse_symbol_plist(struct symbol_plist *plist, const char *input, size_t size);
+struct plist_library * find_plist_library(const struct symbol_plist *plist, const char *name);
+// follows aliases, fails on missing targets and loops
+struct plist_library * resolve_plist_alias(const struct symbol_plist *plist, struct plist_library *library);
+
+#endif /* symbol_plist_h */
@@ -0,0 +1,206 @@
+//
+//  cif_table_stress.c
+//  aah
+//
+//  Stress test and benchmark of cif_table: reader threads look up random
+//  addresses while a writer inserts and overwrites them, growing the table
+//  from its minimum size. Every value read must be one the writer stored
+//  for that address. Lookup throughput is compared with the same lookups
+//  behind a global lock, like the cif cache before it was lock-free.
+//  Finally, the first half is removed like an unloaded image and added back
+//  through the growth that drops removed entries.
+//
+//  usage: cif_table_stress [--quick] [threads]
+//
+
+#include "cif_table.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BASE_ADDRESS 0x100000000ULL
+
+static uint32_t entry_count = 1 << 20;
+static uint64_t lookups_per_thread = 20000000;
+static struct cif_table *table;
+static pthread_mutex_t locked_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint_fast64_t errors;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t address_at(uint32_t index) {
+    return BASE_ADDRESS + 4 * (uint64_t)index;
+}
+
+// the writer stores first_value, then overwrites it with second_value
+static inline void * first_value(uint64_t address) {
+    return (void *)(address ^ 0x5555000000000000ULL);
+}
+
+static inline void * second_value(uint64_t address) {
+    return (void *)(address ^ 0xAAAA000000000000ULL);
+}
+
+static inline uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void * writer_thread(void *arg) {
+    for (uint32_t i = 0; i < entry_count; i++) {
+        uint64_t address = address_at(i);
+        if (cif_table_set(table, address, first_value(address), false) != first_value(address)) {
+            atomic_fetch_add(&errors, 1);
+        }
+    }
+    for (uint32_t i = 0; i < entry_count; i += 2) {
+        uint64_t address = address_at(i);
+        cif_table_set(table, address, second_value(address), true);
+    }
+    return NULL;
+}
+
+struct reader {
+    pthread_t thread;
+    uint64_t seed;
+    bool locked;
+    uint64_t lookups;
+    uint64_t found;
+    uint64_t ns;
+};
+
+static void * reader_thread(void *arg) {
+    struct reader *reader = arg;
+    uint64_t state = reader->seed, found = 0, local_errors = 0;
+    uint64_t start = now_ns();
+    for (uint64_t n = 0; n < lookups_per_thread; n++) {
+        uint64_t address = address_at(next_random(&state) % entry_count);
+        void *value;
+        if (reader->locked) {
+            pthread_mutex_lock(&locked_table_lock);
+            value = cif_table_get(table, address);
+            pthread_mutex_unlock(&locked_table_lock);
+        } else {
+            value = cif_table_get(table, address);
+        }
+        if (value) {
+            found++;
+            local_errors += value != first_value(address) && value != second_value(address);
+        }
+    }
+    reader->ns = now_ns() - start;
+    reader->lookups = lookups_per_thread;
+    reader->found = found;
+    atomic_fetch_add(&errors, local_errors);
+    return NULL;
+}
+
+// returns total lookups per second
+static double run_readers(int threads, bool locked, const char *what) {
+    struct reader *readers = calloc(threads, sizeof(struct reader));
+    for (int i = 0; i < threads; i++) {
+        readers[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        readers[i].locked = locked;
+        pthread_create(&readers[i].thread, NULL, reader_thread, &readers[i]);
+    }
+    double rate = 0;
+    uint64_t found = 0, lookups = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(readers[i].thread, NULL);
+        rate += readers[i].lookups * 1e9 / readers[i].ns;
+        found += readers[i].found;
+        lookups += readers[i].lookups;
+    }
+    printf("  %-34s %2d threads %8.1f M lookups/s, %5.1f%% found\n", what, threads, rate / 1e6, 100.0 * found / lookups);
+    free(readers);
+    return rate;
+}
+
+static void check_all_entries(void) {
+    if (cif_table_count(table) != entry_count) {
+        fprintf(stderr, "count is %u, expected %u\n", cif_table_count(table), entry_count);
+        atomic_fetch_add(&errors, 1);
+    }
+    for (uint32_t i = 0; i < entry_count; i++) {
+        uint64_t address = address_at(i);
+        void *expected = i % 2 ? first_value(address) : second_value(address);
+        if (cif_table_get(table, address) != expected) {
+            atomic_fetch_add(&errors, 1);
+        }
+    }
+    if (cif_table_get(table, address_at(entry_count)) != NULL || cif_table_get(table, 0) != NULL) {
+        atomic_fetch_add(&errors, 1);
+    }
+}
+
+static void check_remove_range(void) {
+    uint32_t half = entry_count / 2;
+    if (cif_table_remove_range(table, address_at(0), address_at(half)) != half || cif_table_count(table) != entry_count - half) {
+        fprintf(stderr, "remove_range: count is %u, expected %u\n", cif_table_count(table), entry_count - half);
+        atomic_fetch_add(&errors, 1);
+    }
+    for (uint32_t i = 0; i < entry_count; i++) {
+        uint64_t address = address_at(i);
+        void *expected = i < half ? NULL : i % 2 ? first_value(address) : second_value(address);
+        if (cif_table_get(table, address) != expected) {
+            atomic_fetch_add(&errors, 1);
+        }
+    }
+    // re-adding reuses the removed slots, then new entries grow the table
+    for (uint32_t i = 0; i < entry_count + half; i++) {
+        uint64_t address = address_at(i);
+        if (i < half || i >= entry_count) {
+            cif_table_set(table, address, i % 2 ? first_value(address) : second_value(address), false);
+        }
+    }
+    entry_count += half;
+    check_all_entries();
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            entry_count = 1 << 16;
+            lookups_per_thread = 1000000;
+        } else {
+            threads = atoi(argv[i]);
+        }
+    }
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 2 ? (int)cpus - 1 : 2;
+    }
+
+    printf("cif_table: %u entries\n", entry_count);
+    table = cif_table_create(1);
+    pthread_t writer;
+    pthread_create(&writer, NULL, writer_thread, NULL);
+    run_readers(threads, false, "lock-free, while inserting");
+    pthread_join(writer, NULL);
+    check_all_entries();
+
+    double lock_free = run_readers(threads, false, "lock-free");
+    double locked = run_readers(threads, true, "global lock");
+    run_readers(1, false, "lock-free");
+    run_readers(1, true, "global lock");
+    printf("  lock-free lookups are %.1fx faster with %d threads\n", lock_free / locked, threads);
+    check_remove_range();
+
+    uint64_t error_count = atomic_load(&errors);
+    if (error_count) {
+        fprintf(stderr, "cif_table: %llu wrong values\n", (unsigned long long)error_count);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,250 @@
+//
+//  emulated_ranges_bench.c
+//  aah
+//
+//  Benchmark of should_emulate_at with as many images as an app loads:
+//  binary search of the emulated ranges snapshot against the linear scan it
+//  replaced. Every image adds its segments, a few of them are emulated, and
+//  most lookups are of native addresses, like those from the objc_msgSend
+//  shim. Both must return the same flags.
+//
+//  Then reader threads look up addresses in a table while a writer loads
+//  and unloads images, checking that ranges that stay loaded are always
+//  found and that replaced snapshots are freed once lookups are done.
+//
+//  usage: emulated_ranges_bench [--quick]
+//
+
+#include "emulated_ranges.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SEGMENTS_PER_IMAGE 4
+#define LOOKUPS 4096
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t next_random(uint32_t n) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t)(state % n);
+}
+
+// the old unsorted array, in load order
+static struct emulated_range *linear_ranges = NULL;
+static uint32_t linear_count = 0;
+
+static uint32_t linear_find(uint64_t address) {
+    for (uint32_t i = 0; i < linear_count; i++) {
+        if (address >= linear_ranges[i].begin && address < linear_ranges[i].end) {
+            return linear_ranges[i].flags;
+        }
+    }
+    return 0;
+}
+
+static uint32_t count_mismatches(const struct emulated_ranges *snapshot, const uint64_t *addresses) {
+    uint32_t mismatches = 0;
+    for (int i = 0; i < LOOKUPS; i++) {
+        if (emulated_ranges_find(snapshot, addresses[i]) != linear_find(addresses[i])) {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+static void bench(uint32_t images, uint32_t emulated_images, uint64_t rounds) {
+    static struct emulated_ranges empty = {.count = 0};
+    struct emulated_ranges *snapshot = &empty;
+    linear_ranges = realloc(linear_ranges, emulated_images * SEGMENTS_PER_IMAGE * sizeof(struct emulated_range));
+    linear_count = 0;
+    // images are loaded at random places in the shared cache and after the app
+    uint64_t *image_bases = malloc(images * sizeof(uint64_t));
+    for (uint32_t i = 0; i < images; i++) {
+        image_bases[i] = 0x180000000ULL + (uint64_t)next_random(1 << 20) * 0x100000;
+    }
+    for (uint32_t i = 0; i < emulated_images; i++) {
+        // the app and its frameworks, not in the shared cache
+        uint64_t base = 0x100000000ULL + (uint64_t)i * 0x1000000;
+        image_bases[next_random(images)] = base;
+        for (uint32_t s = 0; s < SEGMENTS_PER_IMAGE; s++) {
+            uint64_t begin = base + s * 0x200000, end = begin + 0x100000;
+            struct emulated_ranges *old = snapshot;
+            snapshot = emulated_ranges_insert(old, begin, end, 1);
+            if (old != &empty) {
+                free(old);
+            }
+            linear_ranges[linear_count++] = (struct emulated_range){begin, end, 1};
+        }
+    }
+    // one lookup in ten is emulated code
+    uint64_t addresses[LOOKUPS];
+    for (int i = 0; i < LOOKUPS; i++) {
+        uint64_t base = next_random(10) ? image_bases[next_random(images)] : 0x100000000ULL + (uint64_t)next_random(emulated_images) * 0x1000000;
+        addresses[i] = base + next_random(SEGMENTS_PER_IMAGE * 0x200000);
+    }
+    uint32_t mismatches = count_mismatches(snapshot, addresses);
+
+    uint64_t found = 0;
+    uint64_t start = now_ns();
+    for (uint64_t n = 0; n < rounds; n++) {
+        found += linear_find(addresses[n % LOOKUPS]);
+    }
+    double linear_ns = (double)(now_ns() - start) / rounds;
+    start = now_ns();
+    for (uint64_t n = 0; n < rounds; n++) {
+        found += emulated_ranges_find(snapshot, addresses[n % LOOKUPS]);
+    }
+    double binary_ns = (double)(now_ns() - start) / rounds;
+    // unloading the first emulated image
+    for (uint32_t s = 0; s < SEGMENTS_PER_IMAGE; s++) {
+        struct emulated_ranges *old = snapshot;
+        snapshot = emulated_ranges_remove(old, linear_ranges[0].begin);
+        free(old);
+        memmove(&linear_ranges[0], &linear_ranges[1], --linear_count * sizeof(struct emulated_range));
+    }
+    mismatches += count_mismatches(snapshot, addresses);
+    printf("  %4u images, %3u emulated, %4u ranges: linear %6.1f ns, binary search %5.1f ns (%.1fx), %u mismatches\n", images, emulated_images, emulated_images * SEGMENTS_PER_IMAGE, linear_ns, binary_ns, linear_ns / binary_ns, mismatches);
+    if (mismatches) {
+        exit(1);
+    }
+    if (found == 0) {
+        printf("  nothing found\n");
+    }
+    free(snapshot);
+    free(image_bases);
+}
+
+// MARK: table
+
+#define TABLE_READERS 4
+#define LOADED_IMAGES 20
+#define LOADED_FLAGS 1
+#define UNLOADED_FLAGS 2 // images the writer keeps loading and unloading
+
+static struct emulated_ranges_table table = EMULATED_RANGES_TABLE_INITIALIZER;
+static bool writer_done = false;
+static uint64_t table_errors = 0;
+
+static uint64_t image_base(uint32_t image) {
+    return 0x100000000ULL + (uint64_t)image * 0x1000000;
+}
+
+static void image_ranges(uint32_t image, uint32_t flags, struct emulated_range *ranges, uint64_t *begins) {
+    for (uint32_t s = 0; s < SEGMENTS_PER_IMAGE; s++) {
+        uint64_t begin = image_base(image) + s * 0x200000;
+        ranges[s] = (struct emulated_range){begin, begin + 0x100000, flags};
+        begins[s] = begin;
+    }
+}
+
+static void * table_reader_thread(void *arg) {
+    uint64_t random = (uint64_t)(uintptr_t)arg * 0x9E3779B97F4A7C15ULL + 1;
+    uint64_t *lookups = arg;
+    *lookups = 0;
+    while (!__atomic_load_n(&writer_done, __ATOMIC_RELAXED)) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        uint32_t image = random % (2 * LOADED_IMAGES);
+        uint64_t address = image_base(image) + (random >> 32) % (SEGMENTS_PER_IMAGE * 0x200000);
+        bool in_segment = (address - image_base(image)) % 0x200000 < 0x100000;
+        uint32_t flags = emulated_ranges_table_find(&table, address);
+        uint32_t expected = in_segment && image < LOADED_IMAGES ? LOADED_FLAGS : 0;
+        if (flags != expected && !(image >= LOADED_IMAGES && in_segment && flags == UNLOADED_FLAGS)) {
+            __atomic_fetch_add(&table_errors, 1, __ATOMIC_RELAXED);
+        }
+        (*lookups)++;
+    }
+    return NULL;
+}
+
+static void stress_table(uint32_t rounds) {
+    struct emulated_range ranges[SEGMENTS_PER_IMAGE];
+    uint64_t begins[SEGMENTS_PER_IMAGE];
+    for (uint32_t image = 0; image < LOADED_IMAGES; image++) {
+        image_ranges(image, LOADED_FLAGS, ranges, begins);
+        emulated_ranges_table_add(&table, ranges, SEGMENTS_PER_IMAGE);
+    }
+    pthread_t readers[TABLE_READERS];
+    uint64_t lookups[TABLE_READERS];
+    for (int i = 0; i < TABLE_READERS; i++) {
+        pthread_create(&readers[i], NULL, table_reader_thread, &lookups[i]);
+    }
+    uint32_t most_retired = 0;
+    for (uint32_t round = 0; round < rounds; round++) {
+        uint32_t image = LOADED_IMAGES + round % LOADED_IMAGES;
+        image_ranges(image, UNLOADED_FLAGS, ranges, begins);
+        emulated_ranges_table_add(&table, ranges, SEGMENTS_PER_IMAGE);
+        emulated_ranges_table_remove(&table, begins, SEGMENTS_PER_IMAGE);
+        uint32_t retired = emulated_ranges_table_retired_count(&table);
+        most_retired = retired > most_retired ? retired : most_retired;
+    }
+    __atomic_store_n(&writer_done, true, __ATOMIC_RELAXED);
+    uint64_t total_lookups = 0;
+    for (int i = 0; i < TABLE_READERS; i++) {
+        pthread_join(readers[i], NULL);
+        total_lookups += lookups[i];
+    }
+    // without lookups, the next snapshot frees all the others
+    image_ranges(LOADED_IMAGES, UNLOADED_FLAGS, ranges, begins);
+    emulated_ranges_table_add(&table, ranges, SEGMENTS_PER_IMAGE);
+    emulated_ranges_table_remove(&table, begins, SEGMENTS_PER_IMAGE);
+    uint32_t left = emulated_ranges_table_retired_count(&table);
+    printf("  %u images loaded and unloaded during %llu lookups: %u snapshots waiting at most, %u left, %llu errors\n", rounds, (unsigned long long)total_lookups, most_retired, left, (unsigned long long)table_errors);
+    if (table_errors || left) {
+        exit(1);
+    }
+}
+
+// the cost of the reader epoch
+static void bench_table_find(uint64_t rounds) {
+    uint64_t addresses[LOOKUPS];
+    for (int i = 0; i < LOOKUPS; i++) {
+        addresses[i] = image_base(next_random(LOADED_IMAGES)) + next_random(SEGMENTS_PER_IMAGE * 0x200000);
+    }
+    const struct emulated_ranges *snapshot = __atomic_load_n(&table.current, __ATOMIC_ACQUIRE);
+    uint64_t found = 0;
+    uint64_t start = now_ns();
+    for (uint64_t n = 0; n < rounds; n++) {
+        found += emulated_ranges_find(snapshot, addresses[n % LOOKUPS]);
+    }
+    double snapshot_ns = (double)(now_ns() - start) / rounds;
+    start = now_ns();
+    for (uint64_t n = 0; n < rounds; n++) {
+        found += emulated_ranges_table_find(&table, addresses[n % LOOKUPS]);
+    }
+    double table_ns = (double)(now_ns() - start) / rounds;
+    printf("  %u ranges: snapshot %.1f ns, table with reader epoch %.1f ns\n", snapshot->count, snapshot_ns, table_ns);
+    if (found == 0) {
+        printf("  nothing found\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t rounds = 20000000;
+    uint32_t table_rounds = 100000;
+    if (argc > 1 && strcmp(argv[1], "--quick") == 0) {
+        rounds = 200000;
+        table_rounds = 2000;
+    }
+    printf("emulated ranges: ns per should_emulate_at\n");
+    bench(300, 2, rounds);
+    bench(500, 20, rounds);
+    bench(800, 100, rounds);
+    printf("emulated ranges table:\n");
+    stress_table(table_rounds);
+    bench_table_find(rounds);
+    return 0;
+}
@@ -0,0 +1,395 @@
+//
+//  ffi_plan_bench.c
+//  aah
+//
+//  Checks the argument placement plans of ffi_cif_arm64 against the AAPCS64
+//  walker they replaced, for every signature in SymbolTable.plist, and
+//  compares how long placing the arguments of a call into emulated code
+//  takes with each. Signatures with more than one argument are also
+//  checked as variadic after their first one.
+//
+//  usage: ffi_plan_bench [--quick] SymbolTable.plist
+//
+
+#include "ffi_arm64.h"
+#include "../SymbolTable/symbol_plist.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// MARK: signatures
+
+static const char * skip_nested(const char *ms, char opening, char closing) {
+    for (int level = 1; level; ms++) {
+        if (*ms == closing) level--;
+        else if (*ms == opening) level++;
+    }
+    return ms;
+}
+
+// the types of next_type in cif.c, without interning
+static ffi_type * parse_type(const char **signature) {
+    const char *ms = *signature;
+    ffi_type *type = NULL;
+    while (strchr("rnNoORVA", *ms)) {
+        ms++; // qualifiers
+    }
+    switch (*ms++) {
+        case 'c': type = &ffi_type_sint8; break;
+        case 's': type = &ffi_type_sint16; break;
+        case 'i': case 'l': type = &ffi_type_sint32; break;
+        case 'q': type = &ffi_type_sint64; break;
+        case 'C': case 'B': type = &ffi_type_uint8; break;
+        case 'S': type = &ffi_type_uint16; break;
+        case 'I': case 'L': type = &ffi_type_uint32; break;
+        case 'Q': type = &ffi_type_uint64; break;
+        case 'f': type = &ffi_type_float; break;
+        // long double is double on arm64 Darwin
+        case 'd': case 'D': type = &ffi_type_double; break;
+        case 'v': type = &ffi_type_void; break;
+        case '^':
+            parse_type(&ms);
+            // fall through
+        case ':': case '#': case '*': case '?':
+            type = &ffi_type_pointer;
+            break;
+        case '@':
+            type = &ffi_type_pointer;
+            if (*ms == '"') {
+                ms = strchr(ms + 1, '"') + 1;
+            } else if (*ms == '?') {
+                ms++;
+            }
+            break;
+        case '<':
+            type = &ffi_type_pointer;
+            ms = skip_nested(ms, '<', '>');
+            break;
+        case '[': {
+            unsigned long count = strtoul(ms, (char **)&ms, 10);
+            ffi_type *element = *ms == ']' ? &ffi_type_pointer : parse_type(&ms);
+            type = calloc(1, sizeof(ffi_type));
+            type->type = FFI_TYPE_STRUCT;
+            type->elements = calloc(count + 1, sizeof(ffi_type *));
+            for (unsigned long i = 0; i < count; i++) {
+                type->elements[i] = element;
+            }
+            ms++;
+        } break;
+        case '{': {
+            const char *end = skip_nested(ms, '{', '}');
+            const char *equals = strchr(ms, '=');
+            ms = equals && equals < end ? equals + 1 : end - 1;
+            type = calloc(1, sizeof(ffi_type));
+            type->type = FFI_TYPE_STRUCT;
+            type->elements = calloc(1, sizeof(ffi_type *));
+            int count = 0;
+            while (*ms != '}') {
+                type->elements = xrealloc(type->elements, (count + 2) * sizeof(ffi_type *));
+                type->elements[count++] = parse_type(&ms);
+                type->elements[count] = NULL;
+            }
+            ms++;
+        } break;
+        case '(': {
+            ms = strchr(ms, '=') + 1;
+            while (*ms != ')') {
+                ffi_type *member = parse_type(&ms);
+                if (member->size == 0 && member->type == FFI_TYPE_STRUCT) {
+                    // laid out to compare sizes
+                    ffi_cif_arm64 layout;
+                    ffi_prep_cif_arm64(&layout, 0, 0, 0, member, NULL);
+                }
+                if (type == NULL || type->size < member->size) {
+                    type = member;
+                }
+            }
+            ms++;
+        } break;
+        case 'b': {
+            unsigned long bits = strtoul(ms, (char **)&ms, 10);
+            while (*ms == 'b') {
+                ms++;
+                bits += strtoul(ms, (char **)&ms, 10);
+            }
+            type = bits <= 8 ? &ffi_type_uint8 : bits <= 16 ? &ffi_type_uint16 : bits <= 32 ? &ffi_type_uint32 : &ffi_type_uint64;
+        } break;
+        default:
+            fail("unexpected type in %s", *signature);
+    }
+    while (*ms >= '0' && *ms <= '9') {
+        ms++; // offset
+    }
+    *signature = ms;
+    return type;
+}
+
+struct call {
+    const char *signature;
+    ffi_cif_arm64 cif;
+    void **args;
+};
+
+static struct call *calls = NULL;
+static uint32_t call_count = 0;
+static uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+static uint8_t next_byte(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (uint8_t)seed;
+}
+
+static void add_call(const char *signature, bool variadic) {
+    const char *ms = signature;
+    if (*ms == '<') {
+        // wrapper signature, followed by its name
+        ms++;
+    }
+    ffi_type *rtype = parse_type(&ms);
+    ffi_type **types = NULL;
+    uint32_t count = 0;
+    while (*ms && *ms != '>') {
+        types = xrealloc(types, (count + 1) * sizeof(ffi_type *));
+        types[count++] = parse_type(&ms);
+    }
+    if (variadic && count < 2) {
+        free(types);
+        return;
+    }
+    calls = xrealloc(calls, (call_count + 1) * sizeof(struct call));
+    struct call *call = &calls[call_count];
+    call->signature = signature;
+    if (ffi_prep_cif_arm64(&call->cif, variadic, variadic ? 1 : count, count, rtype, types) != FFI_OK) {
+        fail("could not prepare %s", signature);
+    }
+    // random argument values
+    call->args = calloc(count, sizeof(void *));
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t *value = malloc(types[i]->size < 8 ? 8 : types[i]->size);
+        for (size_t j = 0; j < types[i]->size; j++) {
+            value[j] = next_byte();
+        }
+        call->args[i] = value;
+    }
+    call_count++;
+}
+
+// MARK: the walker before plans
+
+struct arg_state {
+    unsigned ngrn;
+    unsigned nsrn;
+    size_t nsaa;
+    unsigned allocating_variadic;
+};
+
+static void * allocate_to_stack(struct arg_state *state, void *stack, size_t alignment, size_t size) {
+    size_t nsaa = state->nsaa;
+    if (state->allocating_variadic && alignment < 8) {
+        alignment = 8;
+    }
+    nsaa = FFI_ALIGN(nsaa, alignment);
+    state->nsaa = nsaa + size;
+    return (char *)stack + nsaa;
+}
+
+static uint64_t extend_integer_type(void *source, int type) {
+    switch (type) {
+        case FFI_TYPE_UINT8: return *(uint8_t *)source;
+        case FFI_TYPE_SINT8: return *(int8_t *)source;
+        case FFI_TYPE_UINT16: return *(uint16_t *)source;
+        case FFI_TYPE_SINT16: return *(int16_t *)source;
+        case FFI_TYPE_UINT32: return *(uint32_t *)source;
+        case FFI_TYPE_INT:
+        case FFI_TYPE_SINT32: return *(int32_t *)source;
+        case FFI_TYPE_UINT64:
+        case FFI_TYPE_SINT64: return *(uint64_t *)source;
+        case FFI_TYPE_POINTER: return *(uintptr_t *)source;
+        default: abort();
+    }
+}
+
+static void extend_hfa_type(struct arm64_call_context *context, unsigned nsrn, void *src, int h) {
+    size_t size = h <= AARCH64_RET_S1 ? 4 : h <= AARCH64_RET_D1 ? 8 : 16;
+    for (int i = 0; i < 4 - (h & 3); i++) {
+        memcpy(&context->v[nsrn + i], src + i * size, size);
+    }
+}
+
+// call_emulated_function before plans, classifies every argument on every call
+static void walk_arguments(const ffi_cif_arm64 *cif, void **args, struct arm64_call_context *regs, void *stack, uint32_t *x_mask_out, uint32_t *v_mask_out) {
+    uint32_t x_mask = 0, v_mask = 0;
+    struct arg_state state = {0};
+    for (uint32_t i = 0; i < cif->nargs; i++) {
+        ffi_type *ty = cif->arg_types[i];
+        size_t s = ty->size;
+        void *a = args[i];
+        int h, t = ty->type;
+        switch (t) {
+            case FFI_TYPE_INT:
+            case FFI_TYPE_UINT8:
+            case FFI_TYPE_SINT8:
+            case FFI_TYPE_UINT16:
+            case FFI_TYPE_SINT16:
+            case FFI_TYPE_UINT32:
+            case FFI_TYPE_SINT32:
+            case FFI_TYPE_UINT64:
+            case FFI_TYPE_SINT64:
+            case FFI_TYPE_POINTER:
+            do_pointer: {
+                uint64_t ext = extend_integer_type(a, t);
+                if (state.ngrn < N_X_ARG_REG) {
+                    x_mask |= 1 << state.ngrn;
+                    regs->x[state.ngrn++] = ext;
+                } else {
+                    void *d = allocate_to_stack(&state, stack, ty->alignment, s);
+                    state.ngrn = N_X_ARG_REG;
+                    memcpy(d, a, s);
+                }
+            } break;
+            case FFI_TYPE_FLOAT:
+            case FFI_TYPE_DOUBLE:
+            case FFI_TYPE_LONGDOUBLE:
+            case FFI_TYPE_STRUCT:
+            case FFI_TYPE_COMPLEX:
+                h = is_vfp_type(ty);
+                if (h) {
+                    int elems = 4 - (h & 3);
+                    if (state.nsrn + elems <= N_V_ARG_REG) {
+                        extend_hfa_type(regs, state.nsrn, a, h);
+                        v_mask |= ((1 << elems) - 1) << state.nsrn;
+                        state.nsrn += elems;
+                        break;
+                    }
+                    state.nsrn = N_V_ARG_REG;
+                    memcpy(allocate_to_stack(&state, stack, ty->alignment, s), a, s);
+                } else if (s > 16) {
+                    a = &args[i];
+                    t = FFI_TYPE_POINTER;
+                    s = sizeof(void *);
+                    goto do_pointer;
+                } else {
+                    size_t n = (s + 7) / 8;
+                    if (state.ngrn + n <= N_X_ARG_REG) {
+                        memcpy(&regs->x[state.ngrn], a, s);
+                        x_mask |= ((1 << n) - 1) << state.ngrn;
+                        state.ngrn += n;
+                    } else {
+                        state.ngrn = N_X_ARG_REG;
+                        memcpy(allocate_to_stack(&state, stack, ty->alignment, s), a, s);
+                    }
+                }
+                break;
+            default:
+                abort();
+        }
+        if (i + 1 == cif->aarch64_nfixedargs) {
+            state.ngrn = N_X_ARG_REG;
+            state.nsrn = N_V_ARG_REG;
+            state.allocating_variadic = 1;
+        }
+    }
+    *x_mask_out = x_mask;
+    *v_mask_out = v_mask;
+}
+
+// MARK: main
+
+int main(int argc, char *argv[]) {
+    int rounds = 200;
+    int arg = 1;
+    if (argc > 1 && strcmp(argv[1], "--quick") == 0) {
+        rounds = 5;
+        arg++;
+    }
+    if (argc - arg != 1) {
+        fprintf(stderr, "usage: %s [--quick] SymbolTable.plist\n", argv[0]);
+        return 1;
+    }
+    size_t plist_size;
+    char *plist_text = read_file(argv[arg], &plist_size);
+    struct symbol_plist plist;
+    parse_symbol_plist(&plist, plist_text, plist_size);
+
+    uint64_t start = now_ns();
+    uint32_t fixed_count = 0, skipped = 0;
+    for (int variadic = 0; variadic < 2; variadic++) {
+        for (uint32_t i = 0; i < plist.library_count; i++) {
+            const struct plist_library *library = &plist.libraries[i];
+            for (uint32_t j = 0; j < library->symbol_count; j++) {
+                const char *signature = library->symbols[j].signature;
+                if (signature[0] == '$') {
+                    // shims have no signature to place
+                } else if (strstr(signature, "...")) {
+                    // next_type in cif.c doesn't parse these either
+                    skipped += !variadic;
+                } else {
+                    add_call(signature, variadic);
+                }
+            }
+        }
+        if (!variadic) {
+            fixed_count = call_count;
+        }
+    }
+    double prep_ns = (double)(now_ns() - start) / call_count;
+
+    // both into zeroed registers and stack, which must match
+    uint32_t max_bytes = 0;
+    for (uint32_t i = 0; i < call_count; i++) {
+        max_bytes = calls[i].cif.bytes > max_bytes ? calls[i].cif.bytes : max_bytes;
+    }
+    uint8_t *plan_stack = malloc(max_bytes + 16), *walk_stack = malloc(max_bytes + 16);
+    uint32_t mismatches = 0;
+    for (uint32_t i = 0; i < call_count; i++) {
+        const struct call *call = &calls[i];
+        struct arm64_call_context plan_regs, walk_regs;
+        uint32_t x_mask, v_mask;
+        memset(&plan_regs, 0, sizeof(plan_regs));
+        memset(&walk_regs, 0, sizeof(walk_regs));
+        memset(plan_stack, 0, max_bytes);
+        memset(walk_stack, 0, max_bytes);
+        ffi_arm64_place_arguments(&call->cif, call->args, &plan_regs, plan_stack);
+        walk_arguments(&call->cif, call->args, &walk_regs, walk_stack, &x_mask, &v_mask);
+        // plans also mark x8 live for results returned in memory
+        if (call->cif.flags & AARCH64_RET_IN_MEM) {
+            x_mask |= 1 << 8;
+        }
+        if (memcmp(&plan_regs, &walk_regs, sizeof(plan_regs)) || memcmp(plan_stack, walk_stack, call->cif.bytes) ||
+            x_mask != call->cif.x_mask || v_mask != call->cif.v_mask) {
+            fprintf(stderr, "mismatch for %s%s\n", call->signature, i >= fixed_count ? " (variadic)" : "");
+            mismatches++;
+        }
+    }
+    printf("ffi plans: %u signatures, %u variadic, %u mismatches, %u with ... skipped\n", fixed_count, call_count - fixed_count, mismatches, skipped);
+    printf("  parsing a signature and preparing its cif and plan: %.1f ns\n", prep_ns);
+
+    struct arm64_call_context regs;
+    start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (uint32_t i = 0; i < call_count; i++) {
+            uint32_t x_mask, v_mask;
+            walk_arguments(&calls[i].cif, calls[i].args, &regs, walk_stack, &x_mask, &v_mask);
+        }
+    }
+    double walk_ns = (double)(now_ns() - start) / rounds / call_count;
+    start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (uint32_t i = 0; i < call_count; i++) {
+            ffi_arm64_place_arguments(&calls[i].cif, calls[i].args, &regs, plan_stack);
+        }
+    }
+    double plan_ns = (double)(now_ns() - start) / rounds / call_count;
+    printf("  placing arguments: walker %.1f ns, plan %.1f ns (%.1fx)\n", walk_ns, plan_ns, walk_ns / plan_ns);
+    return mismatches != 0;
+}
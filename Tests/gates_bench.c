@@ -0,0 +1,147 @@
+//
+//  gates_bench.c
+//  aah
+//
+//  Benchmark of a round trip from emulated code to a native function and
+//  back, like run_emulator does it: emulated code branches to the native
+//  function, emulation stops, the function is called and emulation resumes
+//  at the return address. The branch either goes to a native call gate, an
+//  svc that stops emulation from the interrupt hook, or to the native page
+//  itself, mapped without execute permission, where it fails with
+//  UC_ERR_FETCH_PROT after the fetch hook has looked up the address with
+//  dladdr like cb_invalid_fetch.
+//
+//  Needs unicorn 1.x (pkg-config unicorn).
+//
+//  usage: gates_bench [--quick]
+//
+
+#define _GNU_SOURCE
+#include <unicorn/unicorn.h>
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CODE_ADDRESS 0x10000
+#define RETURN_ADDRESS 0xdead0000 // never reached
+#define GATE_INSTRUCTION 0xd4000001 // svc #0
+
+static uint64_t round_trips = 1000000;
+static uint64_t page_size;
+static uint64_t native_calls = 0;
+static uint32_t *gate_page;
+static bool gate_hit;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void check(uc_err err, const char *what) {
+    if (err != UC_ERR_OK) {
+        fprintf(stderr, "%s: %s\n", what, uc_strerror(err));
+        exit(1);
+    }
+}
+
+__attribute__((noinline)) static void native_function(void) {
+    native_calls++;
+    __asm__ volatile("" ::: "memory");
+}
+
+static void cb_interrupt(uc_engine *uc, uint32_t intno, void *user_data) {
+    uint64_t pc;
+    uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
+    // pc is after the svc, like native_gate_at
+    gate_hit = pc - 4 == (uint64_t)gate_page;
+    uc_emu_stop(uc);
+}
+
+static bool cb_invalid_fetch(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
+    Dl_info info;
+    // native code, caught by the caller
+    dladdr((void *)address, &info);
+    return false;
+}
+
+// one engine, with an emulated caller that calls x16 and loops
+static uc_engine * open_engine(void) {
+    uc_engine *uc;
+    check(uc_open(UC_ARCH_ARM64, UC_MODE_ARM, &uc), "uc_open");
+    uint32_t code[] = {
+        0xd63f0200, // blr x16
+        0x17ffffff, // b CODE_ADDRESS
+    };
+    check(uc_mem_map(uc, CODE_ADDRESS, page_size, UC_PROT_READ | UC_PROT_EXEC), "uc_mem_map(code)");
+    check(uc_mem_write(uc, CODE_ADDRESS, code, sizeof(code)), "uc_mem_write(code)");
+    // native pages are mapped at their host addresses
+    uint64_t native_page = (uint64_t)native_function & ~(page_size - 1);
+    check(uc_mem_map_ptr(uc, native_page, page_size, UC_PROT_READ, (void *)native_page), "uc_mem_map_ptr(native)");
+    check(uc_mem_map_ptr(uc, (uint64_t)gate_page, page_size, UC_PROT_READ | UC_PROT_EXEC, gate_page), "uc_mem_map_ptr(gates)");
+    uc_hook hook;
+    check(uc_hook_add(uc, &hook, UC_HOOK_INTR, (void *)cb_interrupt, NULL, 1, 0), "uc_hook_add(interrupt)");
+    check(uc_hook_add(uc, &hook, UC_HOOK_MEM_FETCH_PROT | UC_HOOK_MEM_FETCH_UNMAPPED, (void *)cb_invalid_fetch, NULL, 1, 0), "uc_hook_add(fetch)");
+    uint64_t lr = RETURN_ADDRESS;
+    uc_reg_write(uc, UC_ARM64_REG_LR, &lr);
+    return uc;
+}
+
+// returns ns per round trip
+static double run(uc_engine *uc, bool gate, uint64_t *errors) {
+    uint64_t target = gate ? (uint64_t)gate_page : (uint64_t)native_function;
+    uc_reg_write(uc, UC_ARM64_REG_X16, &target);
+    uint64_t start_address = CODE_ADDRESS, pc, lr;
+    uint64_t calls = native_calls;
+    uint64_t start = now_ns();
+    for (uint64_t n = 0; n < round_trips; n++) {
+        gate_hit = false;
+        uc_err err = uc_emu_start(uc, start_address, RETURN_ADDRESS, 0, 0);
+        uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
+        if (gate ? (err == UC_ERR_OK && gate_hit) : (err == UC_ERR_FETCH_PROT && pc == target)) {
+            native_function();
+        } else {
+            (*errors)++;
+        }
+        // resume after the call
+        uc_reg_read(uc, UC_ARM64_REG_LR, &lr);
+        start_address = lr;
+    }
+    double ns = (double)(now_ns() - start) / round_trips;
+    if (native_calls - calls != round_trips) {
+        fprintf(stderr, "%s: %llu of %llu round trips called the native function\n", gate ? "gate" : "FETCH_PROT", (unsigned long long)(native_calls - calls), (unsigned long long)round_trips);
+    }
+    return ns;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--quick") == 0) {
+        round_trips = 10000;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+    gate_page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    gate_page[0] = GATE_INSTRUCTION;
+    mprotect(gate_page, page_size, PROT_READ);
+
+    uint64_t errors = 0;
+    uc_engine *uc = open_engine();
+    // warm up the translation cache
+    run(uc, true, &errors);
+    run(uc, false, &errors);
+    double gate_ns = run(uc, true, &errors);
+    double fetch_ns = run(uc, false, &errors);
+    uc_close(uc);
+
+    printf("native call round trips: %llu each\n", (unsigned long long)round_trips);
+    printf("  FETCH_PROT %.1f ns, gate %.1f ns (%.1fx)\n", fetch_ns, gate_ns, fetch_ns / gate_ns);
+    if (errors) {
+        fprintf(stderr, "gates: %llu round trips stopped in the wrong place\n", (unsigned long long)errors);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+//
+//  nlist.h
+//  aah
+//
+//  The parts of <mach-o/nlist.h> used by the Mach-O readers in Sources,
+//  for building their tests on Linux. Layouts and values are Apple's.
+//
+
+#ifndef mach_o_nlist_h
+#define mach_o_nlist_h
+
+#include <stdint.h>
+
+struct nlist_64 {
+    union {
+        uint32_t n_strx;
+    } n_un;
+    uint8_t n_type;
+    uint8_t n_sect;
+    uint16_t n_desc;
+    uint64_t n_value;
+};
+
+#define N_STAB 0xe0
+#define N_TYPE 0x0e
+#define N_EXT 0x01
+#define N_UNDF 0x0
+#define N_SECT 0xe
+
+#define NO_SECT 0
+
+#endif /* mach_o_nlist_h */
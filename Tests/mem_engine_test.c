@@ -0,0 +1,132 @@
+//
+//  mem_engine_test.c
+//  aah
+//
+//  Checks that the intervals kept by mem_engine match the engine's own
+//  regions after remapping ranges that overlap several regions and gaps
+//  between them, and after unmapping ranges.
+//
+//  Needs unicorn 1.x (pkg-config unicorn).
+//
+//  usage: mem_engine_test [--quick]
+//
+
+#include "mem_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define PAGE 0x1000
+#define PAGES 64
+
+static uint64_t errors = 0;
+static uint64_t base;
+
+#define EXPECT(condition, ...) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        errors++; \
+    } \
+} while (0)
+
+static uint64_t page_address(int page) {
+    return base + (uint64_t)page * PAGE;
+}
+
+// uc_mem_regions, with adjacent regions of the same perms merged like the intervals
+static void check_regions(const char *what, uc_engine *uc, const struct mem_intervals *intervals) {
+    uc_mem_region *regions;
+    uint32_t count;
+    if (uc_mem_regions(uc, &regions, &count) != UC_ERR_OK) {
+        EXPECT(false, "%s: uc_mem_regions failed", what);
+        return;
+    }
+    // every page is mapped by both or by neither, with the same perms
+    for (int page = 0; page < PAGES; page++) {
+        uint64_t address = page_address(page);
+        const uc_mem_region *region = NULL;
+        for (uint32_t i = 0; i < count; i++) {
+            if (regions[i].begin <= address && address <= regions[i].end) {
+                region = &regions[i];
+            }
+        }
+        const struct mem_interval *item = mem_intervals_find(intervals, address);
+        EXPECT((region == NULL) == (item == NULL), "%s: page %d is %s by the engine, %s in the intervals", what, page, region ? "mapped" : "not mapped", item ? "mapped" : "not mapped");
+        if (region && item) {
+            EXPECT(region->perms == item->perms, "%s: page %d has perms %u, %u in the intervals", what, page, region->perms, item->perms);
+        }
+    }
+    free(regions);
+}
+
+static uc_err map(uc_engine *uc, struct mem_intervals *intervals, int first, int last, uint32_t perms) {
+    return mem_engine_map_ptr(uc, intervals, page_address(first), (uint64_t)(last - first) * PAGE, perms);
+}
+
+static void test_remap(uc_engine *uc) {
+    struct mem_intervals intervals = {0};
+    uc_err err;
+    // r-- rw- gap r-x, and a separate region
+    EXPECT(map(uc, &intervals, 4, 8, UC_PROT_READ) == UC_ERR_OK, "map 4-8");
+    EXPECT(map(uc, &intervals, 8, 12, UC_PROT_READ | UC_PROT_WRITE) == UC_ERR_OK, "map 8-12");
+    EXPECT(map(uc, &intervals, 14, 20, UC_PROT_READ | UC_PROT_EXEC) == UC_ERR_OK, "map 14-20");
+    EXPECT(map(uc, &intervals, 30, 34, UC_PROT_READ) == UC_ERR_OK, "map 30-34");
+    check_regions("map", uc, &intervals);
+
+    // mapping over an existing region fails, and leaves the intervals alone
+    EXPECT(map(uc, &intervals, 6, 10, UC_PROT_READ) != UC_ERR_OK, "map over 4-12 succeeded");
+    check_regions("map over", uc, &intervals);
+
+    // from the middle of the first region to the middle of the third, over the gap
+    bool found = mem_engine_remap(uc, &intervals, page_address(6), 12 * PAGE, UC_PROT_READ, &err);
+    EXPECT(found && err == UC_ERR_OK, "remap 6-18: found %d, %s", found, uc_strerror(err));
+    check_regions("remap 6-18", uc, &intervals);
+    const struct mem_interval *item = mem_intervals_find(&intervals, page_address(12));
+    EXPECT(item && item->begin == page_address(6) && item->end == page_address(18), "remap 6-18: one interval over the gap");
+    EXPECT(item && item->perms == UC_PROT_ALL, "remap 6-18: perms are %u, expected all of them", item ? item->perms : 0);
+    item = mem_intervals_find(&intervals, page_address(4));
+    EXPECT(item && item->end == page_address(6) && item->perms == UC_PROT_READ, "remap 6-18: the head of 4-8 is kept");
+    item = mem_intervals_find(&intervals, page_address(19));
+    EXPECT(item && item->begin == page_address(18) && item->perms == (UC_PROT_READ | UC_PROT_EXEC), "remap 6-18: the tail of 14-20 is kept");
+
+    // a range that overlaps nothing isn't found
+    found = mem_engine_remap(uc, &intervals, page_address(22), 4 * PAGE, UC_PROT_READ, &err);
+    EXPECT(!found, "remap 22-26 found a region");
+    check_regions("remap 22-26", uc, &intervals);
+
+    // a range that covers a region and the gaps around it
+    found = mem_engine_remap(uc, &intervals, page_address(28), 8 * PAGE, UC_PROT_WRITE, &err);
+    EXPECT(found && err == UC_ERR_OK, "remap 28-36: found %d, %s", found, uc_strerror(err));
+    check_regions("remap 28-36", uc, &intervals);
+
+    // unmapping across regions and gaps
+    EXPECT(mem_engine_unmap_range(uc, &intervals, page_address(5), page_address(30)) == UC_ERR_OK, "unmap 5-30");
+    check_regions("unmap 5-30", uc, &intervals);
+    EXPECT(mem_engine_unmap_range(uc, &intervals, page_address(0), page_address(PAGES)) == UC_ERR_OK, "unmap all");
+    EXPECT(intervals.count == 0, "unmap all: %u intervals left", intervals.count);
+    check_regions("unmap all", uc, &intervals);
+    mem_intervals_free(&intervals);
+}
+
+int main(int argc, char *argv[]) {
+    // host memory backs the mappings, like in libaah
+    void *memory = mmap(NULL, PAGES * PAGE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    base = (uint64_t)memory;
+    uc_engine *uc;
+    uc_err err = uc_open(UC_ARCH_ARM64, UC_MODE_ARM, &uc);
+    if (err != UC_ERR_OK) {
+        fprintf(stderr, "uc_open: %s\n", uc_strerror(err));
+        return 1;
+    }
+    test_remap(uc);
+    uc_close(uc);
+    printf("mem_engine: %llu errors\n", (unsigned long long)errors);
+    return errors != 0;
+}
@@ -0,0 +1,213 @@
+//
+//  mem_intervals_test.c
+//  aah
+//
+//  Checks mem_intervals against a model with one permission per page, with
+//  fixed cases for adding, removing and splitting intervals and random
+//  sequences of both, and times lookups among as many intervals as an app
+//  maps.
+//
+//  usage: mem_intervals_test [--quick]
+//
+
+#include "mem_intervals.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PAGE 0x1000
+#define PAGES 256
+#define BASE 0x100000000ULL
+#define UNMAPPED 0xff
+
+static uint64_t errors = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define EXPECT(condition, ...) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        errors++; \
+    } \
+} while (0)
+
+// MARK: model
+
+// perms of each page, UNMAPPED if not in an interval
+static uint8_t model[PAGES];
+
+static uint64_t page_address(int page) {
+    return BASE + (uint64_t)page * PAGE;
+}
+
+static void model_add(int first, int last, uint32_t perms) {
+    memset(&model[first], perms, last - first);
+}
+
+static void model_remove(int first, int last) {
+    memset(&model[first], UNMAPPED, last - first);
+}
+
+static bool model_is_free(int first, int last) {
+    for (int page = first; page < last; page++) {
+        if (model[page] != UNMAPPED) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// intervals are sorted, don't overlap, and cover the same pages as the model
+static void check_model(const char *what, const struct mem_intervals *intervals) {
+    for (uint32_t i = 0; i < intervals->count; i++) {
+        const struct mem_interval *item = &intervals->items[i];
+        EXPECT(item->begin < item->end, "%s: empty interval %u", what, i);
+        EXPECT(i == 0 || intervals->items[i - 1].end <= item->begin, "%s: intervals %u and %u overlap or aren't sorted", what, i - 1, i);
+    }
+    for (int page = 0; page < PAGES; page++) {
+        uint64_t address = page_address(page) + PAGE / 2;
+        const struct mem_interval *item = mem_intervals_find(intervals, address);
+        if (model[page] == UNMAPPED) {
+            EXPECT(item == NULL, "%s: page %d is in [0x%llx, 0x%llx), expected unmapped", what, page, (unsigned long long)(item ? item->begin : 0), (unsigned long long)(item ? item->end : 0));
+        } else {
+            EXPECT(item && item->perms == model[page], "%s: page %d has perms %d, expected %d", what, page, item ? (int)item->perms : -1, model[page]);
+        }
+        // the first interval that ends after the address
+        uint32_t index = mem_intervals_lower_bound(intervals, address);
+        EXPECT(index == intervals->count || intervals->items[index].end > address, "%s: lower bound of page %d ends before it", what, page);
+        EXPECT(index == 0 || intervals->items[index - 1].end <= address, "%s: lower bound of page %d isn't the first", what, page);
+    }
+}
+
+static void add(struct mem_intervals *intervals, int first, int last, uint32_t perms) {
+    mem_intervals_add(intervals, page_address(first), page_address(last), perms);
+    model_add(first, last, perms);
+}
+
+static void remove_pages(struct mem_intervals *intervals, int first, int last) {
+    mem_intervals_remove(intervals, page_address(first), page_address(last));
+    model_remove(first, last);
+}
+
+static void reset(struct mem_intervals *intervals) {
+    mem_intervals_free(intervals);
+    memset(model, UNMAPPED, sizeof(model));
+}
+
+// MARK: cases
+
+static void test_cases(void) {
+    struct mem_intervals intervals = {0};
+    reset(&intervals);
+
+    // out of order, empty ranges are ignored
+    add(&intervals, 20, 30, 3);
+    add(&intervals, 0, 10, 1);
+    add(&intervals, 40, 50, 5);
+    add(&intervals, 10, 20, 7);
+    mem_intervals_add(&intervals, page_address(60), page_address(60), 1);
+    EXPECT(intervals.count == 4, "add: %u intervals, expected 4", intervals.count);
+    check_model("add", &intervals);
+    EXPECT(mem_intervals_lower_bound(&intervals, 0) == 0, "lower bound before all intervals");
+    EXPECT(mem_intervals_lower_bound(&intervals, page_address(35)) == 3, "lower bound in a gap");
+    EXPECT(mem_intervals_lower_bound(&intervals, page_address(50)) == 4, "lower bound at the end of the last interval");
+    EXPECT(mem_intervals_find(&intervals, page_address(30)) == NULL, "find at the exclusive end of an interval");
+
+    // split in two
+    remove_pages(&intervals, 23, 26);
+    EXPECT(intervals.count == 5, "split: %u intervals, expected 5", intervals.count);
+    check_model("split", &intervals);
+
+    // trims the head and tail of intervals, and removes whole ones in between
+    remove_pages(&intervals, 5, 24);
+    check_model("remove across intervals", &intervals);
+    remove_pages(&intervals, 28, 45);
+    check_model("remove across a gap", &intervals);
+
+    // removing nothing
+    remove_pages(&intervals, 100, 120);
+    check_model("remove unmapped", &intervals);
+
+    // removing everything
+    remove_pages(&intervals, 0, PAGES);
+    EXPECT(intervals.count == 0, "remove all: %u intervals left", intervals.count);
+    check_model("remove all", &intervals);
+
+    // growing past the initial capacity
+    for (int page = 0; page < PAGES; page += 2) {
+        add(&intervals, page, page + 1, page % 8);
+    }
+    check_model("grow", &intervals);
+    mem_intervals_free(&intervals);
+}
+
+static uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t next_random(uint32_t n) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t)(state % n);
+}
+
+// random adds of free ranges, the precondition of mem_intervals_add, and random removes
+static void test_random(int rounds) {
+    struct mem_intervals intervals = {0};
+    reset(&intervals);
+    for (int round = 0; round < rounds; round++) {
+        int first = next_random(PAGES);
+        int last = first + 1 + next_random(PAGES - first < 32 ? PAGES - first : 32);
+        if (next_random(3) && model_is_free(first, last)) {
+            add(&intervals, first, last, next_random(8));
+        } else {
+            remove_pages(&intervals, first, last);
+        }
+        check_model("random", &intervals);
+        if (errors) {
+            fprintf(stderr, "random: failed in round %d\n", round);
+            break;
+        }
+    }
+    mem_intervals_free(&intervals);
+}
+
+// MARK: lookups
+
+static void bench_find(int count, uint64_t lookups) {
+    struct mem_intervals intervals = {0};
+    for (int i = 0; i < count; i++) {
+        mem_intervals_add(&intervals, BASE + (uint64_t)i * 4 * PAGE, BASE + (uint64_t)i * 4 * PAGE + 3 * PAGE, 3);
+    }
+    // a quarter of them are in gaps
+    uint64_t addresses[4096];
+    for (int i = 0; i < 4096; i++) {
+        addresses[i] = BASE + (uint64_t)next_random(count * 4) * PAGE;
+    }
+    uint64_t found = 0;
+    uint64_t start = now_ns();
+    for (uint64_t n = 0; n < lookups; n++) {
+        found += mem_intervals_find(&intervals, addresses[n % 4096]) != NULL;
+    }
+    double ns = (double)(now_ns() - start) / lookups;
+    printf("  %5d intervals: find %.1f ns, %llu found\n", count, ns, (unsigned long long)found);
+    mem_intervals_free(&intervals);
+}
+
+int main(int argc, char *argv[]) {
+    bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+    test_cases();
+    test_random(quick ? 2000 : 50000);
+    printf("mem_intervals: %llu errors\n", (unsigned long long)errors);
+    uint64_t lookups = quick ? 100000 : 10000000;
+    bench_find(64, lookups);
+    bench_find(1024, lookups);
+    bench_find(8192, lookups);
+    return errors != 0;
+}
@@ -0,0 +1,205 @@
+//
+//  perf_map_test.c
+//  aah
+//
+//  Checks the perf map written for a synthetic Mach-O image built in
+//  memory, as if dyld had loaded it: functions come from code sections of
+//  its symbol table with aliases, data, undefined and debug symbols left
+//  out, names of stripped functions fill the gaps, and code caches are
+//  labelled as a whole. Uses the Mach-O headers in Tests/include.
+//
+//  usage: perf_map_test [--quick]
+//
+
+#include "perf_map_writer.h"
+#include <mach-o/nlist.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VMADDR 0x100000000ULL
+#define TEXT_SIZE 0x4000
+#define LINKEDIT_SIZE 0x1000
+#define IMAGE_SIZE (TEXT_SIZE + LINKEDIT_SIZE)
+#define CODE_CACHE 0x7f0000000000ULL
+
+static uint64_t errors = 0;
+
+#define EXPECT(condition, ...) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        errors++; \
+    } \
+} while (0)
+
+struct test_symbol {
+    const char *name;
+    uint8_t type;
+    uint64_t offset; // from VMADDR
+};
+
+// not sorted, like a real symbol table
+static const struct test_symbol test_symbols[] = {
+    {"_helper", N_SECT | N_EXT, 0x1080},
+    {"_main", N_SECT | N_EXT, 0x1000},
+    {"_table", N_SECT, 0x1200}, // __const
+    {"_last", N_SECT, 0x1180},
+    {"__ZN3Foo3barEv", N_SECT | N_EXT, 0x1100},
+    {"_helper_alias", N_SECT | N_EXT, 0x1080},
+    {"_printf", N_UNDF | N_EXT, 0},
+    {"_main", 0x24, 0x1000}, // N_FUN debug symbol
+};
+#define TEST_SYMBOL_COUNT (sizeof(test_symbols) / sizeof(test_symbols[0]))
+
+static struct section_64 test_section(const char *name, uint64_t offset, uint64_t size, uint32_t flags) {
+    struct section_64 section = {.addr = VMADDR + offset, .size = size, .offset = (uint32_t)offset, .flags = flags};
+    // not NUL-terminated when they fill the field
+    memcpy(section.sectname, name, strlen(name));
+    memcpy(section.segname, SEG_TEXT, strlen(SEG_TEXT));
+    return section;
+}
+
+// laid out like a loaded image, with file offsets equal to vm offsets
+static uint8_t * build_image(int with_symtab) {
+    uint8_t *image = aligned_alloc(0x1000, IMAGE_SIZE);
+    memset(image, 0, IMAGE_SIZE);
+    struct mach_header_64 *mh = (struct mach_header_64 *)image;
+    *mh = (struct mach_header_64){.magic = MH_MAGIC_64, .filetype = MH_DYLIB};
+    uint8_t *lc = (uint8_t *)(mh + 1);
+
+    struct segment_command_64 *text = (struct segment_command_64 *)lc;
+    *text = (struct segment_command_64){
+        .cmd = LC_SEGMENT_64, .cmdsize = sizeof(*text) + 3 * sizeof(struct section_64),
+        .vmaddr = VMADDR, .vmsize = TEXT_SIZE, .filesize = TEXT_SIZE,
+        .maxprot = VM_PROT_READ | VM_PROT_EXECUTE, .initprot = VM_PROT_READ | VM_PROT_EXECUTE, .nsects = 3
+    };
+    memcpy(text->segname, SEG_TEXT, strlen(SEG_TEXT));
+    struct section_64 *sections = (struct section_64 *)(text + 1);
+    sections[0] = test_section(SECT_TEXT, 0x1000, 0x200, S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS);
+    sections[1] = test_section("__const", 0x1200, 0x100, 0);
+    sections[2] = test_section("__stubs", 0x1300, 0x40, S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS);
+    lc += text->cmdsize;
+    mh->ncmds++;
+
+    struct segment_command_64 *linkedit = (struct segment_command_64 *)lc;
+    *linkedit = (struct segment_command_64){
+        .cmd = LC_SEGMENT_64, .cmdsize = sizeof(*linkedit),
+        .vmaddr = VMADDR + TEXT_SIZE, .vmsize = LINKEDIT_SIZE, .fileoff = TEXT_SIZE, .filesize = LINKEDIT_SIZE,
+        .maxprot = VM_PROT_READ, .initprot = VM_PROT_READ
+    };
+    memcpy(linkedit->segname, SEG_LINKEDIT, strlen(SEG_LINKEDIT));
+    lc += linkedit->cmdsize;
+    mh->ncmds++;
+
+    if (with_symtab) {
+        struct symtab_command *symtab = (struct symtab_command *)lc;
+        struct nlist_64 *nl = (struct nlist_64 *)(image + TEXT_SIZE);
+        uint32_t stroff = TEXT_SIZE + TEST_SYMBOL_COUNT * sizeof(struct nlist_64);
+        // offset 0 is the empty string
+        uint32_t strsize = 1;
+        for (uint32_t i = 0; i < TEST_SYMBOL_COUNT; i++) {
+            nl[i] = (struct nlist_64){
+                .n_un.n_strx = strsize,
+                .n_type = test_symbols[i].type,
+                .n_sect = (test_symbols[i].type & N_TYPE) == N_SECT ? 1 : NO_SECT,
+                .n_value = test_symbols[i].offset ? VMADDR + test_symbols[i].offset : 0
+            };
+            strcpy((char *)image + stroff + strsize, test_symbols[i].name);
+            strsize += strlen(test_symbols[i].name) + 1;
+        }
+        *symtab = (struct symtab_command){
+            .cmd = LC_SYMTAB, .cmdsize = sizeof(*symtab),
+            .symoff = TEXT_SIZE, .nsyms = TEST_SYMBOL_COUNT, .stroff = stroff, .strsize = strsize
+        };
+        lc += symtab->cmdsize;
+        mh->ncmds++;
+    }
+    mh->sizeofcmds = (uint32_t)(lc - (uint8_t *)(mh + 1));
+    return image;
+}
+
+// compares the lines written since the last call with the expected ones
+static void expect_lines(FILE *file, long *position, const char *const *expected, int count) {
+    char line[256];
+    fseek(file, *position, SEEK_SET);
+    for (int i = 0; i < count; i++) {
+        if (fgets(line, sizeof(line), file) == NULL) {
+            EXPECT(0, "missing line: %s", expected[i]);
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        EXPECT(strcmp(line, expected[i]) == 0, "got \"%s\", expected \"%s\"", line, expected[i]);
+    }
+    if (fgets(line, sizeof(line), file)) {
+        EXPECT(0, "unexpected line: %s", line);
+    }
+    *position = ftell(file);
+    // the writer appends
+    fseek(file, 0, SEEK_END);
+}
+
+static char * entry(uint64_t address, uint64_t size, const char *name) {
+    char *line = malloc(256);
+    snprintf(line, 256, "%llx %llx %s", (unsigned long long)address, (unsigned long long)size, name);
+    return line;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *file = tmpfile();
+    if (file == NULL) {
+        perror("tmpfile");
+        return 1;
+    }
+    static struct perf_map_writer writer;
+    perf_map_writer_init(&writer, file);
+    long position = 0;
+
+    uint8_t *image = build_image(1);
+    uint64_t base = (uint64_t)image;
+    int64_t slide = (int64_t)(base - VMADDR);
+    int written = perf_map_writer_add_image(&writer, (const struct mach_header_64 *)image, slide);
+    EXPECT(written == 4, "wrote %d functions, expected 4", written);
+    // sized up to the next function or the end of __text, leading underscores removed
+    const char *functions[] = {
+        entry(base + 0x1000, 0x80, "main"),
+        entry(base + 0x1080, 0x80, "helper"),
+        entry(base + 0x1100, 0x80, "_ZN3Foo3barEv"),
+        entry(base + 0x1180, 0x80, "last"),
+    };
+    expect_lines(file, &position, functions, 4);
+
+    EXPECT(perf_map_writer_add_name(&writer, base + 0x1040, "-[Foo baz]"), "stripped function not named");
+    EXPECT(!perf_map_writer_add_name(&writer, base + 0x1080, "-[Foo helper]"), "named a function twice");
+    EXPECT(!perf_map_writer_add_name(&writer, base + TEXT_SIZE, "outside"), "named a function outside __TEXT");
+    EXPECT(perf_map_writer_add_name(&writer, base + 0x1020, "-[Foo qux]"), "stripped function not named");
+    const char *names[] = {
+        entry(base + 0x1040, 0x40, "-[Foo baz]"),
+        entry(base + 0x1020, 0x20, "-[Foo qux]"),
+    };
+    expect_lines(file, &position, names, 2);
+
+    // without a symbol table, names cover up to the next one or the end of __TEXT
+    uint8_t *stripped = build_image(0);
+    uint64_t stripped_base = (uint64_t)stripped;
+    written = perf_map_writer_add_image(&writer, (const struct mach_header_64 *)stripped, (int64_t)(stripped_base - VMADDR));
+    EXPECT(written == 0, "wrote %d functions of a stripped image", written);
+    EXPECT(perf_map_writer_add_name(&writer, stripped_base + 0x1100, "-[Stripped second]"), "stripped function not named");
+    EXPECT(perf_map_writer_add_name(&writer, stripped_base + 0x1000, "-[Stripped first]"), "stripped function not named");
+    const char *stripped_names[] = {
+        entry(stripped_base + 0x1100, TEXT_SIZE - 0x1100, "-[Stripped second]"),
+        entry(stripped_base + 0x1000, 0x100, "-[Stripped first]"),
+    };
+    expect_lines(file, &position, stripped_names, 2);
+
+    perf_map_writer_add_region(&writer, CODE_CACHE, 0x8000000, "[unicorn code cache]");
+    const char *regions[] = {entry(CODE_CACHE, 0x8000000, "[unicorn code cache]")};
+    expect_lines(file, &position, regions, 1);
+
+    printf("perf map: %ld bytes, %llu errors\n", position, (unsigned long long)errors);
+    fclose(file);
+    free(image);
+    free(stripped);
+    return errors != 0;
+}
@@ -0,0 +1,179 @@
+//
+//  registers_bench.c
+//  aah
+//
+//  Benchmark of the register transfers at each transition between emulated
+//  and native code, batched by registers.c, against one uc_reg_read or
+//  uc_reg_write per register as before. Each case moves the same registers
+//  both ways and checks that they match.
+//
+//  Needs unicorn 1.x (pkg-config unicorn).
+//
+//  usage: registers_bench [--quick]
+//
+
+#include "registers.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t iterations = 2000000;
+static uint64_t errors = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_context(struct arm64_call_context *context, uint64_t *sp, uint64_t salt) {
+    for (int i = 0; i <= N_X_ARG_REG; i++) {
+        context->x[i] = salt * 0x100 + i;
+    }
+    for (int i = 0; i < N_V_ARG_REG; i++) {
+        context->v[i].d[0].d = salt * 0x10000 + i;
+        context->v[i].d[1].d = ~(salt * 0x10000 + i);
+    }
+    *sp = 0x7f0000000000ULL - salt * 0x10;
+}
+
+static void compare_contexts(const char *what, const struct arm64_call_context *a, const struct arm64_call_context *b, uint32_t x_mask, uint32_t v_mask, uint64_t sp_a, uint64_t sp_b) {
+    for (int i = 0; i <= N_X_ARG_REG; i++) {
+        if ((x_mask & (1 << i)) && a->x[i] != b->x[i]) {
+            fprintf(stderr, "%s: x%d is 0x%llx, expected 0x%llx\n", what, i, (unsigned long long)b->x[i], (unsigned long long)a->x[i]);
+            errors++;
+        }
+    }
+    for (int i = 0; i < N_V_ARG_REG; i++) {
+        if ((v_mask & (1 << i)) && memcmp(&a->v[i], &b->v[i], sizeof(struct _v))) {
+            fprintf(stderr, "%s: v%d differs\n", what, i);
+            errors++;
+        }
+    }
+    if (sp_a != sp_b) {
+        fprintf(stderr, "%s: sp is 0x%llx, expected 0x%llx\n", what, (unsigned long long)sp_b, (unsigned long long)sp_a);
+        errors++;
+    }
+}
+
+// MARK: one call per register
+
+static void single_read_arguments(uc_engine *uc, struct arm64_call_context *context, uint32_t x_mask, uint32_t v_mask, uint64_t *sp) {
+    for (int i = 0; i <= N_X_ARG_REG; i++) {
+        if (x_mask & (1 << i)) {
+            uc_reg_read(uc, UC_ARM64_REG_X0 + i, &context->x[i]);
+        }
+    }
+    for (int i = 0; i < N_V_ARG_REG; i++) {
+        if (v_mask & (1 << i)) {
+            uc_reg_read(uc, UC_ARM64_REG_V0 + i, &context->v[i]);
+        }
+    }
+    if (sp) {
+        uc_reg_read(uc, UC_ARM64_REG_SP, sp);
+    }
+}
+
+static void single_write_arguments(uc_engine *uc, const struct arm64_call_context *context, uint32_t x_mask, uint32_t v_mask, const uint64_t *sp) {
+    for (int i = 0; i <= N_X_ARG_REG; i++) {
+        if (x_mask & (1 << i)) {
+            uc_reg_write(uc, UC_ARM64_REG_X0 + i, &context->x[i]);
+        }
+    }
+    for (int i = 0; i < N_V_ARG_REG; i++) {
+        if (v_mask & (1 << i)) {
+            uc_reg_write(uc, UC_ARM64_REG_V0 + i, &context->v[i]);
+        }
+    }
+    if (sp) {
+        uc_reg_write(uc, UC_ARM64_REG_SP, sp);
+    }
+}
+
+// MARK: transitions
+
+struct transition {
+    const char *name;
+    // calls from emulated code read the arguments, calls into it write them
+    bool reads;
+    uint32_t x_mask, v_mask;
+    bool sp;
+};
+
+static const struct transition transitions[] = {
+    // call_native reads every argument register, the cif isn't known yet
+    {"call_native, all arguments", true, REG_ALL_X_ARGUMENTS, REG_ALL_V_ARGUMENTS, true},
+    // call_emulated_function writes the live ones
+    {"call_emulated_function, 3 integers", false, 0x7, 0, true},
+    {"call_emulated_function, 2 integers, 2 floats", false, 0x3, 0x3, true},
+    // return values
+    {"return x0", false, 0x1, 0, false},
+    {"return a 4 double HFA", false, 0, 0xf, false},
+};
+
+static void check_transition(uc_engine *uc, const struct transition *t) {
+    struct arm64_call_context written, read;
+    uint64_t written_sp, read_sp;
+    memset(&read, 0, sizeof(read));
+    fill_context(&written, &written_sp, 1);
+    read_sp = written_sp;
+    // batched writes, single reads
+    reg_write_arguments(uc, &written, t->x_mask, t->v_mask, t->sp ? &written_sp : NULL);
+    single_read_arguments(uc, &read, t->x_mask, t->v_mask, t->sp ? &read_sp : NULL);
+    compare_contexts(t->name, &written, &read, t->x_mask, t->v_mask, written_sp, read_sp);
+    // single writes, batched reads
+    fill_context(&written, &written_sp, 2);
+    read_sp = written_sp;
+    single_write_arguments(uc, &written, t->x_mask, t->v_mask, t->sp ? &written_sp : NULL);
+    reg_read_arguments(uc, &read, t->x_mask, t->v_mask, t->sp ? &read_sp : NULL);
+    compare_contexts(t->name, &written, &read, t->x_mask, t->v_mask, written_sp, read_sp);
+}
+
+static double time_transition(uc_engine *uc, const struct transition *t, bool batched) {
+    struct arm64_call_context context;
+    uint64_t sp_value, *sp = t->sp ? &sp_value : NULL;
+    fill_context(&context, &sp_value, 3);
+    uint64_t start = now_ns();
+    for (uint64_t n = 0; n < iterations; n++) {
+        if (t->reads && batched) {
+            reg_read_arguments(uc, &context, t->x_mask, t->v_mask, sp);
+        } else if (t->reads) {
+            single_read_arguments(uc, &context, t->x_mask, t->v_mask, sp);
+        } else if (batched) {
+            reg_write_arguments(uc, &context, t->x_mask, t->v_mask, sp);
+        } else {
+            single_write_arguments(uc, &context, t->x_mask, t->v_mask, sp);
+        }
+    }
+    return (double)(now_ns() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--quick") == 0) {
+        iterations = 20000;
+    }
+    uc_engine *uc;
+    uc_err err = uc_open(UC_ARCH_ARM64, UC_MODE_ARM, &uc);
+    if (err != UC_ERR_OK) {
+        fprintf(stderr, "uc_open: %s\n", uc_strerror(err));
+        return 1;
+    }
+
+    printf("registers: ns per transition\n");
+    for (size_t i = 0; i < sizeof(transitions) / sizeof(transitions[0]); i++) {
+        const struct transition *t = &transitions[i];
+        check_transition(uc, t);
+        double single = time_transition(uc, t, false);
+        double batched = time_transition(uc, t, true);
+        printf("  %-46s %2d registers: single %6.1f ns, batched %6.1f ns (%.1fx)\n", t->name, __builtin_popcount(t->x_mask) + __builtin_popcount(t->v_mask) + t->sp, single, batched, single / batched);
+    }
+    uc_close(uc);
+
+    if (errors) {
+        fprintf(stderr, "registers: %llu wrong values\n", (unsigned long long)errors);
+        return 1;
+    }
+    return 0;
+}
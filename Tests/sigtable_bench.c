@@ -0,0 +1,255 @@
+//
+//  sigtable_bench.c
+//  aah
+//
+//  Checks the compiled symbol table against SymbolTable.plist and compares
+//  it with the dictionaries it replaced. The baseline parses the plist at
+//  startup into string-keyed hash tables, and each lookup copies the
+//  library and symbol names like the CFStrings that lookup_method_signature
+//  used to make, retries with the basename, and follows library redirects.
+//
+//  Startup is timed without parsing, which happens at build time for the
+//  compiled table, and was done by CFPropertyList from a binary plist.
+//
+//  usage: sigtable_bench [--quick] SymbolTable.plist SymbolTable.bin
+//
+
+#define _GNU_SOURCE
+#include "sigtable.h"
+#include "../SymbolTable/symbol_plist.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// MARK: baseline
+
+// open addressing string -> pointer map, like a CFDictionary of CFStrings
+struct dictionary {
+    uint32_t mask, count;
+    const char **keys;
+    const void **values;
+};
+
+static uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h = (h ^ (uint8_t)*s) * 16777619u;
+    }
+    return h;
+}
+
+static struct dictionary * dictionary_create(uint32_t capacity) {
+    struct dictionary *dict = calloc(1, sizeof(struct dictionary));
+    uint32_t size = 16;
+    while (size < 2 * capacity) {
+        size <<= 1;
+    }
+    dict->mask = size - 1;
+    dict->keys = calloc(size, sizeof(char *));
+    dict->values = calloc(size, sizeof(void *));
+    return dict;
+}
+
+static void dictionary_set(struct dictionary *dict, const char *key, const void *value) {
+    for (uint32_t i = hash_string(key);; i++) {
+        uint32_t slot = i & dict->mask;
+        if (dict->keys[slot] == NULL || strcmp(dict->keys[slot], key) == 0) {
+            dict->keys[slot] = key;
+            dict->values[slot] = value;
+            return;
+        }
+    }
+}
+
+static const void * dictionary_get(const struct dictionary *dict, const char *key) {
+    for (uint32_t i = hash_string(key);; i++) {
+        uint32_t slot = i & dict->mask;
+        if (dict->keys[slot] == NULL) {
+            return NULL;
+        } else if (strcmp(dict->keys[slot], key) == 0) {
+            return dict->values[slot];
+        }
+    }
+}
+
+// a library's value is its symbols, or the name of another library
+struct dictionary_library {
+    const char *alias;
+    struct dictionary *symbols;
+};
+
+static struct dictionary * dictionaries_create(const struct symbol_plist *plist) {
+    struct dictionary *libraries = dictionary_create(plist->library_count);
+    for (uint32_t i = 0; i < plist->library_count; i++) {
+        const struct plist_library *library = &plist->libraries[i];
+        struct dictionary_library *value = calloc(1, sizeof(struct dictionary_library));
+        value->alias = library->alias;
+        if (library->alias == NULL) {
+            value->symbols = dictionary_create(library->symbol_count);
+            for (uint32_t j = 0; j < library->symbol_count; j++) {
+                dictionary_set(value->symbols, library->symbols[j].name, library->symbols[j].signature);
+            }
+        }
+        dictionary_set(libraries, library->name, value);
+    }
+    return libraries;
+}
+
+// the old lookup_method_signature
+static const char * dictionaries_lookup(const struct dictionary *libraries, const char *lib_name, const char *sym_name) {
+    char *key = strdup(lib_name);
+    const struct dictionary_library *library = dictionary_get(libraries, key);
+    free(key);
+    if (library == NULL && strrchr(lib_name, '/')) {
+        key = strdup(strrchr(lib_name, '/') + 1);
+        library = dictionary_get(libraries, key);
+        free(key);
+    }
+    if (library == NULL) {
+        return NULL;
+    }
+    if (library->alias) {
+        library = dictionary_get(libraries, library->alias);
+    }
+    key = strdup(sym_name);
+    const char *signature = dictionary_get(library->symbols, key);
+    free(key);
+    return signature;
+}
+
+// MARK: compiled table
+
+// the current lookup_method_signature
+static const char * sigtable_lookup_method(const struct sigtable *table, const char *lib_name, const char *sym_name) {
+    const struct sigtable_library *library = sigtable_find_library(table, lib_name);
+    if (library == NULL && strrchr(lib_name, '/')) {
+        library = sigtable_find_library(table, strrchr(lib_name, '/') + 1);
+    }
+    if (library == NULL) {
+        return NULL;
+    }
+    return sigtable_lookup(table, library, sym_name);
+}
+
+// MARK: queries
+
+struct query {
+    const char *library;
+    const char *symbol;
+    const char *expected; // NULL for misses
+};
+
+static struct query *queries = NULL;
+static uint32_t query_count = 0;
+
+static void add_query(const char *library, const char *symbol, const char *expected) {
+    queries = xrealloc(queries, (query_count + 1) * sizeof(struct query));
+    queries[query_count++] = (struct query){library, symbol, expected};
+}
+
+// every symbol of every library, through aliases and by path, and misses
+static void make_queries(const struct symbol_plist *plist) {
+    for (uint32_t i = 0; i < plist->library_count; i++) {
+        const struct plist_library *library = &plist->libraries[i];
+        const struct plist_library *target = resolve_plist_alias(plist, (struct plist_library *)library);
+        char *path = NULL;
+        if (strchr(library->name, '/') == NULL) {
+            // found by basename
+            asprintf(&path, "/System/Library/Frameworks/%s", library->name);
+        }
+        for (uint32_t j = 0; j < target->symbol_count; j++) {
+            add_query(library->name, target->symbols[j].name, target->symbols[j].signature);
+            if (path && j % 4 == 0) {
+                add_query(path, target->symbols[j].name, target->symbols[j].signature);
+            }
+            if (j % 8 == 0) {
+                char *missing;
+                asprintf(&missing, "%s_missing", target->symbols[j].name);
+                add_query(library->name, missing, NULL);
+            }
+        }
+    }
+    add_query("/usr/lib/libmissing.dylib", "missing", NULL);
+    // shuffled, so consecutive lookups don't hit the same cache lines
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (uint32_t i = query_count - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint32_t j = state % (i + 1);
+        struct query tmp = queries[i];
+        queries[i] = queries[j];
+        queries[j] = tmp;
+    }
+}
+
+static bool same_signature(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = 200;
+    int arg = 1;
+    if (argc > 1 && strcmp(argv[1], "--quick") == 0) {
+        rounds = 5;
+        arg++;
+    }
+    if (argc - arg != 2) {
+        fprintf(stderr, "usage: %s [--quick] SymbolTable.plist SymbolTable.bin\n", argv[0]);
+        return 1;
+    }
+    size_t plist_size, table_size;
+    char *plist_text = read_file(argv[arg], &plist_size);
+    void *table_bytes = read_file(argv[arg + 1], &table_size);
+
+    struct symbol_plist plist;
+    parse_symbol_plist(&plist, plist_text, plist_size);
+    uint64_t start = now_ns();
+    struct dictionary *libraries = dictionaries_create(&plist);
+    uint64_t dictionaries_ns = now_ns() - start;
+    start = now_ns();
+    const struct sigtable *table = sigtable_open(table_bytes, table_size);
+    uint64_t open_ns = now_ns() - start;
+    if (table == NULL) {
+        fail("%s is not a valid table", argv[arg + 1]);
+    }
+
+    make_queries(&plist);
+    uint32_t mismatches = 0;
+    for (uint32_t i = 0; i < query_count; i++) {
+        const char *compiled = sigtable_lookup_method(table, queries[i].library, queries[i].symbol);
+        const char *old = dictionaries_lookup(libraries, queries[i].library, queries[i].symbol);
+        if (!same_signature(compiled, queries[i].expected) || !same_signature(old, queries[i].expected)) {
+            fprintf(stderr, "mismatch for %s in %s: %s, expected %s\n", queries[i].symbol, queries[i].library, compiled ? compiled : "(none)", queries[i].expected ? queries[i].expected : "(none)");
+            mismatches++;
+        }
+    }
+    printf("sigtable: %u libraries, %u queries, %u mismatches\n", plist.library_count, query_count, mismatches);
+    printf("  startup: building dictionaries %.3f ms, opening and checking compiled table %.3f ms\n", dictionaries_ns / 1e6, open_ns / 1e6);
+
+    uint64_t found = 0;
+    start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (uint32_t i = 0; i < query_count; i++) {
+            found += dictionaries_lookup(libraries, queries[i].library, queries[i].symbol) != NULL;
+        }
+    }
+    double dictionaries_lookup_ns = (double)(now_ns() - start) / rounds / query_count;
+    start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (uint32_t i = 0; i < query_count; i++) {
+            found += sigtable_lookup_method(table, queries[i].library, queries[i].symbol) != NULL;
+        }
+    }
+    double compiled_lookup_ns = (double)(now_ns() - start) / rounds / query_count;
+    printf("  lookups: dictionaries %.1f ns, compiled table %.1f ns (%.1fx), %llu found\n", dictionaries_lookup_ns, compiled_lookup_ns, dictionaries_lookup_ns / compiled_lookup_ns, (unsigned long long)found);
+    return mismatches != 0;
+}
@@ -0,0 +1,200 @@
+//
+//  print_coverage.c
+//  aah
+//
+//  Prints a coverage file written with COVERAGE_FILE (see Sources/coverage.h):
+//  for each image, the hottest functions and blocks, and how many of its
+//  functions were run, using the symbol table of the image files.
+//
+//  usage: print_coverage [-n count] coverage.bin
+//  build: cc Tools/print_coverage.c -o print_coverage
+//
+//  Images must be the same files that were run, thin 64-bit Mach-O.
+//  Functions are the defined symbols in the text segment.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "../Sources/coverage.h"
+#define TOOL_NAME "print_coverage"
+#include "tools.h"
+
+// MARK: symbols
+
+struct function {
+    uint64_t offset; // from the start of the text segment
+    const char *name;
+    uint64_t count; // block entries
+    uint32_t blocks; // distinct blocks entered
+};
+
+static int compare_offsets(const void *a, const void *b) {
+    const struct function *fa = a, *fb = b;
+    return fa->offset < fb->offset ? -1 : fa->offset > fb->offset;
+}
+
+static int compare_counts(const void *a, const void *b) {
+    const struct function *fa = a, *fb = b;
+    return fa->count < fb->count ? 1 : fa->count > fb->count ? -1 : 0;
+}
+
+// functions in the text segment sorted by offset, NULL if the file can't be read
+static struct function * load_functions(const char *path, uint64_t text_size, uint32_t *count) {
+    size_t file_size;
+    uint8_t *file = read_file(path, &file_size);
+    *count = 0;
+    if (file == NULL) {
+        fprintf(stderr, "print_coverage: couldn't read %s, functions won't be named\n", path);
+        return NULL;
+    }
+    const struct mach_header_64 *mh = (const struct mach_header_64 *)file;
+    if (file_size < sizeof(*mh) || mh->magic != MH_MAGIC_64) {
+        fprintf(stderr, "print_coverage: %s is not a thin 64-bit Mach-O\n", path);
+        return NULL;
+    }
+    const struct segment_command_64 *text = macho_segment(mh, SEG_TEXT);
+    uint64_t text_vmaddr = text ? text->vmaddr : 0;
+    uint32_t symbol_count;
+    struct macho_symbol *symbols = macho_defined_symbols(mh, file, 0, &symbol_count);
+    if (symbols == NULL) {
+        return NULL;
+    }
+
+    struct function *functions = xrealloc(NULL, symbol_count * sizeof(struct function));
+    for (uint32_t i = 0; i < symbol_count; i++) {
+        uint64_t offset = symbols[i].address - text_vmaddr;
+        if (symbols[i].address < text_vmaddr || offset >= text_size) {
+            continue;
+        }
+        functions[*count] = (struct function){.offset = offset, .name = symbols[i].name};
+        (*count)++;
+    }
+    free(symbols);
+    qsort(functions, *count, sizeof(struct function), compare_offsets);
+    return functions;
+}
+
+// last function at or before offset
+static struct function * function_at(struct function *functions, uint32_t count, uint64_t offset) {
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (functions[mid].offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? &functions[lo - 1] : NULL;
+}
+
+// MARK: printing
+
+struct block {
+    uint64_t offset;
+    uint32_t count;
+};
+
+static int compare_blocks(const void *a, const void *b) {
+    const struct block *ba = a, *bb = b;
+    return ba->count < bb->count ? 1 : ba->count > bb->count ? -1 : 0;
+}
+
+static void print_image(const struct coverage_image_header *header, const char *path, const uint32_t *counters, uint32_t top) {
+    uint32_t function_count;
+    struct function *functions = load_functions(path, header->text_size, &function_count);
+    struct block *blocks = NULL;
+    uint32_t block_count = 0;
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < header->text_size / 4; i++) {
+        if (counters[i] == 0) {
+            continue;
+        }
+        blocks = xrealloc(blocks, (block_count + 1) * sizeof(struct block));
+        blocks[block_count++] = (struct block){.offset = i * 4, .count = counters[i]};
+        total += counters[i];
+        struct function *function = function_at(functions, function_count, i * 4);
+        if (function) {
+            function->count += counters[i];
+            function->blocks++;
+        }
+    }
+
+    uint32_t functions_run = 0;
+    for (uint32_t i = 0; i < function_count; i++) {
+        functions_run += functions[i].count != 0;
+    }
+    printf("%s at 0x%llx%s\n", path, (unsigned long long)header->header, header->flags & COVERAGE_IMAGE_UNLOADED ? " (unloaded)" : "");
+    printf("  %u blocks entered %llu times, %u of %u functions run\n", block_count, (unsigned long long)total, functions_run, function_count);
+
+    // blocks are printed with their function before sorting functions
+    qsort(blocks, block_count, sizeof(struct block), compare_blocks);
+    printf("  hottest blocks:\n");
+    for (uint32_t i = 0; i < block_count && i < top; i++) {
+        const struct function *function = function_at(functions, function_count, blocks[i].offset);
+        printf("    %12u  text+0x%llx", blocks[i].count, (unsigned long long)blocks[i].offset);
+        if (function) {
+            printf("  %s+%llu", function->name, (unsigned long long)(blocks[i].offset - function->offset));
+        }
+        printf("\n");
+    }
+
+    qsort(functions, function_count, sizeof(struct function), compare_counts);
+    printf("  hottest functions:\n");
+    for (uint32_t i = 0; i < function_count && i < top && functions[i].count; i++) {
+        printf("    %12llu  %5u blocks  %s\n", (unsigned long long)functions[i].count, functions[i].blocks, functions[i].name);
+    }
+    free(blocks);
+    free(functions);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t top = 20;
+    int ch;
+    while ((ch = getopt(argc, argv, "n:")) != -1) {
+        if (ch == 'n') {
+            top = (uint32_t)strtoul(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n count] coverage.bin\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n count] coverage.bin\n", argv[0]);
+        return 1;
+    }
+    const char *input = argv[optind];
+    size_t size;
+    uint8_t *data = read_file(input, &size);
+    if (data == NULL) {
+        fail("couldn't read %s", input);
+    }
+    const struct coverage_header *header = (const struct coverage_header *)data;
+    if (size < sizeof(*header) || header->magic != COVERAGE_MAGIC) {
+        fail("%s is not a coverage file", input);
+    }
+    if (header->version != COVERAGE_VERSION) {
+        fail("%s has an unsupported version", input);
+    }
+
+    const uint8_t *p = data + sizeof(*header), *end = data + size;
+    for (uint32_t i = 0; i < header->image_count; i++) {
+        const struct coverage_image_header *image = (const struct coverage_image_header *)p;
+        if (p + sizeof(*image) > end) {
+            fail("truncated image in %s", input);
+        }
+        const char *path_bytes = (const char *)(image + 1);
+        const uint32_t *counters = (const uint32_t *)(path_bytes + (image->path_length + 7) / 8 * 8);
+        p = (const uint8_t *)(counters + image->text_size / 4);
+        if (p > end) {
+            fail("truncated image in %s", input);
+        }
+        char *path = strndup(path_bytes, image->path_length);
+        print_image(image, path, counters, top);
+        free(path);
+    }
+    return 0;
+}
@@ -0,0 +1,278 @@
+//
+//  print_trace.c
+//  aah
+//
+//  Prints a trace written with TRACE_FILE (see Sources/trace.h) as
+//  disassembly, reading the code and symbols from the traced images.
+//
+//  usage: print_trace trace.bin
+//  build: cc -Icapstone/include Tools/print_trace.c lib/libcapstone-aah.a -o print_trace
+//
+//  Images must be the same files that were traced, thin 64-bit Mach-O.
+//  Each block is disassembled once, and printed from the cache afterwards.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <capstone/capstone.h>
+#include "../Sources/trace.h"
+#define TOOL_NAME "print_trace"
+#include "tools.h"
+
+// MARK: images
+
+struct image {
+    uint64_t header; // where it was loaded
+    char *path;
+    uint8_t *file;
+    size_t file_size;
+    int64_t slide;
+    const struct segment_command_64 **segments;
+    uint32_t segment_count;
+    struct macho_symbol *symbols; // sorted by address
+    uint32_t symbol_count;
+};
+
+static struct image *images = NULL;
+static uint32_t image_count = 0;
+
+static int compare_symbols(const void *a, const void *b) {
+    const struct macho_symbol *sa = a, *sb = b;
+    return sa->address < sb->address ? -1 : sa->address > sb->address;
+}
+
+static void load_image(struct image *image) {
+    image->file = read_file(image->path, &image->file_size);
+    if (image->file == NULL) {
+        fprintf(stderr, "print_trace: couldn't read %s, its blocks won't be disassembled\n", image->path);
+        return;
+    }
+    const struct mach_header_64 *mh = (const struct mach_header_64 *)image->file;
+    if (image->file_size < sizeof(*mh) || mh->magic != MH_MAGIC_64) {
+        fprintf(stderr, "print_trace: %s is not a thin 64-bit Mach-O\n", image->path);
+        free(image->file);
+        image->file = NULL;
+        return;
+    }
+
+    const struct load_command *lc = (const struct load_command *)(mh + 1);
+    for (uint32_t i = 0; i < mh->ncmds; i++, lc = macho_next_command(lc)) {
+        if (lc->cmd == LC_SEGMENT_64) {
+            const struct segment_command_64 *seg = (const struct segment_command_64 *)lc;
+            if (seg->fileoff == 0 && seg->filesize) {
+                // the segment containing the header
+                image->slide = image->header - seg->vmaddr;
+            }
+            image->segments = xrealloc(image->segments, (image->segment_count + 1) * sizeof(*image->segments));
+            image->segments[image->segment_count++] = seg;
+        }
+    }
+    image->symbols = macho_defined_symbols(mh, image->file, image->slide, &image->symbol_count);
+    qsort(image->symbols, image->symbol_count, sizeof(struct macho_symbol), compare_symbols);
+}
+
+static void unload_image(struct image *image) {
+    free(image->path);
+    free(image->file);
+    free(image->segments);
+    free(image->symbols);
+}
+
+static struct image * image_containing(uint64_t address, const struct segment_command_64 **segment) {
+    for (uint32_t i = 0; i < image_count; i++) {
+        struct image *image = &images[i];
+        for (uint32_t s = 0; image->file && s < image->segment_count; s++) {
+            const struct segment_command_64 *seg = image->segments[s];
+            uint64_t start = seg->vmaddr + image->slide;
+            if (address >= start && address - start < seg->filesize) {
+                *segment = seg;
+                return image;
+            }
+        }
+    }
+    return NULL;
+}
+
+static const struct macho_symbol * symbol_before(const struct image *image, uint64_t address) {
+    // last symbol at or before address
+    uint32_t lo = 0, hi = image->symbol_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (image->symbols[mid].address <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? &image->symbols[lo - 1] : NULL;
+}
+
+// MARK: decode cache
+
+struct block {
+    uint64_t address;
+    uint32_t size;
+    size_t count;
+    cs_insn *insn;
+};
+
+static struct block *blocks = NULL;
+static size_t block_capacity = 0, block_count = 0;
+static csh capstone;
+
+static size_t block_slot(uint64_t address, uint32_t size) {
+    size_t slot = (address >> 2) * 0x9e3779b97f4a7c15ULL & (block_capacity - 1);
+    while (blocks[slot].address && !(blocks[slot].address == address && blocks[slot].size == size)) {
+        slot = (slot + 1) & (block_capacity - 1);
+    }
+    return slot;
+}
+
+static struct block * decode_block(uint64_t address, uint32_t size) {
+    if (block_count * 2 >= block_capacity) {
+        struct block *old = blocks;
+        size_t old_capacity = block_capacity;
+        block_capacity = block_capacity ? block_capacity * 2 : 4096;
+        blocks = calloc(block_capacity, sizeof(struct block));
+        if (blocks == NULL) {
+            fail("out of memory%s", "");
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].address) {
+                blocks[block_slot(old[i].address, old[i].size)] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    struct block *block = &blocks[block_slot(address, size)];
+    if (block->address) {
+        return block;
+    }
+    block->address = address;
+    block->size = size;
+    block_count++;
+    const struct segment_command_64 *seg;
+    struct image *image = image_containing(address, &seg);
+    if (image) {
+        uint64_t offset = seg->fileoff + (address - image->slide - seg->vmaddr);
+        if (offset + size <= image->file_size) {
+            block->count = cs_disasm(capstone, image->file + offset, size, address, 0, &block->insn);
+        }
+    }
+    return block;
+}
+
+// decoded blocks can belong to a removed image
+static void clear_blocks(void) {
+    for (size_t i = 0; i < block_capacity; i++) {
+        if (blocks[i].count) {
+            cs_free(blocks[i].insn, blocks[i].count);
+        }
+    }
+    memset(blocks, 0, block_capacity * sizeof(struct block));
+    block_count = 0;
+}
+
+// MARK: printing
+
+static void print_symbol(uint64_t address) {
+    const struct segment_command_64 *seg;
+    const struct image *image = image_containing(address, &seg);
+    const struct macho_symbol *symbol = image ? symbol_before(image, address) : NULL;
+    if (symbol) {
+        printf("%s+%llu", symbol->name, (unsigned long long)(address - symbol->address));
+    } else {
+        printf("0x%llx", (unsigned long long)address);
+    }
+}
+
+static void print_block(const struct trace_record *record, bool regs) {
+    struct block *block = decode_block(record->address, record->size);
+    printf("[%llu] ", (unsigned long long)record->thread);
+    print_symbol(record->address);
+    printf("\n");
+    if (regs) {
+        static const char *names[TRACE_REG_COUNT] = {"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "sp", "lr"};
+        printf("   ");
+        for (int i = 0; i < TRACE_REG_COUNT; i++) {
+            printf(" %s:0x%llx", names[i], (unsigned long long)record->regs[i]);
+        }
+        printf("\n");
+    }
+    if (block->count == 0) {
+        printf("    0x%llx: (%u bytes, no code)\n", (unsigned long long)record->address, record->size);
+    }
+    for (size_t i = 0; i < block->count; i++) {
+        printf("    0x%llx: %s %s\n", (unsigned long long)block->insn[i].address, block->insn[i].mnemonic, block->insn[i].op_str);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+        return 1;
+    }
+    size_t size;
+    uint8_t *trace = read_file(argv[1], &size);
+    if (trace == NULL) {
+        fail("couldn't read %s", argv[1]);
+    }
+    const struct trace_header *header = (const struct trace_header *)trace;
+    if (size < sizeof(*header) || header->magic != TRACE_MAGIC) {
+        fail("%s is not a trace", argv[1]);
+    }
+    if (header->version != TRACE_VERSION || header->record_size < sizeof(struct trace_record)) {
+        fail("%s has an unsupported version", argv[1]);
+    }
+    bool regs = header->flags & TRACE_FLAG_REGS;
+    if (cs_open(CS_ARCH_ARM64, CS_MODE_LITTLE_ENDIAN, &capstone) != CS_ERR_OK) {
+        fail("couldn't open capstone%s", "");
+    }
+
+    const uint8_t *end = trace + size;
+    for (const uint8_t *p = trace + sizeof(*header); p + header->record_size <= end; p += header->record_size) {
+        const struct trace_record *record = (const struct trace_record *)p;
+        switch (record->kind) {
+            case TRACE_BLOCK:
+                print_block(record, regs);
+                break;
+            case TRACE_IMAGE: {
+                // before the blocks that ran in it
+                uint32_t path_records = (record->size + header->record_size - 1) / header->record_size;
+                if (p + (1 + path_records) * header->record_size > end) {
+                    fail("truncated image record in %s", argv[1]);
+                }
+                images = xrealloc(images, (image_count + 1) * sizeof(struct image));
+                struct image *image = &images[image_count++];
+                memset(image, 0, sizeof(*image));
+                image->header = record->address;
+                image->path = strndup((const char *)p + header->record_size, record->size);
+                load_image(image);
+                printf("image %s at 0x%llx\n", image->path, (unsigned long long)image->header);
+                p += path_records * header->record_size;
+                break;
+            }
+            case TRACE_IMAGE_REMOVED:
+                // after the blocks that ran in it, another image can be loaded at the same address
+                for (uint32_t i = 0; i < image_count; i++) {
+                    if (images[i].header == record->address) {
+                        printf("image %s removed\n", images[i].path);
+                        unload_image(&images[i]);
+                        images[i] = images[--image_count];
+                        clear_blocks();
+                        break;
+                    }
+                }
+                break;
+            case TRACE_DROPPED:
+                printf("[%llu] %llu blocks dropped\n", (unsigned long long)record->thread, (unsigned long long)record->address);
+                break;
+            default:
+                fail("unknown record in %s", argv[1]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+//
+//  tools.h
+//  aah
+//
+//  Helpers shared by the tools, each is built from a single file.
+//  Define TOOL_NAME before including it.
+//
+
+#ifndef tools_h
+#define tools_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../Sources/macho_symbols.h"
+
+static inline void fail(const char *fmt, const char *arg) {
+    fprintf(stderr, TOOL_NAME ": ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static inline void * xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL && size) {
+        fail("out of memory%s", "");
+    }
+    return ptr;
+}
+
+// NULL if it can't be read
+static inline void * read_file(const char *path, size_t *size) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    void *data = xrealloc(NULL, *size);
+    if (fread(data, 1, *size, fp) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+#endif /* tools_h */